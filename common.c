@@ -14,6 +14,7 @@
 #include "./macros.h"
 #include "./zsock.h"
 #include "./zreactor.h"
+#include "./zstore.h"
 #include "./common.h"
 
 static void
@@ -81,6 +82,14 @@ uuid_randomize(gchar *d, gsize dl)
         d[dl-1] = g_ascii_toupper(d[dl-1]);
 }
  
+/* Location of the process, compared by the "near:N" connect policy */
+static const gchar *
+_get_cell(void)
+{
+    const gchar *cell = g_getenv("ZFLOWS_CELL");
+    return (cell && *cell) ? cell : "localhost";
+}
+
 void
 main_set_log_handlers(void)
 {
@@ -111,20 +120,141 @@ main_set_log_handlers(void)
     g_log_set_default_handler(logger_stderr, NULL);
 }
 
+static guint stats_period = 0; // ms
+static int nb_created = 0; // reactors
+
+static void
+_zreactor_dump_stats(struct zreactor_s *zr)
+{
+    struct zreactor_stats_s *st = zreactor_get_stats(zr, TRUE);
+
+    g_message("REACTOR %p loops=%"G_GUINT64_FORMAT" wakeups=%"G_GUINT64_FORMAT
+            " events/wakeup p50=%"G_GUINT64_FORMAT" p99=%"G_GUINT64_FORMAT
+            " wait(ns) p50=%"G_GUINT64_FORMAT" p99=%"G_GUINT64_FORMAT
+            " zk=%"G_GUINT64_FORMAT" zk(ns) p99=%"G_GUINT64_FORMAT
+            " max=%"G_GUINT64_FORMAT" spin_hits=%"G_GUINT64_FORMAT,
+            zr, st->loops, st->wakeups,
+            zhisto_percentile(&st->events, 50),
+            zhisto_percentile(&st->events, 99),
+            zhisto_percentile(&st->poll_wait, 50),
+            zhisto_percentile(&st->poll_wait, 99),
+            st->zk_process, zhisto_percentile(&st->zk_duration, 99),
+            st->zk_duration.max, st->spin_hits);
+
+    for (guint i=0; i < st->monitors->len ;++i) {
+        struct zmon_stats_s *ms = st->monitors->pdata[i];
+        if (!ms->duration.count)
+            continue;
+        g_message("REACTOR %p [%s] calls=%"G_GUINT64_FORMAT
+                " handler(ns) p50=%"G_GUINT64_FORMAT" p99=%"G_GUINT64_FORMAT
+                " p999=%"G_GUINT64_FORMAT" max=%"G_GUINT64_FORMAT,
+                zr, ms->name, ms->duration.count,
+                zhisto_percentile(&ms->duration, 50),
+                zhisto_percentile(&ms->duration, 99),
+                zhisto_percentile(&ms->duration, 99.9),
+                ms->duration.max);
+    }
+
+    zreactor_stats_free(st);
+    zreactor_add_timer(zr, stats_period,
+            (zreactor_fn_timer)_zreactor_dump_stats, zr);
+}
+
+static struct zreactor_s *
+_zreactor_create(void)
+{
+    struct zreactor_s *zr;
+
+    // "epoll" (Linux), zmq_poll() otherwise
+    const gchar *backend = g_getenv("ZFLOWS_REACTOR");
+    if (backend && !g_ascii_strcasecmp(backend, "epoll"))
+        zr = zreactor_create_backend(ZRB_EPOLL);
+    else
+        zr = zreactor_create();
+
+    const gchar *budget = g_getenv("ZFLOWS_BUDGET");
+    if (budget) {
+        gint64 v = g_ascii_strtoll(budget, NULL, 10);
+        if (v > 0 && v <= G_MAXUINT)
+            zreactor_set_budget(zr, v);
+        else
+            g_warning("ZFLOWS_BUDGET [%s] ignored", budget);
+    }
+
+    // Busy polling, in microseconds, and the CPU of the first reactor. The
+    // next ones (shards) are pinned on the next CPUs.
+    const gchar *spin = g_getenv("ZFLOWS_BUSY_POLL");
+    if (spin) {
+        gint64 v = g_ascii_strtoll(spin, NULL, 10);
+        if (v >= 0 && v <= G_USEC_PER_SEC)
+            zreactor_set_busy_poll(zr, v);
+        else
+            g_warning("ZFLOWS_BUSY_POLL [%s] ignored", spin);
+    }
+    // Within the 1024 CPUs of a cpu_set_t
+    const gchar *cpu = g_getenv("ZFLOWS_CPU");
+    if (cpu) {
+        gint64 v = g_ascii_strtoll(cpu, NULL, 10) + (nb_created++);
+        if (v >= 0 && v < 1024)
+            zreactor_set_cpu(zr, v);
+        else
+            g_warning("ZFLOWS_CPU [%s] ignored", cpu);
+    }
+
+    // Periodic dump of the stats, in seconds
+    const gchar *period = g_getenv("ZFLOWS_STATS");
+    if (period && 0 < (stats_period = 1000 * atoi(period))) {
+        zreactor_enable_stats(zr, TRUE);
+        zreactor_add_timer(zr, stats_period,
+                (zreactor_fn_timer)_zreactor_dump_stats, zr);
+    }
+    return zr;
+}
+
 void
 zenv_init(struct zenv_s *zenv)
 {
     ASSERT(zenv != NULL);
 
-    memset(zenv, 0, sizeof(struct zsrv_env_s));
+    memset(zenv, 0, sizeof(struct zenv_s));
+
+    const gchar *disco = g_getenv("ZFLOWS_DISCOVERY");
+    if (!disco)
+        disco = "zk://127.0.0.1:2181";
+    zenv->store = zstore_open(disco);
+    if (!zenv->store)
+        g_error("Discovery backend error [%s]", disco);
+
+    // Publication and refresh of the load, in seconds
+    const gchar *load = g_getenv("ZFLOWS_LOAD_PERIOD");
+    if (load && atoi(load) > 0)
+        zsock_set_load_period(1000 * atoi(load));
+
+    // Pacing of the connections, per second and jitter in milliseconds
+    const gchar *rate = g_getenv("ZFLOWS_CONNECT_RATE");
+    const gchar *jitter = g_getenv("ZFLOWS_CONNECT_JITTER");
+    gint64 vrate = rate ? g_ascii_strtoll(rate, NULL, 10) : 0;
+    gint64 vjitter = jitter ? g_ascii_strtoll(jitter, NULL, 10) : 0;
+    if (vrate < 0 || vrate > G_MAXUINT) {
+        g_warning("ZFLOWS_CONNECT_RATE [%s] ignored", rate);
+        vrate = 0;
+    }
+    if (vjitter < 0 || vjitter > G_MAXUINT) {
+        g_warning("ZFLOWS_CONNECT_JITTER [%s] ignored", jitter);
+        vjitter = 0;
+    }
+    if (vrate || vjitter)
+        zsock_set_connect_pacing(vrate, vjitter);
 
-    zenv->zh = zookeeper_init("127.0.0.1:2181", NULL, 5000, NULL, NULL, 0);
-    ASSERT(zenv->zh != NULL);
+    // Peers kept after they vanished, in milliseconds
+    const gchar *grace = g_getenv("ZFLOWS_CONNECT_GRACE");
+    if (grace && atoi(grace) > 0)
+        zsock_set_connect_grace(atoi(grace));
 
     zenv->zctx = zmq_ctx_new();
     ASSERT(zenv->zctx != NULL);
 
-    zenv->zr = zreactor_create();
+    zenv->zr = _zreactor_create();
     ASSERT(zenv->zr != NULL);
 }
 
@@ -133,27 +263,129 @@ zenv_close(struct zenv_s *zenv)
 {
     ASSERT(zenv != NULL);
 
+    // First, the completions of the closing may still target the reactor
+    zstore_close(zenv->store);
     zreactor_destroy(zenv->zr);
     zmq_ctx_destroy(zenv->zctx);
-    zookeeper_close(zenv->zh);
 }
 
 void
 zsrv_env_init(const gchar *type, struct zsrv_env_s *ctx)
 {
     zenv_init(&ctx->zenv);
+    ctx->shards = g_ptr_array_new();
+    ctx->threads = g_ptr_array_new();
 
     // Create the service and bind it to the environment
-    ctx->zsrv = zservice_create(ctx->zenv.zctx, ctx->zenv.zh, type);
+    ctx->zsrv = zservice_create(ctx->zenv.zctx, ctx->zenv.store, type);
     ASSERT(ctx->zsrv != NULL);
 
-    // TODO get the UUID and the CELL from a configuration
+    const gchar *str_shards = g_getenv("ZFLOWS_SHARDS");
+    gint64 nb_shards = str_shards ? g_ascii_strtoll(str_shards, NULL, 10) : 1;
+    if (nb_shards < 1 || nb_shards > 256) {
+        g_warning("ZFLOWS_SHARDS [%s] ignored", str_shards);
+        nb_shards = 1;
+    }
+
+    // ZooKeeper apart from the data plane, run by a dedicated control
+    // reactor. The multi-threaded client has its own I/O and completion
+    // threads, that hand the callbacks to that reactor.
+#ifdef HAVE_ZK_MT
+    gboolean apart = TRUE;
+#else
+    const gchar *str_zk = g_getenv("ZFLOWS_ZK_THREAD");
+    gboolean apart = str_zk && atoi(str_zk);
+#endif
+
+    if (nb_shards > 1 || apart) {
+        zservice_add_shard(ctx->zsrv, ctx->zenv.zr);
+        for (gint64 i=1; i < nb_shards ;++i) {
+            struct zreactor_s *zr = _zreactor_create();
+            g_ptr_array_add(ctx->shards, zr);
+            zservice_add_shard(ctx->zsrv, zr);
+        }
+    }
+
+    // TODO get the UUID from a configuration
     uuid_randomize(ctx->zsrv->uuid, sizeof(ctx->zsrv->uuid));
-    g_strlcpy(ctx->zsrv->cell, "localhost", sizeof(ctx->zsrv->cell));
+    g_strlcpy(ctx->zsrv->cell, _get_cell(), sizeof(ctx->zsrv->cell));
+
+    // Last known configuration and peers, applied by zsrv_env_run()
+    const gchar *str_cache = g_getenv("ZFLOWS_CACHE");
+    if (str_cache) {
+        gchar *path = g_strdup_printf("%s/%s.zcache", str_cache, type);
+        zservice_use_cache(ctx->zsrv, path);
+        g_free(path);
+    }
+
+    if (apart)
+        ctx->control = _zreactor_create();
+    zstore_attach(ctx->zenv.store, ctx->control ? ctx->control : ctx->zenv.zr);
+}
+
+struct zshard_run_s
+{
+    struct zsrv_env_s *ctx;
+    struct zreactor_s *zr;
+};
+
+/* The first reactor exiting stops the others */
+static gpointer
+_shard_run(gpointer p)
+{
+    struct zshard_run_s *run = p;
+    int rc = zreactor_run(run->zr);
+    zsrv_env_stop(run->ctx);
+    g_free(run);
+    return GINT_TO_POINTER(rc);
+}
+
+static void
+_shard_start(struct zsrv_env_s *ctx, const gchar *name, struct zreactor_s *zr)
+{
+    struct zshard_run_s *run = g_malloc0(sizeof(struct zshard_run_s));
+    run->ctx = ctx;
+    run->zr = zr;
+    g_ptr_array_add(ctx->threads, g_thread_new(name, _shard_run, run));
+}
 
-    zservice_register_in_reactor(ctx->zenv.zr, ctx->zsrv);
+int
+zsrv_env_run(struct zsrv_env_s *ctx)
+{
+    ASSERT(ctx != NULL);
+
+    // The hooks of the service are known now. Starting from the cache
+    // before asking ZooKeeper, its answers can only come after.
+    struct zreactor_s *zk_zr = ctx->control ? ctx->control : ctx->zenv.zr;
+    zservice_start_from_cache(ctx->zsrv, zk_zr);
+    zservice_register_in_reactor(zk_zr, ctx->zsrv);
+
+    for (guint i=0; i < ctx->shards->len ;++i)
+        _shard_start(ctx, "zshard", ctx->shards->pdata[i]);
+    if (ctx->control)
+        _shard_start(ctx, "zcontrol", ctx->control);
 
-    zreactor_add_zk(ctx->zenv.zr, ctx->zenv.zh);
+    int rc = zreactor_run(ctx->zenv.zr);
+
+    zsrv_env_stop(ctx);
+    for (guint i=0; i < ctx->threads->len ;++i) {
+        int th_rc = GPOINTER_TO_INT(g_thread_join(ctx->threads->pdata[i]));
+        if (!rc)
+            rc = th_rc;
+    }
+    g_ptr_array_set_size(ctx->threads, 0);
+    return rc;
+}
+
+void
+zsrv_env_stop(struct zsrv_env_s *ctx)
+{
+    ASSERT(ctx != NULL);
+    zreactor_stop(ctx->zenv.zr);
+    for (guint i=0; i < ctx->shards->len ;++i)
+        zreactor_stop(ctx->shards->pdata[i]);
+    if (ctx->control)
+        zreactor_stop(ctx->control);
 }
 
 void
@@ -161,6 +393,14 @@ zsrv_env_close(struct zsrv_env_s *ctx)
 {
     ASSERT(ctx != NULL);
     zservice_destroy(ctx->zsrv);
+    zstore_close(ctx->zenv.store);
+    ctx->zenv.store = NULL;
+    for (guint i=0; i < ctx->shards->len ;++i)
+        zreactor_destroy(ctx->shards->pdata[i]);
+    if (ctx->control)
+        zreactor_destroy(ctx->control);
+    g_ptr_array_free(ctx->shards, TRUE);
+    g_ptr_array_free(ctx->threads, TRUE);
     zenv_close(&ctx->zenv);
 }
 
@@ -173,9 +413,9 @@ zclt_env_init(const gchar *typename, const gchar *target, struct zclt_env_s *ctx
     memset(ctx, 0, sizeof(*ctx));
     zenv_init(&ctx->zenv);
 
-    // TODO Get the UUID and the CELL from the configuration
+    // TODO Get the UUID from the configuration
     uuid_randomize(ctx->uuid, sizeof(ctx->uuid)-1);
-    g_strlcpy(ctx->cell, "localhost", sizeof(ctx->cell)-1);
+    g_strlcpy(ctx->cell, _get_cell(), sizeof(ctx->cell)-1);
 
     // Now open the zsocket itself
     int ztype = 0;
@@ -190,14 +430,26 @@ zclt_env_init(const gchar *typename, const gchar *target, struct zclt_env_s *ctx
     ASSERT(ctx->zsock != NULL);
 
     ctx->zsock->zs = zmq_socket(ctx->zenv.zctx, ztype);
-    ctx->zsock->zh = ctx->zenv.zh;
+    ctx->zsock->store = ctx->zenv.store;
     ctx->zsock->zctx = ctx->zenv.zctx;
     ctx->zsock->fullname = g_strdup("client");
+    ctx->zsock->zk_zr = ctx->zenv.zr;
     zsock_connect(ctx->zsock, target, "all");
 
+    // Envelopes of the messages sent: bytes[,count[,delay]]
+    const gchar *batch = g_getenv("ZFLOWS_BATCH");
+    if (batch) {
+        guint v[3] = {0, 0, 0};
+        gchar **tokens = g_strsplit(batch, ",", 3);
+        for (guint i=0; i < 3 && tokens[i] ;++i)
+            v[i] = MAX(0, atoi(tokens[i]));
+        g_strfreev(tokens);
+        zsock_set_batch(ctx->zsock, v[0], v[1], v[2]);
+    }
+
     // bind them
     zsock_register_in_reactor(ctx->zenv.zr, ctx->zsock);
-    zreactor_add_zk(ctx->zenv.zr, ctx->zenv.zh);
+    zstore_attach(ctx->zenv.store, ctx->zenv.zr);
 }
 
 void
@@ -11,13 +11,18 @@ void main_set_log_handlers(void);
 
 // Environment common to all entities
 
+struct zstore_s;
+
 struct zenv_s
 {
-    zhandle_t *zh; // ZooKeeper handle
+    struct zstore_s *store; // configuration and discovery
     void *zctx; // ZeroMQ context
     struct zreactor_s *zr;
 };
 
+/* The backend of the configuration and of the discovery is read in the
+ * ZFLOWS_DISCOVERY variable of the environment (see zstore.h), it defaults
+ * to the ZooKeeper of the local host. */
 void zenv_init(struct zenv_s *zenv);
 
 void zenv_close(struct zenv_s *zenv);
@@ -29,10 +34,33 @@ struct zsrv_env_s
 {
     struct zenv_s zenv;
     struct zservice_s *zsrv;
+
+    // Extra data-plane reactors, each run by its own thread, while
+    // zenv.zr (and ZooKeeper) is run by the thread calling zsrv_env_run().
+    GPtrArray *shards; // (struct zreactor_s*)
+    GPtrArray *threads; // (GThread*)
+
+    // Runs the single-threaded ZooKeeper client in its own thread, when
+    // the control plane is apart (NULL otherwise).
+    struct zreactor_s *control;
 };
 
+/* The number of reactors is read in the ZFLOWS_SHARDS variable of the
+ * environment, it defaults to 1. ZFLOWS_ZK_THREAD=1 moves ZooKeeper to a
+ * control-plane thread, the sockets then only live in data-plane reactors
+ * (always the case with the multi-threaded client, HAVE_ZK_MT, whose
+ * callbacks are handed to that thread). */
 void zsrv_env_init(const gchar *type, struct zsrv_env_s *ctx);
 
+/* Starts the service, from the cache if ZFLOWS_CACHE names a directory
+ * where a previous run left it, then runs all the reactors. The first one
+ * exiting stops the others, returns once they all exited: 0 unless one of
+ * them failed. */
+int zsrv_env_run(struct zsrv_env_s *ctx);
+
+/* Can be called from any thread, and from a signal handler */
+void zsrv_env_stop(struct zsrv_env_s *ctx);
+
 void zsrv_env_close(struct zsrv_env_s *ctx);
 
 
@@ -3,6 +3,7 @@
 #endif
 
 #include <stdlib.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -19,19 +20,29 @@
 
 static struct zclt_env_s ctx;
 static int in_evt = 0;
+static struct zmon_s *in_mon = NULL;
+static gchar *line = NULL; // read but refused by the socket, sent first
+
+static inline void
+_set_input_events(int evt)
+{
+    in_evt = evt;
+    if (in_mon)
+        zreactor_mark_dirty(ctx.zenv.zr, in_mon);
+}
 
 static void
 _manage_out(struct zsock_s *zs)
 {
-    in_evt = ZMQ_POLLIN;
+    _set_input_events(ZMQ_POLLIN);
     g_debug("ZSOCK [%s] ready for output", zs->fullname);
 }
 
 static inline void
 _wait_for_output(struct zsock_s *zs)
 {
-    zs->evt = ZMQ_POLLOUT;
     zs->ready_out = _manage_out;
+    zsock_set_events(zs, ZMQ_POLLOUT);
 }
 
 static int
@@ -43,33 +54,46 @@ on_input(void *c, int fd, int evt)
 
     if (!zsock_ready(ctx.zsock)) {
         g_debug("Output not ready");
-        in_evt = 0;
+        _set_input_events(0);
         _wait_for_output(ctx.zsock);
         return 0;
     }
 
-    if (ferror(in) || feof(in)) {
-        g_debug("EOF!");
-        zreactor_stop(ctx.zenv.zr);
-        return -1;
-    }
-
-    if (!(s = fgets(b, sizeof(b), in))) {
-        g_debug("EOF!");
-        zreactor_stop(ctx.zenv.zr);
-        return -1;
+    if (!line) {
+        if (ferror(in) || feof(in)) {
+            g_debug("EOF!");
+            zreactor_stop(ctx.zenv.zr);
+            return -1;
+        }
+        if (!(s = fgets(b, sizeof(b), in))) {
+            g_debug("EOF!");
+            zreactor_stop(ctx.zenv.zr);
+            return -1;
+        }
+        int n = strlen(s);
+        for (; n > 0 && g_ascii_isspace(s[n-1]) ;--n) {}
+        line = g_strndup(s, n);
     }
 
     zmq_msg_t msg;
-    int l = strlen(s);
-    for (; g_ascii_isspace(s[l-1]) ;--l) {}
+    int l = strlen(line);
     zmq_msg_init_size(&msg, l);
-    memcpy(zmq_msg_data(&msg), s, zmq_msg_size(&msg));
-    int rc = zmq_sendmsg(ctx.zsock->zs, &msg, ZMQ_DONTWAIT);
+    memcpy(zmq_msg_data(&msg), line, zmq_msg_size(&msg));
+    int rc = zsock_send(ctx.zsock, &msg, 0);
     zmq_msg_close(&msg);
 
-    (void) rc;
-    ASSERT(rc == l);
+    // The envelopes may need more room than announced, the line waits
+    if (rc < 0 && errno == EAGAIN) {
+        g_debug("Output full");
+        _set_input_events(0);
+        _wait_for_output(ctx.zsock);
+        return 0;
+    }
+    if (rc < 0)
+        g_warning("Line dropped : (%d) %s", errno, zmq_strerror(errno));
+    ASSERT(rc < 0 || rc == l);
+    g_free(line);
+    line = NULL;
     return 0;
 }
 
@@ -96,7 +120,7 @@ main(int argc, char **argv)
     _wait_for_output(ctx.zsock);
 
     fcntl(0, F_SETFL, O_NONBLOCK|fcntl(0, F_GETFL));
-    zreactor_add_fd(ctx.zenv.zr, 0, &in_evt, on_input, stdin);
+    in_mon = zreactor_add_fd(ctx.zenv.zr, 0, &in_evt, on_input, stdin);
     int rc = zreactor_run(ctx.zenv.zr);
     zclt_env_close(&ctx);
     return rc != 0;
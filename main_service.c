@@ -31,7 +31,7 @@ _skip_tail(struct zsock_s *zs)
     for (count=0;  ;++count) {
         zmq_msg_t msg;
         zmq_msg_init(&msg);
-        int rc = zmq_msg_recv(&msg, zs->zs, ZMQ_NOBLOCK);
+        int rc = zsock_recv(zs, &msg);
         if (rc < 0)
             break;
         //g_debug("ZSOCK [%s] -> %d [%.*s]", zs->fullname, rc,
@@ -68,7 +68,7 @@ _on_event_out1(struct zsock_s *zs)
 static void
 sighandler_stop(int s)
 {
-    zreactor_stop(ctx.zenv.zr);
+    zsrv_env_stop(&ctx);
     signal(s, sighandler_stop);
 }
 
@@ -80,19 +80,19 @@ _on_zservice_configured(struct zservice_s *zsrv, gpointer u)
 
     zs_in0 = zservice_get_socket(zsrv, "in0");
     zs_in0->ready_in = _on_event_in0;
-    zs_in0->evt = ZMQ_POLLIN;
+    zsock_set_events(zs_in0, ZMQ_POLLIN);
 
     zs_in1 = zservice_get_socket(zsrv, "in1");
     zs_in1->ready_in = _on_event_in1;
-    zs_in1->evt = ZMQ_POLLIN;
+    zsock_set_events(zs_in1, ZMQ_POLLIN);
 
     zs_out0 = zservice_get_socket(zsrv, "out0");
     zs_out0->ready_out = _on_event_out0;
-    zs_out0->evt = ZMQ_POLLOUT;
+    zsock_set_events(zs_out0, ZMQ_POLLOUT);
 
     zs_out1 = zservice_get_socket(zsrv, "out1");
     zs_out1->ready_out = _on_event_out1;
-    zs_out1->evt = ZMQ_POLLOUT;
+    zsock_set_events(zs_out1, ZMQ_POLLOUT);
 }
 
 int
@@ -113,7 +113,7 @@ main(int argc, char **argv)
 
     zservice_on_config(ctx.zsrv, ctx.zsrv, _on_zservice_configured);
 
-    int rc = zreactor_run(ctx.zenv.zr);
+    int rc = zsrv_env_run(&ctx);
     zsrv_env_close(&ctx);
     return rc != 0;
 }
@@ -0,0 +1,122 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+#include <zmq.h>
+
+#include "./macros.h"
+#include "./zbatch.h"
+
+static void
+_zbatch_free_data(void *data, void *hint)
+{
+    (void) hint;
+    g_free(data);
+}
+
+static GByteArray *
+_zbatch_buffer(struct zbatch_s *b)
+{
+    GByteArray *buf = g_byte_array_sized_new(b->bytes + 4);
+    g_byte_array_append(buf, (guint8*)ZBATCH_MAGIC, ZBATCH_MAGIC_LEN);
+    return buf;
+}
+
+struct zbatch_s*
+zbatch_create(guint bytes, guint count, guint delay)
+{
+    struct zbatch_s *b = g_malloc0(sizeof(struct zbatch_s));
+    b->bytes = bytes ? bytes : ZBATCH_BYTES;
+    b->count = count ? count : ZBATCH_COUNT;
+    b->delay = delay ? delay : ZBATCH_DELAY;
+    b->buf = _zbatch_buffer(b);
+    zhisto_reset(&b->stats.sent);
+    return b;
+}
+
+void
+zbatch_destroy(struct zbatch_s *b)
+{
+    if (!b)
+        return;
+    ASSERT(b->timer == NULL);
+    if (b->has_sealed)
+        zmq_msg_close(&b->sealed);
+    g_byte_array_free(b->buf, TRUE);
+    g_free(b);
+}
+
+gboolean
+zbatch_fits(struct zbatch_s *b, gsize len)
+{
+    return !b->pending || (b->pending < b->count
+            && b->buf->len + 4 + len <= b->bytes);
+}
+
+gboolean
+zbatch_add(struct zbatch_s *b, const void *data, gsize len)
+{
+    ASSERT(len <= G_MAXUINT32);
+    guint32 nlen = htonl(len);
+    g_byte_array_append(b->buf, (guint8*)&nlen, 4);
+    g_byte_array_append(b->buf, data, len);
+    ++ b->pending;
+    return b->pending >= b->count || b->buf->len >= b->bytes;
+}
+
+void
+zbatch_seal(struct zbatch_s *b)
+{
+    ASSERT(!b->has_sealed);
+    ASSERT(b->pending > 0);
+
+    gsize len = b->buf->len;
+    guint8 *data = g_byte_array_free(b->buf, FALSE);
+    zmq_msg_init_data(&b->sealed, data, len, _zbatch_free_data, NULL);
+    b->has_sealed = TRUE;
+    zhisto_record(&b->stats.sent, b->pending);
+
+    b->buf = _zbatch_buffer(b);
+    b->pending = 0;
+}
+
+guint
+zbatch_check(zmq_msg_t *msg)
+{
+    gsize len = zmq_msg_size(msg);
+    const guint8 *data = zmq_msg_data(msg);
+    if (len < ZBATCH_MAGIC_LEN + 4
+            || memcmp(data, ZBATCH_MAGIC, ZBATCH_MAGIC_LEN))
+        return 0;
+
+    guint count = 0;
+    for (gsize at = ZBATCH_MAGIC_LEN; at < len ;++count) {
+        guint32 nlen;
+        if (len - at < 4)
+            return 0;
+        memcpy(&nlen, data + at, 4);
+        at += 4;
+        if (len - at < ntohl(nlen))
+            return 0;
+        at += ntohl(nlen);
+    }
+    return count;
+}
+
+gboolean
+zbatch_next(zmq_msg_t *env, gsize *at, zmq_msg_t *out)
+{
+    gsize len = zmq_msg_size(env);
+    const guint8 *data = zmq_msg_data(env);
+    if (*at >= len)
+        return FALSE;
+
+    guint32 nlen;
+    memcpy(&nlen, data + *at, 4);
+    nlen = ntohl(nlen);
+    zmq_msg_close(out);
+    zmq_msg_init_size(out, nlen);
+    memcpy(zmq_msg_data(out), data + *at + 4, nlen);
+    *at += 4 + nlen;
+    return TRUE;
+}
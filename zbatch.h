@@ -0,0 +1,60 @@
+#ifndef TECHFORUM_zbatch_h
+# define TECHFORUM_zbatch_h 1
+# include <glib.h>
+# include <zmq.h>
+# include "./zhisto.h"
+
+/* Envelope packing small single-frame messages in one frame: the magic,
+ * then for each message its size (4 bytes, network order) and its bytes.
+ * A frame is only taken for an envelope if its sizes exactly cover it. */
+
+# define ZBATCH_MAGIC "\xffZBATCH1"
+# define ZBATCH_MAGIC_LEN 8
+
+/* Defaults of the thresholds, see cfg_sock_s */
+# define ZBATCH_BYTES 8192
+# define ZBATCH_COUNT 256
+# define ZBATCH_DELAY 1
+
+struct zbatch_s
+{
+    guint bytes; // flushed when the envelope reaches that size
+    guint count; // ... or holds that many messages
+    guint delay; // ... or its first message waited that long (ms)
+
+    GByteArray *buf; // the envelope being filled
+    guint pending; // messages in 'buf'
+    zmq_msg_t sealed; // an envelope refused by the socket, sent first
+    gboolean has_sealed;
+    struct ztimer_s *timer; // the deadline of 'buf'
+
+    struct {
+        struct zhisto_s sent; // messages per envelope sealed
+        guint64 flushes_full; // sealed because of 'bytes' or 'count'
+        guint64 flushes_delay; // ... because of 'delay'
+    } stats;
+};
+
+struct zbatch_s* zbatch_create(guint bytes, guint count, guint delay);
+
+/* The envelope sealed and the messages pending are dropped */
+void zbatch_destroy(struct zbatch_s *b);
+
+/* TRUE if a message of 'len' bytes fits in the envelope being filled */
+gboolean zbatch_fits(struct zbatch_s *b, gsize len);
+
+/* Appends a message, TRUE if the envelope is then full */
+gboolean zbatch_add(struct zbatch_s *b, const void *data, gsize len);
+
+/* Turns the envelope being filled into 'b->sealed', without copy. Only
+ * when no envelope is sealed yet and messages are pending. */
+void zbatch_seal(struct zbatch_s *b);
+
+/* Number of messages packed in 'msg', 0 if it is not an envelope */
+guint zbatch_check(zmq_msg_t *msg);
+
+/* Copies into 'out' the message at '*at' in 'env', moves '*at' after it.
+ * FALSE once the end is reached. */
+gboolean zbatch_next(zmq_msg_t *env, gsize *at, zmq_msg_t *out);
+
+#endif // TECHFORUM_zbatch_h
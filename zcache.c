@@ -0,0 +1,283 @@
+#ifndef G_LOG_DOMAIN
+# define G_LOG_DOMAIN "zsock"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "./macros.h"
+#include "./zsock.h"
+#include "./zreactor.h"
+#include "./zcache.h"
+
+#define ZCACHE_MAGIC "ZFLOWS-CACHE 1"
+#define ZCACHE_PERIOD G_USEC_PER_SEC
+
+/* Lines of space-separated and URI-escaped fields:
+ *   ZCACHE_MAGIC
+ *   C <config>
+ *   P <socket> <type> [<url>...] */
+
+struct zcache_s
+{
+    GMutex lock;
+    gchar *path;
+    gchar *config;
+    GTree *peers; // "<socket> <type>" -> (gchar**)
+    gboolean dirty;
+    gint64 last_write;
+    GThreadPool *writer; // one thread, the snapshots written in order
+
+    struct zreactor_s *zr; // runs the deferred write, may be NULL
+    struct ztimer_s *timer; // ... in that reactor's thread only
+    gint armed; // a deferred write is due
+};
+
+static gchar *
+_escape(const gchar *s)
+{
+    return g_uri_escape_string(s, NULL, TRUE);
+}
+
+static gchar *
+_peers_key(const gchar *sock, const gchar *type)
+{
+    gchar *s = _escape(sock), *t = _escape(type);
+    gchar *k = g_strconcat(s, " ", t, NULL);
+    g_free(s);
+    g_free(t);
+    return k;
+}
+
+static void
+_parse_line(struct zcache_s *zc, const gchar *line)
+{
+    gchar **tokens = g_strsplit(line, " ", 0);
+    guint count = g_strv_length(tokens);
+
+    if (count == 2 && !strcmp(tokens[0], "C")) {
+        g_free(zc->config);
+        zc->config = g_uri_unescape_string(tokens[1], NULL);
+    }
+    else if (count >= 3 && !strcmp(tokens[0], "P")) {
+        GPtrArray *urlv = g_ptr_array_new();
+        for (guint i=3; i < count ;++i) {
+            gchar *url = g_uri_unescape_string(tokens[i], NULL);
+            if (url)
+                g_ptr_array_add(urlv, url);
+        }
+        g_ptr_array_add(urlv, NULL);
+        g_tree_replace(zc->peers, g_strconcat(tokens[1], " ", tokens[2], NULL),
+                g_ptr_array_free(urlv, FALSE));
+    }
+
+    g_strfreev(tokens);
+}
+
+static void
+_load(struct zcache_s *zc)
+{
+    GError *err = NULL;
+    GMappedFile *mf = g_mapped_file_new(zc->path, FALSE, &err);
+
+    if (!mf) {
+        g_debug("CACHE [%s] not loaded : %s", zc->path, err->message);
+        g_clear_error(&err);
+        return;
+    }
+
+    const gchar *b = g_mapped_file_get_contents(mf);
+    const gchar *end = b + g_mapped_file_get_length(mf);
+    gsize mlen = strlen(ZCACHE_MAGIC);
+
+    if ((gsize)(end - b) <= mlen || memcmp(b, ZCACHE_MAGIC, mlen)
+            || b[mlen] != '\n')
+        g_warning("CACHE [%s] ignored : invalid header", zc->path);
+    else {
+        for (b += mlen + 1; b < end ;) {
+            const gchar *eol = memchr(b, '\n', end - b);
+            if (!eol)
+                eol = end;
+            gchar *line = g_strndup(b, eol - b);
+            _parse_line(zc, line);
+            g_free(line);
+            b = eol + 1;
+        }
+        g_debug("CACHE [%s] loaded, %d targets", zc->path,
+                g_tree_nnodes(zc->peers));
+    }
+
+    g_mapped_file_unref(mf);
+}
+
+/* In the writer thread, the file is synced when replaced */
+static void
+_write(GString *gs, struct zcache_s *zc)
+{
+    GError *err = NULL;
+    if (!g_file_set_contents(zc->path, gs->str, gs->len, &err)) {
+        g_warning("CACHE [%s] not saved : %s", zc->path, err->message);
+        g_clear_error(&err);
+    }
+    g_string_free(gs, TRUE);
+}
+
+/* Snapshots the content, written aside by the writer thread. Called with
+ * the lock held. */
+static void
+_save(struct zcache_s *zc)
+{
+    GString *gs = g_string_new(ZCACHE_MAGIC "\n");
+
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        (void) u;
+        g_string_append_printf(gs, "P %s", (gchar*)k);
+        for (gchar **c = v; *c ;++c) {
+            gchar *url = _escape(*c);
+            g_string_append_printf(gs, " %s", url);
+            g_free(url);
+        }
+        g_string_append_c(gs, '\n');
+        return FALSE;
+    }
+
+    if (zc->config) {
+        gchar *cfg = _escape(zc->config);
+        g_string_append_printf(gs, "C %s\n", cfg);
+        g_free(cfg);
+    }
+    g_tree_foreach(zc->peers, runner, NULL);
+    g_thread_pool_push(zc->writer, gs, NULL);
+
+    zc->dirty = FALSE;
+    zc->last_write = g_get_monotonic_time();
+}
+
+struct zcache_s*
+zcache_open(const gchar *path)
+{
+    ASSERT(path != NULL);
+
+    struct zcache_s *zc = g_malloc0(sizeof(struct zcache_s));
+    g_mutex_init(&zc->lock);
+    zc->path = g_strdup(path);
+    zc->peers = g_tree_new_full(strcmp3, NULL, g_free,
+            (GDestroyNotify)g_strfreev);
+    zc->writer = g_thread_pool_new((GFunc)_write, zc, 1, FALSE, NULL);
+    _load(zc);
+    return zc;
+}
+
+void
+zcache_close(struct zcache_s *zc)
+{
+    if (!zc)
+        return;
+    if (zc->timer)
+        zreactor_cancel_timer(zc->zr, zc->timer);
+    zcache_flush(zc, TRUE);
+    // Waits for the writes queued
+    g_thread_pool_free(zc->writer, FALSE, TRUE);
+    g_tree_destroy(zc->peers);
+    g_free(zc->config);
+    g_free(zc->path);
+    g_mutex_clear(&zc->lock);
+    g_free(zc);
+}
+
+gchar*
+zcache_get_config(struct zcache_s *zc)
+{
+    ASSERT(zc != NULL);
+    g_mutex_lock(&zc->lock);
+    gchar *cfg = g_strdup(zc->config);
+    g_mutex_unlock(&zc->lock);
+    return cfg;
+}
+
+void
+zcache_set_config(struct zcache_s *zc, const gchar *b, gsize blen)
+{
+    ASSERT(zc != NULL);
+    g_mutex_lock(&zc->lock);
+    if (!zc->config || strlen(zc->config) != blen
+            || memcmp(zc->config, b, blen)) {
+        g_free(zc->config);
+        zc->config = g_strndup(b, blen);
+        zc->dirty = TRUE;
+    }
+    g_mutex_unlock(&zc->lock);
+}
+
+gchar**
+zcache_get_peers(struct zcache_s *zc, const gchar *sock, const gchar *type)
+{
+    ASSERT(zc != NULL);
+    gchar *k = _peers_key(sock, type);
+    g_mutex_lock(&zc->lock);
+    gchar **urlv = g_strdupv(g_tree_lookup(zc->peers, k));
+    g_mutex_unlock(&zc->lock);
+    g_free(k);
+    return urlv;
+}
+
+void
+zcache_set_peers(struct zcache_s *zc, const gchar *sock, const gchar *type,
+        gchar **urlv)
+{
+    ASSERT(zc != NULL);
+    g_mutex_lock(&zc->lock);
+    g_tree_replace(zc->peers, _peers_key(sock, type), g_strdupv(urlv));
+    zc->dirty = TRUE;
+    g_mutex_unlock(&zc->lock);
+}
+
+static void
+_zcache_on_timer(struct zcache_s *zc)
+{
+    zc->timer = NULL;
+    g_atomic_int_set(&zc->armed, 0);
+    zcache_flush(zc, FALSE);
+}
+
+static void
+_zcache_arm(struct zcache_s *zc)
+{
+    g_mutex_lock(&zc->lock);
+    gint64 left = zc->last_write + ZCACHE_PERIOD - g_get_monotonic_time();
+    g_mutex_unlock(&zc->lock);
+    zc->timer = zreactor_add_timer(zc->zr, MAX(left, 0) / 1000 + 1,
+            (zreactor_fn_timer)_zcache_on_timer, zc);
+}
+
+void
+zcache_flush(struct zcache_s *zc, gboolean force)
+{
+    ASSERT(zc != NULL);
+    gboolean deferred = FALSE;
+    g_mutex_lock(&zc->lock);
+    if (zc->dirty) {
+        if (force || g_get_monotonic_time() - zc->last_write >= ZCACHE_PERIOD)
+            _save(zc);
+        else
+            deferred = TRUE;
+    }
+    g_mutex_unlock(&zc->lock);
+
+    // Saved later even if nothing changes anymore
+    if (deferred && zc->zr
+            && g_atomic_int_compare_and_exchange(&zc->armed, 0, 1)) {
+        if (zreactor_is_current(zc->zr))
+            _zcache_arm(zc);
+        else
+            zreactor_post(zc->zr, (zreactor_fn_task)_zcache_arm, zc);
+    }
+}
+
+void
+zcache_attach(struct zcache_s *zc, struct zreactor_s *zr)
+{
+    ASSERT(zc != NULL);
+    zc->zr = zr;
+}
@@ -0,0 +1,41 @@
+#ifndef TECHFORUM_zcache_h
+# define TECHFORUM_zcache_h 1
+# include <glib.h>
+
+/* Last known configuration of a service and peers of its sockets, kept in a
+ * file to start without waiting for ZooKeeper. The file is memory-mapped at
+ * opening and atomically replaced when saved, by a thread of its own. All
+ * the functions can be called from any thread. */
+
+struct zcache_s;
+struct zreactor_s;
+
+/* Never NULL, the cache is empty if the file is missing or invalid. */
+struct zcache_s* zcache_open(const gchar *path);
+
+/* Saves the pending changes */
+void zcache_close(struct zcache_s *zc);
+
+/* A copy of the configuration, NULL if unknown */
+gchar* zcache_get_config(struct zcache_s *zc);
+
+void zcache_set_config(struct zcache_s *zc, const gchar *b, gsize blen);
+
+/* A copy of the URLs known for the target 'type' of the socket 'sock', NULL
+ * if unknown. */
+gchar** zcache_get_peers(struct zcache_s *zc, const gchar *sock,
+        const gchar *type);
+
+void zcache_set_peers(struct zcache_s *zc, const gchar *sock,
+        const gchar *type, gchar **urlv);
+
+/* Writes the file if it changed. Unless 'force', at most once per second:
+ * a change coming sooner is saved by a timer of the reactor attached, or
+ * else by a later call. */
+void zcache_flush(struct zcache_s *zc, gboolean force);
+
+/* The deferred writes are run by 'zr', that must outlive the cache or stop
+ * before it is closed. Called before 'zr' runs, or in its thread. */
+void zcache_attach(struct zcache_s *zc, struct zreactor_s *zr);
+
+#endif // TECHFORUM_zcache_h
@@ -0,0 +1,583 @@
+#ifndef G_LOG_DOMAIN
+# define G_LOG_DOMAIN "zsock"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <zookeeper.h>
+
+#include "./macros.h"
+#include "./zsock.h"
+#include "./zreactor.h"
+#include "./zdisco.h"
+#include "./zstore.h"
+
+#define ZK_DEBUG(FMT,...) g_log("ZK", G_LOG_LEVEL_DEBUG, FMT, ##__VA_ARGS__)
+
+struct zdisco_sub_s
+{
+    zdisco_fn fn;
+    gpointer u;
+};
+
+/* The context of the watch, that may outlive the entry: ZooKeeper offers
+ * no way to disarm it. */
+struct zdisco_watch_s
+{
+    struct zdisco_s *zd; // NULL once the entry is released
+};
+
+static GRecMutex registry_lock;
+static GHashTable *registry = NULL; // char* -> (struct zdisco_s*)
+
+static void on_get(int r, const char *v, int vl, const struct Stat *s, const void *u);
+static void on_list_completion(int r, const struct String_vector *sv, const void *u);
+static void on_list_change(zhandle_t *zh, int t, int s, const char *p, void *u);
+static void on_exists(int r, const struct Stat *s, const void *u);
+
+static void _zdisco_on_session(struct zdisco_s *zd);
+
+static void
+_zdisco_free(struct zdisco_s *zd)
+{
+    g_debug("DISCO [%s] released", zd->type);
+    if (zd->started)
+        zstore_remove_session_hook(zd->store,
+                (zstore_fn_session)_zdisco_on_session, zd);
+    if (zd->timer)
+        zreactor_cancel_timer(zd->zr, zd->timer);
+    if (zd->refresh_timer)
+        zreactor_cancel_timer(zd->zr, zd->refresh_timer);
+    // An armed watch frees its context when it fires
+    if (zd->watching)
+        zd->watch->zd = NULL;
+    else
+        g_free(zd->watch);
+    if (zd->children)
+        g_tree_destroy(zd->children);
+    if (zd->subs)
+        g_array_free(zd->subs, TRUE);
+    g_free(zd->type);
+    g_free(zd);
+}
+
+/* The last subscriber gone, the entry waits for the callbacks that still
+ * reference it. The registry must be locked. */
+static gboolean
+_zdisco_maybe_free(struct zdisco_s *zd)
+{
+    if (zd->subs->len)
+        return FALSE;
+    if (!zd->busy && !zd->list_pending && !zd->get_pending)
+        _zdisco_free(zd);
+    return TRUE;
+}
+
+/* The callbacks run with the registry locked and the entry pinned, for the
+ * subscribers notified may unsubscribe. */
+static void
+_zdisco_enter(struct zdisco_s *zd)
+{
+    g_rec_mutex_lock(&registry_lock);
+    ++ zd->busy;
+}
+
+static void
+_zdisco_leave(struct zdisco_s *zd)
+{
+    -- zd->busy;
+    _zdisco_maybe_free(zd);
+    g_rec_mutex_unlock(&registry_lock);
+}
+
+struct zdisco_s*
+zdisco_subscribe(const gchar *type, zdisco_fn fn, gpointer u)
+{
+    ASSERT(type != NULL);
+    ASSERT(fn != NULL);
+
+    g_rec_mutex_lock(&registry_lock);
+    if (!registry)
+        registry = g_hash_table_new(g_str_hash, g_str_equal);
+    struct zdisco_s *zd = g_hash_table_lookup(registry, type);
+    if (!zd) {
+        zd = g_malloc0(sizeof(struct zdisco_s));
+        zd->type = g_strdup(type);
+        zd->subs = g_array_new(FALSE, FALSE, sizeof(struct zdisco_sub_s));
+        zd->watch = g_malloc0(sizeof(struct zdisco_watch_s));
+        zd->watch->zd = zd;
+        zd->children = g_tree_new_full(strcmp3, NULL, g_free,
+                (GDestroyNotify)cfg_listen_destroy);
+        g_hash_table_insert(registry, zd->type, zd);
+    }
+    struct zdisco_sub_s sub = {fn, u};
+    g_array_append_val(zd->subs, sub);
+    g_debug("DISCO [%s] %u subscribers", type, zd->subs->len);
+    g_rec_mutex_unlock(&registry_lock);
+    return zd;
+}
+
+void
+zdisco_unsubscribe(struct zdisco_s *zd, gpointer u)
+{
+    if (!zd)
+        return;
+
+    g_rec_mutex_lock(&registry_lock);
+    for (guint i=0; i < zd->subs->len ;++i) {
+        if (g_array_index(zd->subs, struct zdisco_sub_s, i).u == u) {
+            g_array_remove_index_fast(zd->subs, i);
+            break;
+        }
+    }
+    if (!zd->subs->len) {
+        g_hash_table_remove(registry, zd->type);
+        if (zd->timer) {
+            zreactor_cancel_timer(zd->zr, zd->timer);
+            zd->timer = NULL;
+        }
+        if (zd->refresh_timer) {
+            zreactor_cancel_timer(zd->zr, zd->refresh_timer);
+            zd->refresh_timer = NULL;
+        }
+        _zdisco_maybe_free(zd);
+    }
+    g_rec_mutex_unlock(&registry_lock);
+}
+
+void
+zdisco_set_window(struct zdisco_s *zd, guint delay_min, guint delay_max)
+{
+    ASSERT(zd != NULL);
+    zd->delay_min = MAX(zd->delay_min, delay_min);
+    zd->delay_max = MAX(zd->delay_max, MAX(delay_min, delay_max));
+}
+
+static void _zdisco_arm_refresh(struct zdisco_s *zd);
+
+void
+zdisco_set_refresh(struct zdisco_s *zd, guint period)
+{
+    ASSERT(zd != NULL);
+    if (!period || (zd->refresh && zd->refresh <= period))
+        return;
+    zd->refresh = period;
+    if (zd->refresh_timer) {
+        zreactor_cancel_timer(zd->zr, zd->refresh_timer);
+        zd->refresh_timer = NULL;
+    }
+    if (zd->started)
+        _zdisco_arm_refresh(zd);
+}
+
+//------------------------------------------------------------------------------
+
+static gboolean
+_zdisco_has_sub(struct zdisco_s *zd, gpointer u)
+{
+    for (guint i=0; i < zd->subs->len ;++i) {
+        if (g_array_index(zd->subs, struct zdisco_sub_s, i).u == u)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Iterates a copy, the subscribers called may unsubscribe */
+static void
+_zdisco_notify(struct zdisco_s *zd)
+{
+    GArray *subs = g_array_sized_new(FALSE, FALSE,
+            sizeof(struct zdisco_sub_s), zd->subs->len);
+    g_array_append_vals(subs, zd->subs->data, zd->subs->len);
+    for (guint i=0; i < subs->len ;++i) {
+        struct zdisco_sub_s *sub = &g_array_index(subs,
+                struct zdisco_sub_s, i);
+        if (_zdisco_has_sub(zd, sub->u))
+            sub->fn(sub->u);
+    }
+    g_array_free(subs, TRUE);
+}
+
+static void
+restart_list(struct zdisco_s *zd)
+{
+    // Start the ZooKeeper request
+    gchar *p = g_strdup_printf("/listen/%s", zd->type);
+    int rc = zstore_awget_children(zd->store, p,
+            on_list_change, zd->watch,
+            on_list_completion, zd);
+    ZK_DEBUG("awget_children(%s) = %d", p, rc);
+    g_free(p);
+
+    if (rc == ZOK)
+        ++ zd->list_pending;
+}
+
+static void maybe_relist(struct zdisco_s *zd);
+
+static void
+_zdisco_on_window(struct zdisco_s *zd)
+{
+    _zdisco_enter(zd);
+    zd->timer = NULL;
+    if (zd->subs->len)
+        maybe_relist(zd);
+    _zdisco_leave(zd);
+}
+
+/* Waits for the node of the type to be created, the watch then fires as
+ * the one of a listing. Counted as a listing pending. */
+static void
+_zdisco_await(struct zdisco_s *zd)
+{
+    gchar *p = g_strdup_printf("/listen/%s", zd->type);
+    int rc = zstore_awexists(zd->store, p, on_list_change, zd->watch,
+            on_exists, zd);
+    ZK_DEBUG("awexists(%s) = %d", p, rc);
+    g_free(p);
+
+    if (rc == ZOK)
+        ++ zd->list_pending;
+}
+
+/* A failed listing arms no watch. Asked again at once if the connection
+ * failed, the client holds it until it is back. A missing node is waited
+ * for. Otherwise, until the next session. */
+static void
+_zdisco_failed(struct zdisco_s *zd, int r)
+{
+    if (r == ZCONNECTIONLOSS || r == ZOPERATIONTIMEOUT)
+        ++ zd->list_wanted;
+    else if (r == ZNONODE)
+        _zdisco_await(zd);
+    else
+        g_warning("DISCO [%s] listing failed (%d), waiting for the next"
+                " session", zd->type, r);
+}
+
+/* All the changes notified so far are served by a single listing, the
+ * watch it arms notifies the later ones. */
+static void
+maybe_relist(struct zdisco_s *zd)
+{
+    if (zd->get_pending || zd->list_pending || !zd->list_wanted)
+        return;
+
+    if (zd->timer) {
+        zreactor_cancel_timer(zd->zr, zd->timer);
+        zd->timer = NULL;
+    }
+
+    // Still inside the coalescing window
+    if (zd->delay_max && zd->zr) {
+        gint64 now = g_get_monotonic_time() / 1000;
+        gint64 deadline = MIN(zd->last_change + zd->delay_min,
+                zd->first_change + zd->delay_max);
+        if (now < deadline) {
+            zd->timer = zreactor_add_timer(zd->zr, deadline - now,
+                    (zreactor_fn_timer)_zdisco_on_window, zd);
+            return;
+        }
+    }
+
+    ++ zd->stats.lists;
+    zd->stats.max_batch = MAX(zd->stats.max_batch, zd->list_wanted);
+    g_debug("LIST %s : %u changes (%"G_GUINT64_FORMAT" changes,"
+            " %"G_GUINT64_FORMAT" lists, %u subscribers)", zd->type,
+            zd->list_wanted, zd->stats.changes, zd->stats.lists,
+            zd->subs->len);
+    zd->list_wanted = 0;
+    zd->first_change = 0;
+    restart_list(zd);
+}
+
+static inline void
+maybe_notify(struct zdisco_s *zd)
+{
+    if (!zd->get_pending && !zd->list_pending && !zd->list_wanted)
+        _zdisco_notify(zd);
+}
+
+void
+zdisco_start(struct zdisco_s *zd, struct zstore_s *store, struct zreactor_s *zr,
+        gpointer u)
+{
+    ASSERT(zd != NULL);
+    ASSERT(store != NULL);
+
+    _zdisco_enter(zd);
+    if (!zd->zr)
+        zd->zr = zr;
+
+    if (!zd->started) {
+        zd->store = store;
+        zd->started = TRUE;
+        zstore_add_session_hook(store,
+                (zstore_fn_session)_zdisco_on_session, zd);
+        restart_list(zd);
+        _zdisco_arm_refresh(zd);
+    }
+    // Up to date, the subscriber catches up at once. Otherwise it will be
+    // notified with the others.
+    else if (!zd->get_pending && !zd->list_pending && !zd->list_wanted) {
+        for (guint i=0; i < zd->subs->len ;++i) {
+            struct zdisco_sub_s *sub = &g_array_index(zd->subs,
+                    struct zdisco_sub_s, i);
+            if (sub->u == u) {
+                sub->fn(sub->u);
+                break;
+            }
+        }
+    }
+    _zdisco_leave(zd);
+}
+
+/* Remembers the listener behind the child node 'name'. Takes 'cfg' over. */
+static void
+_zdisco_consider(struct zdisco_s *zd, const gchar *name,
+        struct cfg_listen_s *cfg)
+{
+    int ztype;
+    GError *e = zsocket_resolve(cfg->ztype, &ztype);
+    if (e != NULL) {
+        g_debug("Socket ignored (invalid ztype)");
+        g_clear_error(&e);
+        cfg_listen_destroy(cfg);
+        cfg = NULL;
+    }
+
+    // Ignored listeners are remembered too, not to be fetched again
+    g_tree_replace(zd->children, g_strdup(name), cfg);
+}
+
+/* A child node being fetched */
+struct zget_s
+{
+    struct zdisco_s *zd;
+    gchar *name;
+};
+
+static void
+on_get(int r, const char *v, int vl, const struct Stat *s, const void *u)
+{
+    struct zget_s *get = (struct zget_s*) u;
+    struct zdisco_s *zd = get->zd;
+    (void) r, (void) s;
+
+    ASSERT(zd != NULL);
+    _zdisco_enter(zd);
+    g_debug("%s(%s) %.*s", __FUNCTION__, zd->type, v ? vl : 0, v);
+    -- zd->get_pending;
+
+    // The nodes never change, a failed get will be retried by the next
+    // listing if the node is still there.
+    if (r == ZOK) {
+        struct cfg_listen_s *cfg = zlisten_parse_config_buffer(v, vl);
+        if (cfg != NULL)
+            _zdisco_consider(zd, get->name, cfg);
+    }
+    g_free(get->name);
+    g_free(get);
+
+    if (zd->subs->len)
+        maybe_notify(zd);
+    if (zd->subs->len)
+        maybe_relist(zd);
+    _zdisco_leave(zd);
+}
+
+/* Fetches the bodies of the nodes known, the gets run as the ones of the
+ * nodes described only by their body. Skipped while the table is being
+ * updated. */
+static void
+_zdisco_on_refresh(struct zdisco_s *zd)
+{
+    _zdisco_enter(zd);
+    zd->refresh_timer = NULL;
+    if (!zd->subs->len) {
+        _zdisco_leave(zd);
+        return;
+    }
+    _zdisco_arm_refresh(zd);
+    if (zd->get_pending || zd->list_pending || zd->list_wanted) {
+        _zdisco_leave(zd);
+        return;
+    }
+
+    ++ zd->stats.refreshes;
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        (void) u;
+        if (!v)
+            return FALSE;
+        struct zget_s *get = g_malloc0(sizeof(struct zget_s));
+        get->zd = zd;
+        get->name = g_strdup(k);
+        gchar *p = g_strdup_printf("/listen/%s/%s", zd->type, (gchar*)k);
+        int rc = zstore_awget(zd->store, p, NULL, NULL, on_get, get);
+        if (rc == ZOK)
+            ++ zd->get_pending;
+        else {
+            g_free(get->name);
+            g_free(get);
+        }
+        g_free(p);
+        return FALSE;
+    }
+    g_tree_foreach(zd->children, runner, NULL);
+    _zdisco_leave(zd);
+}
+
+static void
+_zdisco_arm_refresh(struct zdisco_s *zd)
+{
+    if (zd->refresh && zd->zr && !zd->refresh_timer)
+        zd->refresh_timer = zreactor_add_timer(zd->zr, zd->refresh,
+                (zreactor_fn_timer)_zdisco_on_refresh, zd);
+}
+
+static void
+on_list_completion(int r, const struct String_vector *sv, const void *u)
+{
+    struct zdisco_s *zd = (struct zdisco_s*) u;
+
+    ASSERT(zd != NULL);
+    _zdisco_enter(zd);
+    g_debug("%s(%s) %d %u", __FUNCTION__, zd->type, r, sv ? sv->count : 0);
+    -- zd->list_pending;
+
+    if (r == ZOK)  {
+        zd->watching = TRUE;
+
+        // Forget the listeners gone
+        GTree *listed = g_tree_new_full(strcmp3, NULL, NULL, NULL);
+        for (gint32 i=0; i < sv->count ;++i)
+            g_tree_insert(listed, sv->data[i], sv->data[i]);
+        GPtrArray *gone = g_ptr_array_new();
+        gboolean runner(gpointer k, gpointer v, gpointer u) {
+            (void) v, (void) u;
+            if (!g_tree_lookup(listed, k))
+                g_ptr_array_add(gone, k);
+            return FALSE;
+        }
+        g_tree_foreach(zd->children, runner, NULL);
+        for (guint i=0; i < gone->len ;++i)
+            g_tree_remove(zd->children, gone->pdata[i]);
+        g_ptr_array_free(gone, TRUE);
+        g_tree_destroy(listed);
+
+        // Only the new ones are fetched, the nodes never change
+        for (gint32 i=0; i < sv->count ;++i) {
+            const gchar *name = sv->data[i];
+            if (g_tree_lookup_extended(zd->children, name, NULL, NULL))
+                continue;
+            // Described by its name, no need to get it
+            struct cfg_listen_s *cfg = zlisten_parse_name(zd->type, name);
+            if (cfg) {
+                _zdisco_consider(zd, name, cfg);
+                continue;
+            }
+            struct zget_s *get = g_malloc0(sizeof(struct zget_s));
+            get->zd = zd;
+            get->name = g_strdup(name);
+            gchar *p = g_strdup_printf("/listen/%s/%s", zd->type, name);
+            int rc = zstore_awget(zd->store, p, NULL, NULL, on_get, get);
+            ZK_DEBUG("awget(%s) = %d", p, rc);
+            if (rc == ZOK)
+                ++ zd->get_pending;
+            else {
+                g_free(get->name);
+                g_free(get);
+            }
+            g_free(p);
+        }
+    }
+    else if (zd->subs->len)
+        _zdisco_failed(zd, r);
+
+    if (zd->subs->len)
+        maybe_notify(zd);
+    if (zd->subs->len)
+        maybe_relist(zd);
+    _zdisco_leave(zd);
+}
+
+static void
+on_exists(int r, const struct Stat *s, const void *u)
+{
+    struct zdisco_s *zd = (struct zdisco_s*) u;
+    (void) s;
+
+    ASSERT(zd != NULL);
+    _zdisco_enter(zd);
+    g_debug("%s(%s) %d", __FUNCTION__, zd->type, r);
+    -- zd->list_pending;
+
+    // Armed whether the node exists or not
+    if (r == ZOK || r == ZNONODE)
+        zd->watching = TRUE;
+    if (zd->subs->len) {
+        if (r == ZOK) // Created meanwhile
+            ++ zd->list_wanted;
+        else if (r != ZNONODE)
+            _zdisco_failed(zd, r);
+    }
+
+    if (zd->subs->len)
+        maybe_relist(zd);
+    _zdisco_leave(zd);
+}
+
+/* A change to be served by a listing, that arms the watch again */
+static void
+_zdisco_changed(struct zdisco_s *zd)
+{
+    gint64 now = g_get_monotonic_time() / 1000;
+    if (!zd->first_change)
+        zd->first_change = now;
+    zd->last_change = now;
+    ++ zd->stats.changes;
+
+    ++ zd->list_wanted;
+    maybe_relist(zd);
+}
+
+static void
+on_list_change(zhandle_t *zh, int t, int s, const char *p, void *u)
+{
+    struct zdisco_watch_s *w = u;
+    (void) zh, (void) p;
+
+    ASSERT(w != NULL);
+
+    // The watch survives the reconnections of a session, not its expiry
+    if (t == ZOO_SESSION_EVENT && s != ZOO_EXPIRED_SESSION_STATE)
+        return;
+
+    g_rec_mutex_lock(&registry_lock);
+    struct zdisco_s *zd = w->zd;
+    if (!zd) {
+        g_rec_mutex_unlock(&registry_lock);
+        g_free(w);
+        return;
+    }
+    _zdisco_enter(zd);
+    g_rec_mutex_unlock(&registry_lock);
+
+    g_debug("%s(%s,%d,%d)", __FUNCTION__, zd->type, t, s);
+    zd->watching = FALSE;
+    if (t != ZOO_SESSION_EVENT && zd->subs->len)
+        _zdisco_changed(zd);
+    _zdisco_leave(zd);
+}
+
+/* The session renewed, the watch is armed again. The peers known and the
+ * connections stay until the listing tells they are gone. */
+static void
+_zdisco_on_session(struct zdisco_s *zd)
+{
+    _zdisco_enter(zd);
+    if (zd->subs->len)
+        _zdisco_changed(zd);
+    _zdisco_leave(zd);
+}
@@ -0,0 +1,83 @@
+#ifndef TECHFORUM_zdisco_h
+# define TECHFORUM_zdisco_h 1
+# include <glib.h>
+# include <zookeeper.h>
+
+/* Discovery of the listeners of a target type, shared by all the sockets of
+ * the process connecting to it: a single watch on /listen/<type>, a single
+ * table of the peers, and the changes fanned out to the subscribers. The
+ * registry can be used from any thread, an entry only from the thread
+ * running the ZooKeeper callbacks (or before they run). Both are guarded
+ * by the same recursive lock. */
+
+struct zreactor_s;
+struct zstore_s;
+struct ztimer_s;
+struct zdisco_watch_s;
+
+typedef void (*zdisco_fn) (gpointer u);
+
+struct zdisco_s
+{
+    gchar *type;
+    struct zstore_s *store;
+    struct zreactor_s *zr; // arms the coalescing timers, may be NULL
+    GArray *subs; // (struct zdisco_sub_s)
+
+    // Listeners known, by name of their node (immutable once created). The
+    // invalid ones are mapped to NULL.
+    GTree *children; // char* -> (struct cfg_listen_s*)
+    guint list_wanted;
+    guint list_pending;
+    guint get_pending;
+    gboolean started; // the first listing has been asked
+    gboolean watching; // a watch is armed on the node, or on its creation
+    struct zdisco_watch_s *watch; // its context
+    guint busy; // callbacks running, the entry is not freed meanwhile
+
+    // Coalescing window: the changes notified are served by a single
+    // listing, at least 'delay_min' ms after the last one and at most
+    // 'delay_max' ms after the first one.
+    guint delay_min;
+    guint delay_max;
+    gint64 first_change; // ms, 0 when no change is waiting
+    gint64 last_change; // ms
+    struct ztimer_s *timer;
+
+    // Period (ms) of the refresh of the bodies of the nodes (e.g. the load
+    // of the listeners), 0 if never.
+    guint refresh;
+    struct ztimer_s *refresh_timer;
+
+    struct {
+        guint64 changes; // watches fired
+        guint64 lists; // listings started
+        guint max_batch; // most changes served by a listing
+        guint64 refreshes; // rounds of gets
+    } stats;
+};
+
+/* Takes a reference on the entry of 'type', created at the first call.
+ * 'fn' is called with 'u' each time the table of the peers changes. */
+struct zdisco_s* zdisco_subscribe(const gchar *type, zdisco_fn fn,
+        gpointer u);
+
+/* Drops the reference taken for 'u'. The last one releases the entry, once
+ * its pending ZooKeeper requests completed. An armed watch does not hold
+ * it. */
+void zdisco_unsubscribe(struct zdisco_s *zd, gpointer u);
+
+/* Starts the listing at the first call. Later, the subscriber 'u' is
+ * notified at once if the table is up to date. */
+void zdisco_start(struct zdisco_s *zd, struct zstore_s *store,
+        struct zreactor_s *zr, gpointer u);
+
+/* Widens the coalescing window to cover the one asked */
+void zdisco_set_window(struct zdisco_s *zd, guint delay_min,
+        guint delay_max);
+
+/* Asks the bodies of the nodes to be fetched again at least every 'period'
+ * ms. Only effective with a reactor given to zdisco_start(). */
+void zdisco_set_refresh(struct zdisco_s *zd, guint period);
+
+#endif // TECHFORUM_zdisco_h
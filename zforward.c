@@ -0,0 +1,252 @@
+#ifndef G_LOG_DOMAIN
+# define G_LOG_DOMAIN "zsock"
+#endif
+
+#include <errno.h>
+
+#include <glib.h>
+#include <zmq.h>
+
+#include "./macros.h"
+#include "./zsock.h"
+#include "./zforward.h"
+
+/* The forwarding state of a socket, its input and/or output side. The
+ * handlers it replaced are restored once no forward uses it. */
+struct zfwd_port_s
+{
+    struct zsock_s *zsock;
+    struct zforward_s *reader; // the forward reading the socket
+    guint writers; // forwards writing into it
+    GPtrArray *stalled; // (struct zforward_s*) ... waiting for room
+
+    void (*ready_in)(struct zsock_s*);
+    void (*ready_out)(struct zsock_s*);
+    gpointer ready_data;
+};
+
+static void _zforward_on_input(struct zsock_s *zsock);
+static void _zforward_on_output(struct zsock_s *zsock);
+
+static struct zfwd_port_s *
+_port_get(struct zsock_s *zsock)
+{
+    if (zsock->ready_in == _zforward_on_input
+            || zsock->ready_out == _zforward_on_output)
+        return zsock->ready_data;
+
+    struct zfwd_port_s *port = g_malloc0(sizeof(struct zfwd_port_s));
+    port->zsock = zsock;
+    port->stalled = g_ptr_array_new();
+    port->ready_in = zsock->ready_in;
+    port->ready_out = zsock->ready_out;
+    port->ready_data = zsock->ready_data;
+    zsock->ready_data = port;
+    return port;
+}
+
+/* Gives back the sides not used anymore */
+static void
+_port_release(struct zfwd_port_s *port)
+{
+    struct zsock_s *zsock = port->zsock;
+    if (!port->reader)
+        zsock->ready_in = port->ready_in;
+    if (!port->writers)
+        zsock->ready_out = port->ready_out;
+    if (port->reader || port->writers)
+        return;
+    zsock->ready_data = port->ready_data;
+    g_ptr_array_free(port->stalled, TRUE);
+    g_free(port);
+}
+
+//------------------------------------------------------------------------------
+
+/* Sends the frame, or keeps it aside when 'out' is full. The caller still
+ * closes 'msg'. */
+static gboolean
+_zforward_send(struct zforward_s *fw, zmq_msg_t *msg)
+{
+    int flags = zmq_msg_more(msg) ? ZMQ_SNDMORE : 0;
+    if (0 <= zsock_send(fw->out, msg, flags))
+        return TRUE;
+    if (errno == EAGAIN) {
+        zmq_msg_init(&fw->held);
+        zmq_msg_move(&fw->held, msg);
+        fw->holding = TRUE;
+        return FALSE;
+    }
+    g_warning("ZSOCK [%s] forward error : (%d) %s", fw->out->fullname,
+            errno, zmq_strerror(errno));
+    return TRUE;
+}
+
+/* Moves the messages waiting in the input, as many as the budget of the
+ * turn allows, or only the end of the current one. A message is never cut:
+ * ZMQ only refuses its first frame, and zsock_recv() delivers it whole.
+ * Returns FALSE when the output is full. */
+static gboolean
+_zforward_move(struct zforward_s *fw, gboolean whole, guint *count)
+{
+    while (whole || fw->in->in_message) {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (0 > zsock_recv(fw->in, &msg)) {
+            zmq_msg_close(&msg);
+            break;
+        }
+        gboolean last = !zmq_msg_more(&msg);
+        gboolean sent = _zforward_send(fw, &msg);
+        zmq_msg_close(&msg);
+        if (!sent)
+            return FALSE;
+        if (last)
+            ++ *count;
+    }
+    return TRUE;
+}
+
+static void
+_zforward_count(struct zforward_s *fw, guint count)
+{
+    if (!count)
+        return;
+    fw->stats.messages += count;
+    ++ fw->stats.batches;
+    fw->stats.max_batch = MAX(fw->stats.max_batch, count);
+}
+
+/* Stops reading until 'out' can take the frame held */
+static void
+_zforward_stall(struct zforward_s *fw)
+{
+    ++ fw->stats.stalls;
+    fw->stalled = TRUE;
+    g_ptr_array_add(fw->pout->stalled, fw);
+    zsock_set_events(fw->in, fw->in->evt & ~ZMQ_POLLIN);
+    zsock_set_events(fw->out, fw->out->evt | ZMQ_POLLOUT);
+}
+
+static void
+_zforward_on_input(struct zsock_s *zsock)
+{
+    struct zfwd_port_s *port = zsock->ready_data;
+    struct zforward_s *fw = port->reader;
+    guint count = 0;
+
+    if (!fw || fw->stalled)
+        return;
+    if (!_zforward_move(fw, TRUE, &count))
+        _zforward_stall(fw);
+    _zforward_count(fw, count);
+}
+
+/* 'out' became writable, the stalled forwards send the frame they hold and
+ * the end of its message, then read their input again. */
+static void
+_zforward_on_output(struct zsock_s *zsock)
+{
+    struct zfwd_port_s *port = zsock->ready_data;
+    GPtrArray *stalled = port->stalled;
+    port->stalled = g_ptr_array_new();
+
+    for (guint i=0; i < stalled->len ;++i) {
+        struct zforward_s *fw = stalled->pdata[i];
+        guint count = 0;
+        fw->stalled = FALSE;
+        if (fw->holding) {
+            zmq_msg_t msg;
+            zmq_msg_init(&msg);
+            zmq_msg_move(&msg, &fw->held);
+            zmq_msg_close(&fw->held);
+            fw->holding = FALSE;
+            gboolean last = !zmq_msg_more(&msg);
+            gboolean sent = _zforward_send(fw, &msg);
+            zmq_msg_close(&msg);
+            if (!sent) {
+                _zforward_stall(fw);
+                continue;
+            }
+            if (last)
+                ++ count;
+        }
+        if (!_zforward_move(fw, FALSE, &count)) {
+            _zforward_stall(fw);
+            continue;
+        }
+        _zforward_count(fw, count);
+        zsock_set_events(fw->in, fw->in->evt | ZMQ_POLLIN);
+    }
+    g_ptr_array_free(stalled, TRUE);
+}
+
+//------------------------------------------------------------------------------
+
+struct zforward_s*
+zforward_create(struct zsock_s *in, struct zsock_s *out)
+{
+    ASSERT(in != NULL);
+    ASSERT(out != NULL);
+    ASSERT(in != out);
+
+    struct zforward_s *fw = g_malloc0(sizeof(struct zforward_s));
+    fw->in = in;
+    fw->out = out;
+    return fw;
+}
+
+void
+zforward_start(struct zforward_s *fw)
+{
+    ASSERT(fw != NULL);
+    ASSERT(fw->in->zr == fw->out->zr);
+    if (fw->started)
+        return;
+
+    fw->pin = _port_get(fw->in);
+    fw->pout = _port_get(fw->out);
+    ASSERT(fw->pin->reader == NULL);
+    fw->pin->reader = fw;
+    ++ fw->pout->writers;
+    fw->in->ready_in = _zforward_on_input;
+    fw->out->ready_out = _zforward_on_output;
+    fw->started = TRUE;
+
+    g_debug("FWD [%s] -> [%s]", fw->in->fullname, fw->out->fullname);
+    zsock_set_events(fw->in, fw->in->evt | ZMQ_POLLIN);
+}
+
+void
+zforward_destroy(struct zforward_s *fw)
+{
+    if (!fw)
+        return;
+
+    if (fw->started) {
+        g_debug("FWD [%s] -/> [%s] %"G_GUINT64_FORMAT" messages,"
+                " %"G_GUINT64_FORMAT" batches, %"G_GUINT64_FORMAT" stalls",
+                fw->in->fullname, fw->out->fullname, fw->stats.messages,
+                fw->stats.batches, fw->stats.stalls);
+        if (fw->stalled)
+            g_ptr_array_remove_fast(fw->pout->stalled, fw);
+        if (fw->holding) {
+            // Dropped with the rest of its message
+            zmq_msg_close(&fw->held);
+            while (fw->in->in_message) {
+                zmq_msg_t msg;
+                zmq_msg_init(&msg);
+                int rc = zsock_recv(fw->in, &msg);
+                zmq_msg_close(&msg);
+                if (rc < 0)
+                    break;
+            }
+        }
+        zsock_set_events(fw->in, fw->in->evt & ~ZMQ_POLLIN);
+        fw->pin->reader = NULL;
+        -- fw->pout->writers;
+        _port_release(fw->pin);
+        _port_release(fw->pout);
+    }
+    g_free(fw);
+}
@@ -0,0 +1,46 @@
+#ifndef TECHFORUM_zforward_h
+# define TECHFORUM_zforward_h 1
+# include <glib.h>
+# include <zmq.h>
+
+/* Moves the messages received on a socket to another one, frame by frame
+ * and without copy, in the batches granted by the reactor. When the output
+ * cannot take more, the frame refused is kept aside and the input is not
+ * read anymore until the output becomes writable. Several inputs may feed
+ * the same output, their messages are never interleaved. */
+
+struct zsock_s;
+struct zfwd_port_s;
+
+struct zforward_s
+{
+    struct zsock_s *in;
+    struct zsock_s *out;
+    struct zfwd_port_s *pin; // set once started
+    struct zfwd_port_s *pout; // shared by the forwards to 'out'
+    zmq_msg_t held; // refused by 'out'
+    gboolean holding;
+    gboolean stalled; // waiting for 'out'
+    gboolean started;
+
+    struct {
+        guint64 messages;
+        guint64 batches; // turns that moved at least a message
+        guint max_batch;
+        guint64 stalls; // times the output was full
+    } stats;
+};
+
+/* Both sockets must be managed by the same reactor. Can be called from any
+ * thread. */
+struct zforward_s* zforward_create(struct zsock_s *in, struct zsock_s *out);
+
+/* Replaces the handlers of both sockets and monitors the input. To be
+ * called in the thread of their reactor, or before it runs. */
+void zforward_start(struct zforward_s *fw);
+
+/* Restores the handlers, drops the frame held. Same thread as
+ * zforward_start(). */
+void zforward_destroy(struct zforward_s *fw);
+
+#endif // TECHFORUM_zforward_h
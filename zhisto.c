@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include <glib.h>
+
+#include "./macros.h"
+#include "./zhisto.h"
+
+static inline guint
+_zh_index(guint64 v)
+{
+    if (v < ZH_SUB)
+        return v;
+    guint e = g_bit_storage(v) - 1;
+    return (e - ZH_SUB_BITS + 1) * ZH_SUB
+        + ((v >> (e - ZH_SUB_BITS)) & (ZH_SUB - 1));
+}
+
+static inline guint64
+_zh_upper(guint idx)
+{
+    if (idx < ZH_SUB)
+        return idx;
+    guint e = idx / ZH_SUB + ZH_SUB_BITS - 1;
+    guint64 sub = idx % ZH_SUB;
+    guint64 lower = (ZH_SUB + sub) << (e - ZH_SUB_BITS);
+    return lower + ((G_GUINT64_CONSTANT(1) << (e - ZH_SUB_BITS)) - 1);
+}
+
+void
+zhisto_reset(struct zhisto_s *h)
+{
+    ASSERT(h != NULL);
+    memset(h, 0, sizeof(*h));
+}
+
+void
+zhisto_record(struct zhisto_s *h, guint64 v)
+{
+    if (!h->count || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    ++ h->count;
+    h->sum += v;
+    ++ h->buckets[_zh_index(v)];
+}
+
+void
+zhisto_merge(struct zhisto_s *dst, const struct zhisto_s *src)
+{
+    ASSERT(dst != NULL);
+    ASSERT(src != NULL);
+
+    if (!src->count)
+        return;
+    if (!dst->count || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (guint i=0; i < ZH_BUCKETS ;++i)
+        dst->buckets[i] += src->buckets[i];
+}
+
+guint64
+zhisto_percentile(const struct zhisto_s *h, gdouble p)
+{
+    ASSERT(h != NULL);
+
+    if (!h->count)
+        return 0;
+
+    guint64 rank = (guint64) ((p / 100.0) * h->count + 0.5);
+    rank = CLAMP(rank, 1, h->count);
+
+    guint64 seen = 0;
+    for (guint i=0; i < ZH_BUCKETS ;++i) {
+        if ((seen += h->buckets[i]) >= rank)
+            return MIN(_zh_upper(i), h->max);
+    }
+    return h->max;
+}
+
+guint64
+zhisto_mean(const struct zhisto_s *h)
+{
+    ASSERT(h != NULL);
+    return h->count ? h->sum / h->count : 0;
+}
@@ -0,0 +1,35 @@
+#ifndef TECHFORUM_zhisto_h
+# define TECHFORUM_zhisto_h 1
+# include <glib.h>
+
+/* Log-linear histogram, a la HdrHistogram: each power of two is split in
+ * ZH_SUB buckets, so that any value is recorded with a relative error below
+ * 1/ZH_SUB. Recording is O(1) and allocation free. */
+
+# define ZH_SUB_BITS 3
+# define ZH_SUB (1 << ZH_SUB_BITS)
+# define ZH_BUCKETS ((64 - ZH_SUB_BITS + 1) * ZH_SUB)
+
+struct zhisto_s
+{
+    guint64 count;
+    guint64 sum;
+    guint64 min;
+    guint64 max;
+    guint64 buckets[ZH_BUCKETS];
+};
+
+void zhisto_reset(struct zhisto_s *h);
+
+void zhisto_record(struct zhisto_s *h, guint64 v);
+
+/* Adds the values recorded in 'src' to 'dst' */
+void zhisto_merge(struct zhisto_s *dst, const struct zhisto_s *src);
+
+/* Upper bound of the bucket holding the p-th percentile (0 < p <= 100),
+ * 0 when empty. */
+guint64 zhisto_percentile(const struct zhisto_s *h, gdouble p);
+
+guint64 zhisto_mean(const struct zhisto_s *h);
+
+#endif // TECHFORUM_zhisto_h
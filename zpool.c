@@ -0,0 +1,594 @@
+#ifndef G_LOG_DOMAIN
+# define G_LOG_DOMAIN "zsock"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <glib.h>
+#include <zmq.h>
+
+#include "./macros.h"
+#include "./zsock.h"
+#include "./zreactor.h"
+#include "./zpool.h"
+
+#define ZPOOL_RING 1024 // jobs per worker
+#define ZPOOL_RETRY 5 // ms before sending again after EAGAIN
+
+/* Fed by the reactor thread only, consumed by its worker and by the idle
+ * workers stealing from it. */
+struct zdeque_s
+{
+    volatile gint top; // next job to be taken
+    volatile gint bottom; // next free slot
+    gpointer ring[ZPOOL_RING];
+};
+
+struct zworker_s
+{
+    struct zpool_s *pool;
+    GThread *th;
+    guint id;
+    struct zdeque_s dq;
+};
+
+struct zbind_s
+{
+    struct zpool_s *pool;
+    struct zsock_s *zsock;
+    zpool_fn_work fn;
+    gpointer u;
+};
+
+struct zjob_s
+{
+    struct zbind_s *bind;
+    struct zsock_s *in;
+    guint count;
+    zmq_msg_t *frames;
+};
+
+/* A message produced by a worker, to be sent by the reactor */
+struct zout_s
+{
+    struct zout_s *next;
+    struct zsock_s *out;
+    guint count;
+    guint sent;
+    zmq_msg_t *frames;
+};
+
+struct zpool_s
+{
+    struct zreactor_s *zr;
+    struct zmon_s *zmon;
+    int fd; // eventfd, workers -> reactor
+    int evt;
+    volatile gint notified;
+    volatile gint stopping;
+    volatile gint starving; // the reactor waits for room in the deques
+
+    GMutex lock;
+    GCond cond;
+    volatile gint sleepers;
+
+    guint nb_workers;
+    struct zworker_s *workers;
+    guint next; // next worker fed
+
+    // Results, lock-free MPSC queue (intrusive, a la Vyukov)
+    struct zout_s *head; // pushed by the workers
+    struct zout_s *tail; // popped by the reactor
+    struct zout_s stub;
+
+    // Reactor side only
+    GQueue backlog_out; // (struct zout_s*) not sent yet
+    GQueue backlog_in; // (struct zjob_s*) not dispatched yet
+    GPtrArray *paused; // (struct zsock_s*) input suspended
+    GPtrArray *binds; // (struct zbind_s*)
+    struct ztimer_s *retry;
+};
+
+//------------------------------------------------------------------------------
+
+static void
+_zjob_free(struct zjob_s *job)
+{
+    for (guint i=0; i < job->count ;++i)
+        zmq_msg_close(job->frames + i);
+    g_free(job->frames);
+    g_free(job);
+}
+
+static void
+_zout_free(struct zout_s *o)
+{
+    for (guint i=0; i < o->count ;++i)
+        zmq_msg_close(o->frames + i);
+    g_free(o->frames);
+    g_free(o);
+}
+
+static gboolean
+_deque_push(struct zdeque_s *dq, gpointer p)
+{
+    gint t = g_atomic_int_get(&dq->top);
+    gint b = dq->bottom;
+    if ((guint)(b - t) >= ZPOOL_RING)
+        return FALSE;
+    g_atomic_pointer_set(&dq->ring[(guint)b % ZPOOL_RING], p);
+    g_atomic_int_set(&dq->bottom, b + 1);
+    return TRUE;
+}
+
+static gpointer
+_deque_take(struct zdeque_s *dq)
+{
+    for (;;) {
+        gint t = g_atomic_int_get(&dq->top);
+        gint b = g_atomic_int_get(&dq->bottom);
+        if ((gint)(b - t) <= 0)
+            return NULL;
+        gpointer p = g_atomic_pointer_get(&dq->ring[(guint)t % ZPOOL_RING]);
+        if (g_atomic_int_compare_and_exchange(&dq->top, t, t + 1))
+            return p;
+    }
+}
+
+static inline gboolean
+_deque_empty(struct zdeque_s *dq)
+{
+    return 0 >= (gint)(g_atomic_int_get(&dq->bottom) - g_atomic_int_get(&dq->top));
+}
+
+static void
+_mpsc_push(struct zpool_s *pool, struct zout_s *o)
+{
+    struct zout_s *prev;
+    g_atomic_pointer_set(&o->next, NULL);
+    do {
+        prev = g_atomic_pointer_get(&pool->head);
+    } while (!g_atomic_pointer_compare_and_exchange(&pool->head, prev, o));
+    g_atomic_pointer_set(&prev->next, o);
+}
+
+static struct zout_s *
+_mpsc_pop(struct zpool_s *pool)
+{
+    struct zout_s *tail = pool->tail;
+    struct zout_s *next = g_atomic_pointer_get(&tail->next);
+
+    if (tail == &pool->stub) {
+        if (!next)
+            return NULL;
+        pool->tail = tail = next;
+        next = g_atomic_pointer_get(&next->next);
+    }
+    if (next) {
+        pool->tail = next;
+        return tail;
+    }
+    // A push is in progress, its author will notify again
+    if (tail != g_atomic_pointer_get(&pool->head))
+        return NULL;
+    _mpsc_push(pool, &pool->stub);
+    next = g_atomic_pointer_get(&tail->next);
+    if (next) {
+        pool->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* Wakes the reactor up, once until it handled the notification */
+static inline void
+_notify(struct zpool_s *pool)
+{
+    uint64_t one = 1;
+    if (g_atomic_int_compare_and_exchange(&pool->notified, 0, 1))
+        (void) write(pool->fd, &one, sizeof(one));
+}
+
+//------------------------------------------------------------------------------
+// Worker side
+
+static struct zjob_s *
+_zpool_take(struct zpool_s *pool, struct zworker_s *w)
+{
+    struct zjob_s *job;
+
+    if (NULL != (job = _deque_take(&w->dq)))
+        return job;
+    for (guint i=1; i < pool->nb_workers ;++i) {
+        struct zworker_s *victim = pool->workers + ((w->id + i) % pool->nb_workers);
+        if (NULL != (job = _deque_take(&victim->dq)))
+            return job;
+    }
+    return NULL;
+}
+
+static gboolean
+_zpool_has_jobs(struct zpool_s *pool)
+{
+    for (guint i=0; i < pool->nb_workers ;++i) {
+        if (!_deque_empty(&(pool->workers[i].dq)))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gpointer
+_worker_run(gpointer p)
+{
+    struct zworker_s *w = p;
+    struct zpool_s *pool = w->pool;
+
+    while (!g_atomic_int_get(&pool->stopping)) {
+        struct zjob_s *job = _zpool_take(pool, w);
+        if (job) {
+            job->bind->fn(job->bind->u, job);
+            _zjob_free(job);
+            if (g_atomic_int_get(&pool->starving))
+                _notify(pool);
+            continue;
+        }
+
+        // Registered as a sleeper before checking, so that the reactor
+        // either sees us sleeping or we see its jobs.
+        g_mutex_lock(&pool->lock);
+        g_atomic_int_inc(&pool->sleepers);
+        if (!_zpool_has_jobs(pool) && !g_atomic_int_get(&pool->stopping))
+            g_cond_wait_until(&pool->cond, &pool->lock,
+                    g_get_monotonic_time() + G_USEC_PER_SEC);
+        g_atomic_int_add(&pool->sleepers, -1);
+        g_mutex_unlock(&pool->lock);
+    }
+
+    return p;
+}
+
+struct zsock_s*
+zjob_input(struct zjob_s *job)
+{
+    ASSERT(job != NULL);
+    return job->in;
+}
+
+guint
+zjob_count(struct zjob_s *job)
+{
+    ASSERT(job != NULL);
+    return job->count;
+}
+
+zmq_msg_t*
+zjob_frame(struct zjob_s *job, guint i)
+{
+    ASSERT(job != NULL);
+    ASSERT(i < job->count);
+    return job->frames + i;
+}
+
+void
+zjob_send(struct zjob_s *job, struct zsock_s *out, zmq_msg_t *frames,
+        guint count)
+{
+    ASSERT(job != NULL);
+    ASSERT(out != NULL);
+    ASSERT(count > 0);
+
+    struct zout_s *o = g_malloc0(sizeof(struct zout_s));
+    o->out = out;
+    o->count = count;
+    o->frames = g_malloc0(count * sizeof(zmq_msg_t));
+    for (guint i=0; i < count ;++i) {
+        zmq_msg_init(o->frames + i);
+        zmq_msg_move(o->frames + i, frames + i);
+    }
+
+    _mpsc_push(job->bind->pool, o);
+    _notify(job->bind->pool);
+}
+
+//------------------------------------------------------------------------------
+// Reactor side
+
+static void
+_zpool_wake_workers(struct zpool_s *pool)
+{
+    if (g_atomic_int_get(&pool->sleepers) > 0) {
+        g_mutex_lock(&pool->lock);
+        g_cond_broadcast(&pool->cond);
+        g_mutex_unlock(&pool->lock);
+    }
+}
+
+static void
+_zpool_pause(struct zpool_s *pool, struct zsock_s *zsock)
+{
+    for (guint i=0; i < pool->paused->len ;++i) {
+        if (pool->paused->pdata[i] == zsock)
+            return;
+    }
+    g_ptr_array_add(pool->paused, zsock);
+    zsock_set_events(zsock, zsock->evt & ~ZMQ_POLLIN);
+}
+
+static void
+_zpool_resume_all(struct zpool_s *pool)
+{
+    for (guint i=0; i < pool->paused->len ;++i) {
+        struct zsock_s *zsock = pool->paused->pdata[i];
+        zsock_set_events(zsock, zsock->evt | ZMQ_POLLIN);
+    }
+    g_ptr_array_set_size(pool->paused, 0);
+}
+
+static gboolean
+_zpool_dispatch(struct zpool_s *pool, struct zjob_s *job)
+{
+    for (guint i=0; i < pool->nb_workers ;++i) {
+        struct zworker_s *w = pool->workers + (pool->next++ % pool->nb_workers);
+        if (_deque_push(&w->dq, job))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static struct zjob_s *
+_zpool_recv(struct zsock_s *zsock)
+{
+    guint max = 0;
+    struct zjob_s *job = NULL;
+
+    for (;;) {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (0 > zsock_recv(zsock, &msg)) {
+            zmq_msg_close(&msg);
+            return job; // only possible on the first frame
+        }
+        if (!job) {
+            job = g_malloc0(sizeof(struct zjob_s));
+            job->bind = zsock->ready_data;
+            job->in = zsock;
+        }
+        if (job->count >= max) { // zmq_msg_t must be moved, not copied
+            zmq_msg_t *frames = g_malloc0((max = MAX(1, 2*max)) * sizeof(zmq_msg_t));
+            for (guint i=0; i < job->count ;++i) {
+                zmq_msg_init(frames + i);
+                zmq_msg_move(frames + i, job->frames + i);
+                zmq_msg_close(job->frames + i);
+            }
+            g_free(job->frames);
+            job->frames = frames;
+        }
+        int more = zmq_msg_more(&msg);
+        zmq_msg_init(job->frames + job->count);
+        zmq_msg_move(job->frames + job->count, &msg);
+        ++ job->count;
+        zmq_msg_close(&msg);
+        if (!more)
+            return job;
+    }
+}
+
+static void
+_zpool_on_input(struct zsock_s *zsock)
+{
+    struct zbind_s *bind = zsock->ready_data;
+    struct zpool_s *pool = bind->pool;
+
+    // Bounded by the budget granted by the reactor
+    for (;;) {
+        if (!g_queue_is_empty(&pool->backlog_in)) {
+            _zpool_pause(pool, zsock);
+            break;
+        }
+        struct zjob_s *job = _zpool_recv(zsock);
+        if (!job)
+            break;
+        if (!_zpool_dispatch(pool, job)) {
+            g_atomic_int_set(&pool->starving, 1);
+            g_queue_push_tail(&pool->backlog_in, job);
+        }
+    }
+
+    _zpool_wake_workers(pool);
+}
+
+static void _zpool_flush_out(struct zpool_s *pool);
+
+static void
+_zpool_on_retry(struct zpool_s *pool)
+{
+    pool->retry = NULL;
+    _zpool_flush_out(pool);
+}
+
+static void
+_zpool_flush_out(struct zpool_s *pool)
+{
+    struct zout_s *o;
+
+    while (NULL != (o = g_queue_peek_head(&pool->backlog_out))) {
+        while (o->sent < o->count) {
+            int flags = ZMQ_DONTWAIT | ((o->sent + 1 < o->count) ? ZMQ_SNDMORE : 0);
+            if (0 <= zsock_send(o->out, o->frames + o->sent, flags)) {
+                ++ o->sent;
+                continue;
+            }
+            if (errno == EAGAIN) {
+                if (!pool->retry)
+                    pool->retry = zreactor_add_timer(pool->zr, ZPOOL_RETRY,
+                            (zreactor_fn_timer)_zpool_on_retry, pool);
+                goto pressure;
+            }
+            g_warning("ZSOCK [%s] send error : (%d) %s", o->out->fullname,
+                    errno, zmq_strerror(errno));
+            break;
+        }
+        g_queue_pop_head(&pool->backlog_out);
+        _zout_free(o);
+    }
+
+pressure:
+    // Stop reading while the outputs cannot absorb what the workers produce
+    if (g_queue_get_length(&pool->backlog_out) > ZPOOL_RING) {
+        for (guint i=0; i < pool->binds->len ;++i) {
+            struct zbind_s *bind = pool->binds->pdata[i];
+            _zpool_pause(pool, bind->zsock);
+        }
+    }
+    else if (!g_atomic_int_get(&pool->starving))
+        _zpool_resume_all(pool);
+}
+
+static void
+_zpool_flush_in(struct zpool_s *pool)
+{
+    struct zjob_s *job;
+
+    while (NULL != (job = g_queue_peek_head(&pool->backlog_in))) {
+        if (!_zpool_dispatch(pool, job))
+            return;
+        g_queue_pop_head(&pool->backlog_in);
+    }
+
+    g_atomic_int_set(&pool->starving, 0);
+}
+
+static int
+_zpool_on_event(struct zpool_s *pool, int fd, int evt)
+{
+    uint64_t count;
+    struct zout_s *o;
+    (void) evt;
+
+    while (0 < read(fd, &count, sizeof(count))) {}
+    g_atomic_int_set(&pool->notified, 0);
+
+    _zpool_flush_in(pool);
+    _zpool_wake_workers(pool);
+
+    while (NULL != (o = _mpsc_pop(pool)))
+        g_queue_push_tail(&pool->backlog_out, o);
+    _zpool_flush_out(pool);
+    return 0;
+}
+
+static void
+_zpool_register(struct zpool_s *pool)
+{
+    pool->zmon = zreactor_add_fd(pool->zr, pool->fd, &pool->evt,
+            (zreactor_fn_fd)_zpool_on_event, pool);
+    zreactor_set_name(pool->zr, pool->zmon, "zpool");
+}
+
+struct zpool_s*
+zpool_create(struct zreactor_s *zr, guint nb_workers)
+{
+    ASSERT(zr != NULL);
+    ASSERT(nb_workers > 0);
+
+    struct zpool_s *pool = g_malloc0(sizeof(struct zpool_s));
+    pool->zr = zr;
+    pool->fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (pool->fd < 0)
+        g_error("eventfd() failed : (%d) %s", errno, g_strerror(errno));
+    pool->evt = ZMQ_POLLIN;
+    g_mutex_init(&pool->lock);
+    g_cond_init(&pool->cond);
+    pool->head = pool->tail = &pool->stub;
+    g_queue_init(&pool->backlog_out);
+    g_queue_init(&pool->backlog_in);
+    pool->paused = g_ptr_array_new();
+    pool->binds = g_ptr_array_new_with_free_func(g_free);
+
+    if (zreactor_is_current(zr))
+        _zpool_register(pool);
+    else
+        zreactor_post(zr, (zreactor_fn_task)_zpool_register, pool);
+
+    pool->nb_workers = nb_workers;
+    pool->workers = g_malloc0(nb_workers * sizeof(struct zworker_s));
+    for (guint i=0; i < nb_workers ;++i) {
+        struct zworker_s *w = pool->workers + i;
+        w->pool = pool;
+        w->id = i;
+        w->th = g_thread_new("zworker", _worker_run, w);
+    }
+
+    return pool;
+}
+
+void
+zpool_destroy(struct zpool_s *pool)
+{
+    struct zjob_s *job;
+    struct zout_s *o;
+
+    if (!pool)
+        return;
+
+    g_atomic_int_set(&pool->stopping, 1);
+    g_mutex_lock(&pool->lock);
+    g_cond_broadcast(&pool->cond);
+    g_mutex_unlock(&pool->lock);
+    for (guint i=0; i < pool->nb_workers ;++i) {
+        struct zworker_s *w = pool->workers + i;
+        g_thread_join(w->th);
+        while (NULL != (job = _deque_take(&w->dq)))
+            _zjob_free(job);
+    }
+    g_free(pool->workers);
+
+    while (NULL != (job = g_queue_pop_head(&pool->backlog_in)))
+        _zjob_free(job);
+    while (NULL != (o = _mpsc_pop(pool)))
+        g_queue_push_tail(&pool->backlog_out, o);
+    while (NULL != (o = g_queue_pop_head(&pool->backlog_out)))
+        _zout_free(o);
+
+    for (guint i=0; i < pool->binds->len ;++i) {
+        struct zbind_s *bind = pool->binds->pdata[i];
+        if (bind->zsock->ready_in == _zpool_on_input) {
+            bind->zsock->ready_in = NULL;
+            bind->zsock->ready_data = NULL;
+        }
+    }
+
+    if (pool->retry)
+        zreactor_cancel_timer(pool->zr, pool->retry);
+    if (pool->zmon)
+        zreactor_remove(pool->zr, pool->zmon);
+    close(pool->fd);
+    g_ptr_array_free(pool->paused, TRUE);
+    g_ptr_array_free(pool->binds, TRUE);
+    g_mutex_clear(&pool->lock);
+    g_cond_clear(&pool->cond);
+    g_free(pool);
+}
+
+void
+zpool_attach(struct zpool_s *pool, struct zsock_s *zsock,
+        zpool_fn_work fn, gpointer u)
+{
+    ASSERT(pool != NULL);
+    ASSERT(zsock != NULL);
+    ASSERT(fn != NULL);
+    ASSERT(zsock->zr == pool->zr);
+
+    struct zbind_s *bind = g_malloc0(sizeof(struct zbind_s));
+    bind->pool = pool;
+    bind->zsock = zsock;
+    bind->fn = fn;
+    bind->u = u;
+    g_ptr_array_add(pool->binds, bind);
+
+    zsock->ready_data = bind;
+    zsock->ready_in = _zpool_on_input;
+}
@@ -0,0 +1,45 @@
+#ifndef TECHFORUM_zpool_h
+# define TECHFORUM_zpool_h 1
+# include <glib.h>
+# include <zmq.h>
+
+struct zpool_s;
+struct zjob_s;
+struct zsock_s;
+struct zreactor_s;
+
+/* Called by a worker thread, for each message received */
+typedef void (*zpool_fn_work) (gpointer u, struct zjob_s *job);
+
+/* The pool works for the sockets managed by 'zr', the results are sent by
+ * the thread running 'zr'. Can be called before 'zr' runs. */
+struct zpool_s* zpool_create(struct zreactor_s *zr, guint nb_workers);
+
+/* Stops and joins the workers, detaches the sockets. Must be called in the
+ * thread of 'zr', or once it has exited. The results not sent yet are
+ * dropped. */
+void zpool_destroy(struct zpool_s *pool);
+
+/* Replaces the 'ready_in' handler of 'zsock', whose messages will be given
+ * to 'fn' in the worker threads. 'zsock' must be managed by the reactor of
+ * the pool, and the call happen before the reactor runs or in its thread.
+ * The caller still decides when ZMQ_POLLIN is monitored. */
+void zpool_attach(struct zpool_s *pool, struct zsock_s *zsock,
+        zpool_fn_work fn, gpointer u);
+
+/* For the worker threads ---------------------------------------------------*/
+
+struct zsock_s* zjob_input(struct zjob_s *job);
+
+/* Number of frames of the message received */
+guint zjob_count(struct zjob_s *job);
+
+zmq_msg_t* zjob_frame(struct zjob_s *job, guint i);
+
+/* Sends a message made of 'count' frames on 'out', that must be managed by
+ * the pool's reactor. The frames are moved, the caller keeps initiated but
+ * empty messages. */
+void zjob_send(struct zjob_s *job, struct zsock_s *out,
+        zmq_msg_t *frames, guint count);
+
+#endif // TECHFORUM_zpool_h
@@ -1,15 +1,65 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE // CPU_SET()
+#endif
+
 #include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <glib.h>
 
 #include "./macros.h"
 #include "./zreactor.h"
+#include "./zwheel.h"
+
+#define ZR_EPOLL_BATCH 64
+#define ZR_BUDGET 64
+#define ZR_TASKS 4096 // slots of the ring of posted tasks, a power of 2
+#define ZR_SPIN_MIN 5000 // ns, shortest spin in busy-poll mode
 
 struct zreactor_s
 {
-    GArray *items;  
-    GArray *monitors;
-    gboolean running;
+    GArray *items; // zmq_pollitem_t, poll backend only
+    GPtrArray *monitors; // (struct zmon_s*) same order than 'items'
+    GPtrArray *zk; // (struct zmon_s*) rearmed at each loop
+    GPtrArray *dirty; // (struct zmon_s*) interest changed
+    GPtrArray *removed; // (struct zmon_s*) to be released
+    volatile gint running;
+    struct zwheel_s *wheel;
+
+    // Tasks posted by other threads: bounded lock-free MPSC ring, a la
+    // Vyukov. The producers claim a slot by moving 'tasks_head', the reactor
+    // consumes at 'tasks_tail'. A slot is ready when its sequence number
+    // reaches its position plus one.
+    struct ztask_s *tasks;
+    volatile gint tasks_head;
+    guint tasks_tail;
+    volatile gint tasks_notified; // the eventfd has been written
+    int tasks_fd; // eventfd
+    int tasks_evt;
+
+    enum zreactor_backend_e backend;
+    int epfd; // epoll backend only
+    guint budget; // messages per turn and per unit of weight
+
+    // Busy-poll mode: spin up to twice the average inter-arrival time of
+    // the events, provided it is below 'spin_max'.
+    guint64 spin_max; // ns, 0 when disabled
+    gint64 arrival_ewma; // ns
+    guint64 last_arrival; // ns
+    int cpu; // pinned by zreactor_run(), if >= 0
+
+    struct zreactor_stats_s *stats; // NULL when disabled
+    guint turn_events; // handlers called during the current turn
+
+    // ZMQ monitors to be served at the next turn without being polled:
+    // leftovers of an exhausted budget, and (epoll) sockets signaled.
+    GPtrArray *check; // (struct zmon_s*)
 };
 
 struct zmon_s
@@ -33,17 +83,211 @@ struct zmon_s
             void *sock;
         } zmq;
     } data;
+
+    guint idx; // position in zr->monitors and zr->items
+    gboolean dirty; // already present in zr->dirty
+    gboolean removed; // already present in zr->removed
+    gboolean queued; // already present in zr->check
+    gboolean leftovers; // the handler reported messages left
+    guint weight; // ZMQ monitors only
+    gchar *name;
+    struct zhisto_s *stats; // handler durations, when enabled
+
+    // Only used by the epoll backend
+    int armed_fd; // the FD currently registered in the epoll set
+    int armed_evt; // the interest that FD has been registered with
+};
+
+struct ztask_s
+{
+    volatile gint seq;
+    zreactor_fn_task fn;
+    gpointer u;
 };
 
+// The reactor running in the current thread
+static GPrivate current_zr = G_PRIVATE_INIT(NULL);
+
 //------------------------------------------------------------------------------
 
+static inline gint64
+_now_ms(void)
+{
+    return g_get_monotonic_time() / 1000;
+}
+
+static inline guint64
+_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((guint64)ts.tv_sec * G_GUINT64_CONSTANT(1000000000)) + ts.tv_nsec;
+}
+
+static inline guint64
+_stats_start(struct zreactor_s *zr)
+{
+    return G_UNLIKELY(zr->stats != NULL) ? _now_ns() : 0;
+}
+
+static inline void
+_stats_handler(struct zreactor_s *zr, struct zmon_s *mon, guint64 t0)
+{
+    if (G_LIKELY(!zr->stats))
+        return;
+    ++ zr->turn_events;
+    if (mon->stats)
+        zhisto_record(mon->stats, _now_ns() - t0);
+}
+
+static inline void
+_stats_wait(struct zreactor_s *zr, guint64 t0)
+{
+    if (G_UNLIKELY(zr->stats != NULL))
+        zhisto_record(&zr->stats->poll_wait, _now_ns() - t0);
+}
+
+static inline void
+_stats_turn(struct zreactor_s *zr)
+{
+    if (G_LIKELY(!zr->stats))
+        return;
+    ++ zr->stats->loops;
+    if (zr->turn_events) {
+        ++ zr->stats->wakeups;
+        zhisto_record(&zr->stats->events, zr->turn_events);
+        zr->turn_events = 0;
+    }
+}
+
+static void
+_zmon_free(struct zmon_s *mon)
+{
+    if (mon->stats)
+        g_free(mon->stats);
+    if (mon->name)
+        g_free(mon->name);
+    g_free(mon);
+}
+
+static inline void
+_wakeup(struct zreactor_s *zr)
+{
+    uint64_t one = 1;
+    if (zr->tasks_fd >= 0)
+        (void) write(zr->tasks_fd, &one, sizeof(one));
+}
+
+/* Only one write per burst of posts, until the reactor drains the ring */
+static inline void
+_tasks_notify(struct zreactor_s *zr)
+{
+    if (g_atomic_int_compare_and_exchange(&zr->tasks_notified, 0, 1))
+        _wakeup(zr);
+}
+
+static gboolean
+_tasks_push(struct zreactor_s *zr, zreactor_fn_task fn, gpointer u)
+{
+    struct ztask_s *slot;
+    guint pos;
+
+    for (;;) {
+        pos = (guint) g_atomic_int_get(&zr->tasks_head);
+        slot = zr->tasks + (pos & (ZR_TASKS - 1));
+        gint diff = (gint) ((guint) g_atomic_int_get(&slot->seq) - pos);
+        if (diff < 0)
+            return FALSE; // full
+        if (!diff && g_atomic_int_compare_and_exchange(&zr->tasks_head,
+                    (gint)pos, (gint)(pos + 1)))
+            break;
+        // Claimed by another producer, retry
+    }
+
+    slot->fn = fn;
+    slot->u = u;
+    g_atomic_int_set(&slot->seq, (gint)(pos + 1));
+    return TRUE;
+}
+
+static gboolean
+_tasks_pop(struct zreactor_s *zr, struct ztask_s *out)
+{
+    guint pos = zr->tasks_tail;
+    struct ztask_s *slot = zr->tasks + (pos & (ZR_TASKS - 1));
+
+    // Empty, or the producer has not published it yet (it will notify)
+    if ((guint) g_atomic_int_get(&slot->seq) != pos + 1)
+        return FALSE;
+    out->fn = slot->fn;
+    out->u = slot->u;
+    g_atomic_int_set(&slot->seq, (gint)(pos + ZR_TASKS));
+    zr->tasks_tail = pos + 1;
+    return TRUE;
+}
+
+static int
+_run_posted_tasks(struct zreactor_s *zr, int fd, int evt)
+{
+    uint64_t count;
+    struct ztask_s task;
+    (void) evt;
+
+    while (0 < read(fd, &count, sizeof(count))) {}
+    g_atomic_int_set(&zr->tasks_notified, 0);
+
+    // At most a ring per turn, posts keep coming while we run
+    for (guint i=0; i < ZR_TASKS ;++i) {
+        if (!_tasks_pop(zr, &task))
+            return 0;
+        task.fn(task.u);
+    }
+    _tasks_notify(zr);
+    return 0;
+}
+
 struct zreactor_s *
 zreactor_create(void)
+{
+    return zreactor_create_backend(ZRB_POLL);
+}
+
+struct zreactor_s *
+zreactor_create_backend(enum zreactor_backend_e backend)
 {
     struct zreactor_s *zr = g_malloc0(sizeof(struct zreactor_s));
     zr->items = g_array_new(FALSE, FALSE, sizeof(zmq_pollitem_t));
-    zr->monitors = g_array_new(FALSE, FALSE, sizeof(struct zmon_s));
+    zr->monitors = g_ptr_array_new();
+    zr->zk = g_ptr_array_new();
+    zr->dirty = g_ptr_array_new();
+    zr->removed = g_ptr_array_new();
     zr->running = TRUE;
+    zr->wheel = zwheel_create(_now_ms());
+    zr->backend = backend;
+    zr->epfd = -1;
+    zr->budget = ZR_BUDGET;
+    zr->cpu = -1;
+    zr->check = g_ptr_array_new();
+
+    if (backend == ZRB_EPOLL) {
+        if (0 > (zr->epfd = epoll_create1(EPOLL_CLOEXEC))) {
+            g_warning("epoll_create1() failed (%d) %s, falling back to"
+                    " zmq_poll()", errno, g_strerror(errno));
+            zr->backend = ZRB_POLL;
+        }
+    }
+
+    zr->tasks = g_malloc0(ZR_TASKS * sizeof(struct ztask_s));
+    for (guint i=0; i < ZR_TASKS ;++i)
+        zr->tasks[i].seq = i;
+    zr->tasks_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (zr->tasks_fd < 0)
+        g_error("eventfd() failed : (%d) %s", errno, g_strerror(errno));
+    zr->tasks_evt = ZMQ_POLLIN;
+    struct zmon_s *mon = zreactor_add_fd(zr, zr->tasks_fd, &(zr->tasks_evt),
+            (zreactor_fn_fd)_run_posted_tasks, zr);
+    zreactor_set_name(zr, mon, "tasks");
+
     return zr;
 }
 
@@ -54,8 +298,29 @@ zreactor_destroy(struct zreactor_s *zr)
         return;
     if (zr->items)
         g_array_free(zr->items, TRUE);
-    if (zr->monitors)
-        g_array_free(zr->monitors, TRUE);
+    if (zr->monitors) {
+        for (guint i=0; i < zr->monitors->len ;++i)
+            _zmon_free(zr->monitors->pdata[i]);
+        g_ptr_array_free(zr->monitors, TRUE);
+    }
+    if (zr->zk)
+        g_ptr_array_free(zr->zk, TRUE);
+    if (zr->dirty)
+        g_ptr_array_free(zr->dirty, TRUE);
+    if (zr->removed)
+        g_ptr_array_free(zr->removed, TRUE);
+    if (zr->check)
+        g_ptr_array_free(zr->check, TRUE);
+    if (zr->wheel)
+        zwheel_destroy(zr->wheel);
+    if (zr->stats)
+        zreactor_stats_free(zr->stats);
+    if (zr->epfd >= 0)
+        close(zr->epfd);
+    if (zr->tasks) // Not run, their targets are probably gone
+        g_free(zr->tasks);
+    if (zr->tasks_fd >= 0)
+        close(zr->tasks_fd);
     g_free(zr);
 }
 
@@ -63,84 +328,563 @@ void
 zreactor_stop(struct zreactor_s *zr)
 {
     ASSERT(zr != NULL);
-    zr->running = FALSE;
+    g_atomic_int_set(&(zr->running), FALSE);
+    _wakeup(zr);
+}
+
+gboolean
+zreactor_is_current(struct zreactor_s *zr)
+{
+    return zr != NULL && g_private_get(&current_zr) == zr;
+}
+
+gboolean
+zreactor_try_post(struct zreactor_s *zr, zreactor_fn_task fn, gpointer u)
+{
+    ASSERT(zr != NULL);
+    ASSERT(fn != NULL);
+
+    if (!_tasks_push(zr, fn, u))
+        return FALSE;
+    _tasks_notify(zr);
+    return TRUE;
 }
 
 void
-zreactor_add_zk(struct zreactor_s *zr, zhandle_t *zh)
+zreactor_post(struct zreactor_s *zr, zreactor_fn_task fn, gpointer u)
 {
-    struct zmon_s mon;
-    zmq_pollitem_t item = {NULL,-1,0,0};
+    ASSERT(zr != NULL);
+    ASSERT(fn != NULL);
+
+    while (!_tasks_push(zr, fn, u)) {
+        // The reactor cannot drain the ring while we wait for it
+        if (zreactor_is_current(zr))
+            _run_posted_tasks(zr, zr->tasks_fd, ZMQ_POLLIN);
+        else {
+            _tasks_notify(zr);
+            g_thread_yield();
+        }
+    }
+    _tasks_notify(zr);
+}
 
-    mon.type = ZMT_ZK;
-    mon.data.zh = zh;
-    g_array_prepend_vals(zr->monitors, &mon, 1);
-    g_array_prepend_vals(zr->items, &item, 1);
+struct ztimer_s *
+zreactor_add_timer(struct zreactor_s *zr, guint delay,
+        zreactor_fn_timer fn, gpointer fnu)
+{
+    ASSERT(zr != NULL);
+    ASSERT(fn != NULL);
+    return zwheel_add(zr->wheel, _now_ms() + delay, fn, fnu);
+}
+
+void
+zreactor_cancel_timer(struct zreactor_s *zr, struct ztimer_s *t)
+{
+    ASSERT(zr != NULL);
+    if (t)
+        zwheel_cancel(zr->wheel, t);
+}
+
+static inline void
+_check_later(struct zreactor_s *zr, struct zmon_s *mon)
+{
+    if (!mon->queued) {
+        mon->queued = TRUE;
+        g_ptr_array_add(zr->check, mon);
+    }
 }
 
 void
+zreactor_check_later(struct zreactor_s *zr, struct zmon_s *mon)
+{
+    ASSERT(zr != NULL);
+    ASSERT(mon != NULL);
+    ASSERT(mon->type == ZMT_ZMQ);
+    if (mon->removed)
+        return;
+    mon->leftovers = TRUE;
+    _check_later(zr, mon);
+}
+
+static inline guint32
+_zevt_to_epoll(int evt)
+{
+    return ((evt & ZMQ_POLLIN) ? EPOLLIN : 0)
+        | ((evt & ZMQ_POLLOUT) ? EPOLLOUT : 0);
+}
+
+static inline int
+_epoll_to_zevt(guint32 evt)
+{
+    return ((evt & EPOLLIN) ? ZMQ_POLLIN : 0)
+        | ((evt & EPOLLOUT) ? ZMQ_POLLOUT : 0)
+        | ((evt & (EPOLLERR|EPOLLHUP)) ? ZMQ_POLLERR : 0);
+}
+
+static int
+_epoll_register(struct zreactor_s *zr, struct zmon_s *mon, int fd,
+        guint32 events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = mon;
+    if (0 > epoll_ctl(zr->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        g_warning("epoll_ctl(ADD,%d) failed : (%d) %s", fd,
+                errno, g_strerror(errno));
+        return -1;
+    }
+
+    mon->armed_fd = fd;
+    return 0;
+}
+
+static void
+_epoll_unregister(struct zreactor_s *zr, struct zmon_s *mon)
+{
+    struct epoll_event ev;
+
+    if (mon->armed_fd < 0)
+        return;
+    epoll_ctl(zr->epfd, EPOLL_CTL_DEL, mon->armed_fd, &ev);
+    mon->armed_fd = -1;
+}
+
+static struct zmon_s *
+_zmon_register(struct zreactor_s *zr, enum zmon_type_e type)
+{
+    zmq_pollitem_t item = {NULL,-1,0,0};
+    struct zmon_s *mon = g_malloc0(sizeof(struct zmon_s));
+
+    mon->type = type;
+    mon->armed_fd = -1;
+    mon->idx = zr->monitors->len;
+    if (zr->stats)
+        mon->stats = g_malloc0(sizeof(struct zhisto_s));
+    g_ptr_array_add(zr->monitors, mon);
+    g_array_append_vals(zr->items, &item, 1);
+    return mon;
+}
+
+/* Actually forget the monitors removed since the last loop. The positions
+ * are kept dense by moving the last monitor in the free slot. */
+static void
+_purge_removed(struct zreactor_s *zr)
+{
+    gboolean _is_removed(gpointer p) {
+        return ((struct zmon_s*)p)->removed;
+    }
+    void _filter(GPtrArray *gpa) {
+        for (guint i=0; i < gpa->len ;) {
+            if (_is_removed(gpa->pdata[i]))
+                g_ptr_array_remove_index_fast(gpa, i);
+            else
+                ++ i;
+        }
+    }
+
+    if (!zr->removed->len)
+        return;
+
+    _filter(zr->dirty);
+    _filter(zr->check);
+
+    for (guint i=0; i < zr->removed->len ;++i) {
+        struct zmon_s *mon = zr->removed->pdata[i];
+        guint last = zr->monitors->len - 1;
+
+        if (mon->idx != last) {
+            struct zmon_s *moved = zr->monitors->pdata[last];
+            zr->monitors->pdata[mon->idx] = moved;
+            g_array_index(zr->items, zmq_pollitem_t, mon->idx) =
+                g_array_index(zr->items, zmq_pollitem_t, last);
+            moved->idx = mon->idx;
+        }
+        g_ptr_array_set_size(zr->monitors, last);
+        g_array_set_size(zr->items, last);
+
+        if (mon->type == ZMT_ZK)
+            g_ptr_array_remove_fast(zr->zk, mon);
+        _zmon_free(mon);
+    }
+
+    g_ptr_array_set_size(zr->removed, 0);
+}
+
+struct zmon_s *
+zreactor_add_zk(struct zreactor_s *zr, zhandle_t *zh)
+{
+    struct zmon_s *mon = _zmon_register(zr, ZMT_ZK);
+    mon->data.zh = zh;
+    g_ptr_array_add(zr->zk, mon);
+    return mon;
+}
+
+struct zmon_s *
 zreactor_add_zmq(struct zreactor_s *zr, void *s, int *evt,
         zreactor_fn_zmq fn, gpointer fnu)
 {
-    struct zmon_s mon;
-    zmq_pollitem_t item = {NULL,-1,0,0};
+    struct zmon_s *mon = _zmon_register(zr, ZMT_ZMQ);
+    mon->data.zmq.evt = evt;
+    mon->data.zmq.ctx = fnu;
+    mon->data.zmq.handler = fn;
+    mon->data.zmq.sock = s;
+    mon->weight = 1;
 
-    mon.type = ZMT_ZMQ;
-    mon.data.zmq.evt = evt;
-    mon.data.zmq.ctx = fnu;
-    mon.data.zmq.handler = fn;
-    mon.data.zmq.sock = s;
-    g_array_append_vals(zr->monitors, &mon, 1);
+    g_array_index(zr->items, zmq_pollitem_t, mon->idx).socket = s;
 
-    item.socket = s;
-    item.fd = -1;
-    g_array_append_vals(zr->items, &item, 1);
+    if (zr->backend == ZRB_EPOLL) {
+        // ZMQ_FD is edge-triggered and only signals that ZMQ_EVENTS may
+        // have changed, whatever the direction.
+        int fd = -1;
+        size_t fdlen = sizeof(fd);
+        if (0 > zmq_getsockopt(s, ZMQ_FD, &fd, &fdlen))
+            g_error("ZMQ_FD not available : (%d) %s", errno, g_strerror(errno));
+        _epoll_register(zr, mon, fd, EPOLLIN|EPOLLET);
+    }
+
+    zreactor_mark_dirty(zr, mon);
+    return mon;
 }
 
-void
+struct zmon_s *
 zreactor_add_fd(struct zreactor_s *zr, int fd, int *evt,
         zreactor_fn_fd fn, gpointer fnu)
 {
-    struct zmon_s mon;
-    zmq_pollitem_t item = {NULL,-1,0,0};
+    struct zmon_s *mon = _zmon_register(zr, ZMT_FD);
+    mon->data.fd.evt = evt;
+    mon->data.fd.ctx = fnu;
+    mon->data.fd.handler = fn;
+    mon->data.fd.fd = fd;
 
-    mon.type = ZMT_FD;
-    mon.data.fd.evt = evt;
-    mon.data.fd.ctx = fnu;
-    mon.data.fd.handler = fn;
-    mon.data.fd.fd = fd;
-    g_array_append_vals(zr->monitors, &mon, 1);
+    g_array_index(zr->items, zmq_pollitem_t, mon->idx).fd = fd;
 
-    item.fd = fd;
-    g_array_append_vals(zr->items, &item, 1);
+    if (zr->backend == ZRB_EPOLL) {
+        mon->armed_evt = *evt;
+        _epoll_register(zr, mon, fd, _zevt_to_epoll(*evt));
+    }
+
+    zreactor_mark_dirty(zr, mon);
+    return mon;
+}
+
+void
+zreactor_mark_dirty(struct zreactor_s *zr, struct zmon_s *mon)
+{
+    ASSERT(zr != NULL);
+    ASSERT(mon != NULL);
+    if (!mon->dirty && !mon->removed) {
+        mon->dirty = TRUE;
+        g_ptr_array_add(zr->dirty, mon);
+    }
+}
+
+void
+zreactor_set_budget(struct zreactor_s *zr, guint budget)
+{
+    ASSERT(zr != NULL);
+    zr->budget = MAX(budget, 1);
+}
+
+void
+zreactor_set_weight(struct zreactor_s *zr, struct zmon_s *mon, guint weight)
+{
+    ASSERT(zr != NULL);
+    ASSERT(mon != NULL);
+    (void) zr;
+    mon->weight = MAX(weight, 1);
+}
+
+void
+zreactor_set_busy_poll(struct zreactor_s *zr, guint spin_us)
+{
+    ASSERT(zr != NULL);
+    zr->spin_max = (guint64)spin_us * 1000;
+    zr->arrival_ewma = zr->spin_max / 2;
+    zr->last_arrival = 0;
+}
+
+void
+zreactor_set_cpu(struct zreactor_s *zr, int cpu)
+{
+    ASSERT(zr != NULL);
+    zr->cpu = cpu;
+}
+
+void
+zreactor_set_name(struct zreactor_s *zr, struct zmon_s *mon,
+        const gchar *name)
+{
+    ASSERT(zr != NULL);
+    ASSERT(mon != NULL);
+    (void) zr;
+    if (mon->name)
+        g_free(mon->name);
+    mon->name = g_strdup(name);
+}
+
+void
+zreactor_enable_stats(struct zreactor_s *zr, gboolean on)
+{
+    ASSERT(zr != NULL);
+
+    if (!on == !zr->stats)
+        return;
+    if (on)
+        zr->stats = g_malloc0(sizeof(struct zreactor_stats_s));
+    else {
+        zreactor_stats_free(zr->stats);
+        zr->stats = NULL;
+    }
+    for (guint i=0; i < zr->monitors->len ;++i) {
+        struct zmon_s *mon = zr->monitors->pdata[i];
+        if (mon->stats)
+            g_free(mon->stats);
+        mon->stats = on ? g_malloc0(sizeof(struct zhisto_s)) : NULL;
+    }
+    zr->turn_events = 0;
+}
+
+static gchar *
+_zmon_name(struct zmon_s *mon)
+{
+    if (mon->name)
+        return g_strdup(mon->name);
+    switch (mon->type) {
+        case ZMT_ZMQ:
+            return g_strdup_printf("zmq:%p", mon->data.zmq.sock);
+        case ZMT_ZK:
+            return g_strdup("zk");
+        case ZMT_FD:
+            return g_strdup_printf("fd:%d", mon->data.fd.fd);
+        default:
+            g_assert_not_reached();
+            return NULL;
+    }
+}
+
+struct zreactor_stats_s *
+zreactor_get_stats(struct zreactor_s *zr, gboolean reset)
+{
+    ASSERT(zr != NULL);
+
+    if (!zr->stats)
+        return NULL;
+
+    struct zreactor_stats_s *st = g_new(struct zreactor_stats_s, 1);
+    memcpy(st, zr->stats, sizeof(struct zreactor_stats_s));
+    st->monitors = g_ptr_array_new();
+    for (guint i=0; i < zr->monitors->len ;++i) {
+        struct zmon_s *mon = zr->monitors->pdata[i];
+        if (mon->removed || !mon->stats)
+            continue;
+        struct zmon_stats_s *ms = g_malloc(sizeof(struct zmon_stats_s));
+        ms->name = _zmon_name(mon);
+        memcpy(&ms->duration, mon->stats, sizeof(struct zhisto_s));
+        g_ptr_array_add(st->monitors, ms);
+        if (reset)
+            zhisto_reset(mon->stats);
+    }
+
+    if (reset)
+        memset(zr->stats, 0, sizeof(struct zreactor_stats_s));
+    return st;
+}
+
+void
+zreactor_stats_free(struct zreactor_stats_s *st)
+{
+    if (!st)
+        return;
+    if (st->monitors) {
+        for (guint i=0; i < st->monitors->len ;++i) {
+            struct zmon_stats_s *ms = st->monitors->pdata[i];
+            g_free(ms->name);
+            g_free(ms);
+        }
+        g_ptr_array_free(st->monitors, TRUE);
+    }
+    g_free(st);
+}
+
+void
+zreactor_remove(struct zreactor_s *zr, struct zmon_s *mon)
+{
+    ASSERT(zr != NULL);
+    if (!mon || mon->removed)
+        return;
+
+    // Released at the next loop, the current one may still hold it.
+    mon->removed = TRUE;
+    g_ptr_array_add(zr->removed, mon);
+    g_array_index(zr->items, zmq_pollitem_t, mon->idx).events = 0;
+    if (zr->backend == ZRB_EPOLL)
+        _epoll_unregister(zr, mon);
+}
+
+static inline void
+_fire_timers(struct zreactor_s *zr)
+{
+    zwheel_advance(zr->wheel, _now_ms());
+}
+
+/* The next expiry shortens the delay computed for the monitors */
+static inline glong
+_timers_delay(struct zreactor_s *zr, glong delay)
+{
+    gint64 next = zwheel_next_expiry(zr->wheel);
+    if (next < 0)
+        return delay;
+    gint64 now = _now_ms();
+    return (next <= now) ? 0 : MIN(delay, next - now);
+}
+
+static inline glong
+_get_zk_interest(zhandle_t *zh, int *pfd, int *pevt)
+{
+    int evt;
+    struct timeval tv;
+
+    zookeeper_interest(zh, pfd, &evt, &tv);
+    *pevt = ((evt & ZOOKEEPER_READ) ? ZMQ_POLLIN : 0)
+        | ((evt & ZOOKEEPER_WRITE) ? ZMQ_POLLOUT : 0);
+    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
+static inline int
+_zmq_ready_events(struct zmon_s *mon)
+{
+    int evt = 0;
+    size_t evtlen = sizeof(evt);
+    if (0 > zmq_getsockopt(mon->data.zmq.sock, ZMQ_EVENTS, &evt, &evtlen))
+        return 0;
+    return evt & *(mon->data.zmq.evt);
+}
+
+/* Returns TRUE if the handler left messages in the socket */
+static inline gboolean
+_zmq_dispatch(struct zreactor_s *zr, struct zmon_s *mon, int evt)
+{
+    guint64 t0 = _stats_start(zr);
+    int rc = mon->data.zmq.handler(mon->data.zmq.ctx, mon->data.zmq.sock,
+            evt, mon->weight * zr->budget);
+    _stats_handler(zr, mon, t0);
+    mon->leftovers = rc > 0;
+    return rc > 0 && !mon->removed;
+}
+
+/* The events of a monitor served again, the messages left may be held by
+ * the handler itself (e.g. an envelope being unpacked) */
+static inline int
+_zmq_leftover_events(struct zmon_s *mon)
+{
+    int evt = _zmq_ready_events(mon);
+    if (mon->leftovers)
+        evt |= *(mon->data.zmq.evt) & ZMQ_POLLIN;
+    return evt;
+}
+
+static inline void
+_fd_dispatch(struct zreactor_s *zr, struct zmon_s *mon, int evt)
+{
+    guint64 t0 = _stats_start(zr);
+    mon->data.fd.handler(mon->data.fd.ctx, mon->data.fd.fd, evt);
+    _stats_handler(zr, mon, t0);
+}
+
+static inline int
+_zk_process(struct zreactor_s *zr, struct zmon_s *mon, int evt)
+{
+    guint64 t0 = _stats_start(zr);
+    int rc = zookeeper_process(mon->data.zh, evt);
+    if (G_UNLIKELY(zr->stats != NULL)) {
+        ++ zr->stats->zk_process;
+        zhisto_record(&zr->stats->zk_duration, _now_ns() - t0);
+        _stats_handler(zr, mon, t0);
+    }
+    if (rc==ZOK || rc==ZNOTHING)
+        return 0;
+    // The client reconnects on its own, an expired session is renewed by
+    // its owner (see zstore.c): none of them must stop the data plane.
+    if (rc==ZCONNECTIONLOSS || rc==ZOPERATIONTIMEOUT || rc==ZSESSIONEXPIRED
+            || rc==ZINVALIDSTATE || rc==ZCLOSING) {
+        g_debug("ZK process error : %d", rc);
+        return 0;
+    }
+    return -1;
+}
+
+/* Takes the monitors to be served at this turn. Those re-queued while they
+ * are served go to the next turn. */
+static inline GPtrArray *
+_take_checks(struct zreactor_s *zr)
+{
+    GPtrArray *todo = zr->check;
+    zr->check = g_ptr_array_sized_new(MAX(todo->len, 8));
+    return todo;
+}
+
+/* How long to spin before blocking, in ns */
+static inline guint64
+_spin_budget(struct zreactor_s *zr, glong delay)
+{
+    if (G_LIKELY(!zr->spin_max) || !delay)
+        return 0;
+    // The next event will probably come too late
+    if ((guint64)zr->arrival_ewma > zr->spin_max)
+        return 0;
+    guint64 spin = MAX(2 * (guint64)zr->arrival_ewma, ZR_SPIN_MIN);
+    spin = MIN(spin, zr->spin_max);
+    return MIN(spin, (guint64)delay * 1000000);
+}
+
+static inline int
+_note_arrival(struct zreactor_s *zr, int rc, gboolean spun)
+{
+    if (G_LIKELY(!zr->spin_max) || rc <= 0)
+        return rc;
+    guint64 now = _now_ns();
+    if (zr->last_arrival)
+        zr->arrival_ewma += ((gint64)(now - zr->last_arrival)
+                - zr->arrival_ewma) / 8;
+    zr->last_arrival = now;
+    if (spun && zr->stats)
+        ++ zr->stats->spin_hits;
+    return rc;
+}
+
+//------------------------------------------------------------------------------
+// zmq_poll() backend
+
 static inline int
 _manage_one_event(struct zreactor_s *zr, guint i)
 {
-    int rc, evt;
+    int evt;
     zmq_pollitem_t *item = &g_array_index(zr->items, zmq_pollitem_t, i);
-    struct zmon_s *mon = &g_array_index(zr->monitors, struct zmon_s, i);
+    struct zmon_s *mon = zr->monitors->pdata[i];
     //g_debug("EVT [%u] EVT[%x/%x]", i, item->revents, item->events);
 
+    if (mon->removed)
+        return 0;
+
     switch (mon->type) {
 
         case ZMT_ZMQ:
-            if (item->revents)
-                mon->data.zmq.handler(mon->data.zmq.ctx, mon->data.zmq.sock,
-                        item->revents);
+            // Already queued sockets are served with the leftovers
+            if (item->revents && !mon->queued) {
+                if (_zmq_dispatch(zr, mon, item->revents))
+                    _check_later(zr, mon);
+            }
             return 0;
 
         case ZMT_ZK:
             evt = (item->revents & ZMQ_POLLIN ? ZOOKEEPER_READ : 0)
                 | (item->revents & ZMQ_POLLOUT ? ZOOKEEPER_WRITE : 0);
-            rc = zookeeper_process(mon->data.zh, evt);
-            return (rc==ZOK || rc==ZNOTHING) ? 0 : -1;
+            return _zk_process(zr, mon, evt);
 
         case ZMT_FD:
             if (item->revents)
-                mon->data.fd.handler(mon->data.fd.ctx, mon->data.fd.fd,
-                        item->revents);
+                _fd_dispatch(zr, mon, item->revents);
             return 0;
 
         default:
@@ -153,65 +897,84 @@ static inline int
 _manage_all_events(struct zreactor_s *zr)
 {
     guint i, max;
-    gboolean stopped = FALSE;
 
     for (i=0,max=zr->items->len; i < max ;++i) {
         int rc = _manage_one_event(zr, i);
         if (rc)
             return rc;
-        if (stopped)
-            return 1;
     }
 
     return 0;
 }
 
+/* The leftovers of the previous turn, served after the sockets that just
+ * became ready. */
+static void
+_poll_serve_leftovers(struct zreactor_s *zr, GPtrArray *todo)
+{
+    for (guint i=0; i < todo->len ;++i) {
+        struct zmon_s *mon = todo->pdata[i];
+        mon->queued = FALSE;
+        if (mon->removed)
+            continue;
+        int evt = _zmq_leftover_events(mon);
+        if (evt && _zmq_dispatch(zr, mon, evt))
+            _check_later(zr, mon);
+    }
+    g_ptr_array_free(todo, TRUE);
+}
+
 static inline glong
 _rearm_zk_item_and_get_delay(struct zmon_s *mon, zmq_pollitem_t *item)
 {
     int fd, evt;
-    struct timeval tv;
+    glong delay = _get_zk_interest(mon->data.zh, &fd, &evt);
 
-    zookeeper_interest(mon->data.zh, &fd, &evt, &tv);
     item->socket = NULL;
     item->fd = fd;
     item->revents = 0;
-    item->events = ZMQ_POLLERR
-        | ((evt & ZOOKEEPER_READ) ? ZMQ_POLLIN : 0)
-        | ((evt & ZOOKEEPER_WRITE) ? ZMQ_POLLOUT : 0);
-    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+    item->events = ZMQ_POLLERR | evt;
+    return delay;
 }
 
-static inline glong
-_rearm_one_item_and_get_delay(struct zmon_s *mon, zmq_pollitem_t *item)
+static inline void
+_rearm_one_item(struct zmon_s *mon, zmq_pollitem_t *item)
 {
     switch (mon->type) {
         case ZMT_ZMQ:
             item->events = *(mon->data.zmq.evt);
-            return -1;
+            return;
         case ZMT_ZK:
-            return _rearm_zk_item_and_get_delay(mon, item);
+            return;
         case ZMT_FD:
             item->events = *(mon->data.fd.evt);
-            return -1;
+            return;
         default:
             g_assert_not_reached();
-            return -1;
+            return;
     }
 }
 
+/* Only the dirty monitors are rearmed, plus the ZooKeeper handles whose
+ * interest changes on their own. */
 static glong
 _rearm_all_items_and_get_delay(struct zreactor_s *zr)
 {
     guint i, max;
     glong d, delay = 60000;
 
-    for (i=0,max=zr->monitors->len; i < max ;++i) {
-        d = _rearm_one_item_and_get_delay(
-                &g_array_index(zr->monitors, struct zmon_s, i),
-                &g_array_index(zr->items, zmq_pollitem_t, i));
-        if (d < 0)
-            continue;
+    for (i=0,max=zr->dirty->len; i < max ;++i) {
+        struct zmon_s *mon = zr->dirty->pdata[i];
+        mon->dirty = FALSE;
+        _rearm_one_item(mon, &g_array_index(zr->items, zmq_pollitem_t,
+                    mon->idx));
+    }
+    g_ptr_array_set_size(zr->dirty, 0);
+
+    for (i=0,max=zr->zk->len; i < max ;++i) {
+        struct zmon_s *mon = zr->zk->pdata[i];
+        d = _rearm_zk_item_and_get_delay(mon,
+                &g_array_index(zr->items, zmq_pollitem_t, mon->idx));
         if (delay > d)
             delay = d;
     }
@@ -220,15 +983,244 @@ _rearm_all_items_and_get_delay(struct zreactor_s *zr)
 }
 
 static int
-_zreactor_run_step(struct zreactor_s *zr)
+_poll_wait(struct zreactor_s *zr, glong delay)
 {
-    int rc = zmq_poll((zmq_pollitem_t*)zr->items->data, zr->items->len,
-            _rearm_all_items_and_get_delay(zr));
-    if (rc <= 0) // Timeout or error
+    int rc;
+    zmq_pollitem_t *items = (zmq_pollitem_t*) zr->items->data;
+    guint64 spin = _spin_budget(zr, delay);
+
+    if (spin) {
+        guint64 start = _now_ns();
+        do {
+            if (0 != (rc = zmq_poll(items, zr->items->len, 0)))
+                return _note_arrival(zr, rc, TRUE);
+        } while (_now_ns() - start < spin);
+        delay = MAX(0, delay - (glong)(spin / 1000000));
+    }
+
+    return _note_arrival(zr, zmq_poll(items, zr->items->len, delay), FALSE);
+}
+
+static int
+_zreactor_run_step_poll(struct zreactor_s *zr)
+{
+    _fire_timers(zr);
+    _purge_removed(zr);
+    glong delay = _timers_delay(zr, _rearm_all_items_and_get_delay(zr));
+    if (zr->check->len)
+        delay = 0;
+
+    guint64 t0 = _stats_start(zr);
+    int rc = _poll_wait(zr, delay);
+    _stats_wait(zr, t0);
+    if (rc < 0)
         return rc;
-    return _manage_all_events(zr);
+
+    GPtrArray *todo = _take_checks(zr);
+    if (rc > 0)
+        rc = _manage_all_events(zr);
+    _poll_serve_leftovers(zr, todo);
+    _stats_turn(zr);
+    return rc;
 }
 
+//------------------------------------------------------------------------------
+// epoll backend
+
+static void
+_epoll_rearm_zk(struct zreactor_s *zr, struct zmon_s *mon, int fd, int evt)
+{
+    struct epoll_event ev;
+
+    // The ZooKeeper client opens a new socket at each reconnection, often
+    // with the number of the one it closed, which left the epoll set. So
+    // the registration is refreshed even when nothing seems to change.
+    if (mon->armed_fd != fd)
+        _epoll_unregister(zr, mon);
+
+    mon->armed_evt = evt;
+    if (fd < 0)
+        return;
+
+    if (mon->armed_fd < 0)
+        _epoll_register(zr, mon, fd, _zevt_to_epoll(evt));
+    else {
+        ev.events = _zevt_to_epoll(evt);
+        ev.data.ptr = mon;
+        if (0 > epoll_ctl(zr->epfd, EPOLL_CTL_MOD, fd, &ev)) {
+            mon->armed_fd = -1;
+            if (errno == ENOENT)
+                _epoll_register(zr, mon, fd, ev.events);
+            else
+                g_warning("epoll_ctl(MOD,%d) failed : (%d) %s", fd,
+                        errno, g_strerror(errno));
+        }
+    }
+}
+
+static void
+_epoll_rearm_one(struct zreactor_s *zr, struct zmon_s *mon)
+{
+    int evt;
+    struct epoll_event ev;
+
+    switch (mon->type) {
+        case ZMT_ZMQ:
+            evt = *(mon->data.zmq.evt);
+            // New interests must be checked against the current state of the
+            // socket: the edge may already have been consumed.
+            if (evt & ~mon->armed_evt)
+                _check_later(zr, mon);
+            mon->armed_evt = evt;
+            return;
+        case ZMT_ZK:
+            return;
+        case ZMT_FD:
+            evt = *(mon->data.fd.evt);
+            if (evt != mon->armed_evt && mon->armed_fd >= 0) {
+                ev.events = _zevt_to_epoll(evt);
+                ev.data.ptr = mon;
+                epoll_ctl(zr->epfd, EPOLL_CTL_MOD, mon->armed_fd, &ev);
+            }
+            mon->armed_evt = evt;
+            return;
+        default:
+            g_assert_not_reached();
+            return;
+    }
+}
+
+static glong
+_epoll_rearm_all_and_get_delay(struct zreactor_s *zr)
+{
+    guint i, max;
+    glong d, delay = 60000;
+
+    for (i=0,max=zr->dirty->len; i < max ;++i) {
+        struct zmon_s *mon = zr->dirty->pdata[i];
+        mon->dirty = FALSE;
+        _epoll_rearm_one(zr, mon);
+    }
+    g_ptr_array_set_size(zr->dirty, 0);
+
+    for (i=0,max=zr->zk->len; i < max ;++i) {
+        int fd, evt;
+        struct zmon_s *mon = zr->zk->pdata[i];
+        d = _get_zk_interest(mon->data.zh, &fd, &evt);
+        _epoll_rearm_zk(zr, mon, fd, evt);
+        if (delay > d)
+            delay = d;
+    }
+
+    return delay;
+}
+
+static void
+_epoll_check_zmq(struct zreactor_s *zr)
+{
+    if (!zr->check->len)
+        return;
+
+    // Monitors still ready after their handler are queued for the next
+    // step, in the new array.
+    GPtrArray *todo = _take_checks(zr);
+
+    for (guint i=0; i < todo->len ;++i) {
+        struct zmon_s *mon = todo->pdata[i];
+        mon->queued = FALSE;
+        if (mon->removed)
+            continue;
+
+        int evt = _zmq_leftover_events(mon);
+        if (!evt)
+            continue;
+
+        // The handler probably consumed the edge signaled by ZMQ_FD, nothing
+        // will wake us up anymore if it didn't drain the socket.
+        if (_zmq_dispatch(zr, mon, evt)
+                || (!mon->removed && _zmq_ready_events(mon)))
+            _check_later(zr, mon);
+    }
+
+    g_ptr_array_free(todo, TRUE);
+}
+
+static int
+_epoll_manage_one_event(struct zreactor_s *zr, struct epoll_event *ev)
+{
+    int evt;
+    struct zmon_s *mon = ev->data.ptr;
+
+    if (mon->removed)
+        return 0;
+
+    switch (mon->type) {
+        case ZMT_ZMQ:
+            _check_later(zr, mon);
+            return 0;
+        case ZMT_ZK:
+            evt = ((ev->events & EPOLLIN) ? ZOOKEEPER_READ : 0)
+                | ((ev->events & EPOLLOUT) ? ZOOKEEPER_WRITE : 0);
+            return _zk_process(zr, mon, evt);
+        case ZMT_FD:
+            evt = _epoll_to_zevt(ev->events);
+            if (evt)
+                _fd_dispatch(zr, mon, evt);
+            return 0;
+        default:
+            g_assert_not_reached();
+            return -1;
+    }
+}
+
+static int
+_epoll_wait(struct zreactor_s *zr, struct epoll_event *evs, glong delay)
+{
+    int rc;
+    guint64 spin = _spin_budget(zr, delay);
+
+    if (spin) {
+        guint64 start = _now_ns();
+        do {
+            if (0 != (rc = epoll_wait(zr->epfd, evs, ZR_EPOLL_BATCH, 0)))
+                return _note_arrival(zr, rc, TRUE);
+        } while (_now_ns() - start < spin);
+        delay = MAX(0, delay - (glong)(spin / 1000000));
+    }
+
+    return _note_arrival(zr, epoll_wait(zr->epfd, evs, ZR_EPOLL_BATCH, delay),
+            FALSE);
+}
+
+static int
+_zreactor_run_step_epoll(struct zreactor_s *zr)
+{
+    struct epoll_event evs[ZR_EPOLL_BATCH];
+
+    _fire_timers(zr);
+    _purge_removed(zr);
+    glong delay = _timers_delay(zr, _epoll_rearm_all_and_get_delay(zr));
+    if (zr->check->len)
+        delay = 0;
+
+    guint64 t0 = _stats_start(zr);
+    int rc = _epoll_wait(zr, evs, delay);
+    _stats_wait(zr, t0);
+    if (rc < 0)
+        return rc;
+
+    for (int i=0; i < rc ;++i) {
+        if (0 != _epoll_manage_one_event(zr, evs+i))
+            return -1;
+    }
+
+    _epoll_check_zmq(zr);
+    _stats_turn(zr);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+
 int
 zreactor_run(struct zreactor_s *zr)
 {
@@ -236,8 +1228,24 @@ zreactor_run(struct zreactor_s *zr)
     ASSERT(zr->items != NULL);
     ASSERT(zr->monitors != NULL);
     ASSERT(zr->items->len == zr->monitors->len);
-    while (zr->running && !_zreactor_run_step(zr)) {}
+    g_private_set(&current_zr, zr);
+    if (zr->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(zr->cpu, &set);
+        if (0 > sched_setaffinity(0, sizeof(set), &set))
+            g_warning("Reactor not pinned on CPU %d : (%d) %s", zr->cpu,
+                    errno, g_strerror(errno));
+    }
+    if (zr->backend == ZRB_EPOLL) {
+        while (g_atomic_int_get(&(zr->running))
+                && !_zreactor_run_step_epoll(zr)) {}
+    }
+    else {
+        while (g_atomic_int_get(&(zr->running))
+                && !_zreactor_run_step_poll(zr)) {}
+    }
+    g_private_set(&current_zr, NULL);
     g_debug("Reactor LOOP exited");
-    return zr->running;
+    return g_atomic_int_get(&(zr->running));
 }
-
@@ -2,27 +2,139 @@
 # define TECHFORUM_zreactor_h 1
 # include <zmq.h>
 # include <zookeeper.h>
+# include "./zhisto.h"
 
 struct zreactor_s;
 
 typedef int (*zreactor_fn_fd)  (void *u, int fd, int e);
 
-typedef int (*zreactor_fn_zmq) (void *u, void *s, int e);
+/* 'budget' is the number of messages the handler may consume. It returns
+ * a positive value when it left messages because the budget was exhausted,
+ * the socket is then served again at the next turn without being polled,
+ * with ZMQ_POLLIN even if the messages left are held by the handler. */
+typedef int (*zreactor_fn_zmq) (void *u, void *s, int e, guint budget);
 
+typedef void (*zreactor_fn_timer) (void *u);
+
+typedef void (*zreactor_fn_task) (void *u);
+
+struct ztimer_s;
+
+enum zreactor_backend_e
+{
+    ZRB_POLL = 0, // zmq_poll() on an array of all the monitors
+    ZRB_EPOLL,    // epoll set, FD registered once (Linux only)
+};
+
+/* Same as zreactor_create_backend(ZRB_POLL) */
 struct zreactor_s* zreactor_create(void);
 
+struct zreactor_s* zreactor_create_backend(enum zreactor_backend_e backend);
+
 void zreactor_destroy(struct zreactor_s *zr);
 
+/* Can be called from any thread */
 void zreactor_stop(struct zreactor_s *zr);
 
 int zreactor_run(struct zreactor_s *zr);
 
-void zreactor_add_zk(struct zreactor_s *zr, zhandle_t *zh);
+/* Tells if the reactor is running in the calling thread */
+gboolean zreactor_is_current(struct zreactor_s *zr);
+
+/* Can be called from any thread. 'fn' will be called by the thread running
+ * the reactor, in the order of the calls to zreactor_post(). Lock-free and
+ * allocation free, a burst of posts costs a single wakeup. Waits for room
+ * when the queue (4096 tasks) is full. */
+void zreactor_post(struct zreactor_s *zr, zreactor_fn_task fn, gpointer u);
+
+/* Same as zreactor_post() but fails instead of waiting. */
+gboolean zreactor_try_post(struct zreactor_s *zr, zreactor_fn_task fn,
+        gpointer u);
 
-void zreactor_add_fd(struct zreactor_s *zr, int fd, int *evt,
+struct zmon_s;
+
+/* The zreactor_add_*() functions return a handle that remains valid until
+ * zreactor_remove() is called on it. */
+
+struct zmon_s* zreactor_add_zk(struct zreactor_s *zr, zhandle_t *zh);
+
+struct zmon_s* zreactor_add_fd(struct zreactor_s *zr, int fd, int *evt,
         zreactor_fn_fd fn, gpointer fnu);
 
-void zreactor_add_zmq(struct zreactor_s *zr, void *s, int *evt,
+struct zmon_s* zreactor_add_zmq(struct zreactor_s *zr, void *s, int *evt,
         zreactor_fn_zmq fn, gpointer fnu);
 
+/* The interest pointed by 'evt' is only read again after this call, it must
+ * follow each change of the interest. */
+void zreactor_mark_dirty(struct zreactor_s *zr, struct zmon_s *mon);
+
+/* The ZMQ monitor is served at the next turn as if its handler had left
+ * messages, e.g. held by the handler itself. Reactor's thread only. */
+void zreactor_check_later(struct zreactor_s *zr, struct zmon_s *mon);
+
+/* Stops monitoring immediately. The handle is released by the next loop, and
+ * the socket/FD may be closed as soon as the call returns. */
+void zreactor_remove(struct zreactor_s *zr, struct zmon_s *mon);
+
+/* Messages allowed per turn to a ZMQ monitor of weight 1 (default 64). */
+void zreactor_set_budget(struct zreactor_s *zr, guint budget);
+
+/* The ready ZMQ monitors are served in round-robin, each with a budget
+ * proportional to its weight (default 1). */
+void zreactor_set_weight(struct zreactor_s *zr, struct zmon_s *mon,
+        guint weight);
+
+/* Opt-in busy polling, for latency-critical steps. Before blocking, the loop
+ * checks the monitors without waiting, for up to 'spin_us' microseconds but
+ * no longer than twice the average inter-arrival time of the events. It
+ * does not spin at all when the events are further apart. 0 disables it. */
+void zreactor_set_busy_poll(struct zreactor_s *zr, guint spin_us);
+
+/* The thread running the reactor will be pinned on 'cpu' (-1 by default,
+ * no pinning) by zreactor_run(). */
+void zreactor_set_cpu(struct zreactor_s *zr, int cpu);
+
+/* Stats -------------------------------------------------------------------*/
+
+struct zmon_stats_s
+{
+    gchar *name;
+    struct zhisto_s duration; // ns spent in the handler
+};
+
+struct zreactor_stats_s
+{
+    guint64 loops; // turns of the loop
+    guint64 wakeups; // turns with at least one handler called
+    guint64 zk_process; // calls to zookeeper_process()
+    guint64 spin_hits; // wakeups caught while busy-polling
+    struct zhisto_s poll_wait; // ns spent in zmq_poll() or epoll_wait()
+    struct zhisto_s events; // handlers called per wakeup
+    struct zhisto_s zk_duration; // ns spent in zookeeper_process()
+    GPtrArray *monitors; // (struct zmon_stats_s*) snapshots only
+};
+
+/* Disabled by default, the loop then only pays a test per handler. Like
+ * all the functions below, to be called by the thread running the reactor
+ * (e.g. in a timer) or while it does not run. */
+void zreactor_enable_stats(struct zreactor_s *zr, gboolean on);
+
+/* Copy of the stats gathered since the last reset, NULL if disabled. */
+struct zreactor_stats_s* zreactor_get_stats(struct zreactor_s *zr,
+        gboolean reset);
+
+void zreactor_stats_free(struct zreactor_stats_s *st);
+
+/* Name of the monitor in the stats */
+void zreactor_set_name(struct zreactor_s *zr, struct zmon_s *mon,
+        const gchar *name);
+
+/* One-shot timer, fired by the reactor loop after 'delay' milliseconds.
+ * The handle is released when the timer fires, and then becomes invalid. */
+struct ztimer_s* zreactor_add_timer(struct zreactor_s *zr, guint delay,
+        zreactor_fn_timer fn, gpointer fnu);
+
+/* O(1), must not be called for a timer that already fired. */
+void zreactor_cancel_timer(struct zreactor_s *zr, struct ztimer_s *t);
+
 #endif
@@ -11,6 +11,10 @@
 #include "./macros.h"
 #include "./zsock.h"
 #include "./zreactor.h"
+#include "./zcache.h"
+#include "./zstore.h"
+#include "./zforward.h"
+#include "./zpool.h"
 
 #define ZK_DEBUG(FMT,...) g_log("ZK", G_LOG_LEVEL_DEBUG, FMT, ##__VA_ARGS__)
 
@@ -38,31 +42,263 @@ zservice_create_socket(struct zservice_s *zsrv, struct cfg_sock_s *itf)
 
     struct zsock_s *zsock = zsock_create(zsrv->uuid, zsrv->cell);
     zsock->zs = zs;
-    zsock->zh = zsrv->zh;
+    zsock->store = zsrv->store;
     zsock->zctx = zsrv->zctx;
     zsock->localname = g_strdup(itf->sockname);
     zsock->fullname = g_strconcat(zsrv->srvtype, ".", itf->sockname, NULL);
+    zsock->cache = zsrv->cache;
     zsock_configure(zsock, itf);
 
     g_debug("SOCK [%s] [%s]", itf->ztype, zsock->fullname);
     return zsock;
 }
 
+/* Runs 'fn' in the thread of 'zr', at once if it is the current one */
 static void
+_zservice_run(struct zreactor_s *zr, zreactor_fn_task fn, gpointer u)
+{
+    if (zreactor_is_current(zr))
+        fn(u);
+    else
+        zreactor_post(zr, fn, u);
+}
+
+/* The reactor of a socket linked to 'name' by the forward rules, followed
+ * transitively, NULL if none is registered yet. */
+static struct zreactor_s *
+_zservice_forward_reactor(struct zservice_s *zsrv, const gchar *name)
+{
+    struct zreactor_s *zr = NULL;
+    GPtrArray *names = g_ptr_array_new();
+    g_ptr_array_add(names, (gpointer) name);
+
+    gboolean known(const gchar *n) {
+        for (guint i=0; i < names->len ;++i) {
+            if (!strcmp(names->pdata[i], n))
+                return TRUE;
+        }
+        return FALSE;
+    }
+
+    for (guint i=0; !zr && i < names->len ;++i) {
+        const gchar *n = names->pdata[i];
+        struct zsock_s *zsock = g_tree_lookup(zsrv->socks, n);
+        if (zsock && zsock->zr) {
+            zr = zsock->zr;
+            break;
+        }
+        for (guint j=0; j < zsrv->forward_cfg->len ;++j) {
+            struct cfg_forward_s *cf = zsrv->forward_cfg->pdata[j];
+            const gchar *other = !strcmp(cf->in, n) ? cf->out
+                : (!strcmp(cf->out, n) ? cf->in : NULL);
+            if (other && !known(other))
+                g_ptr_array_add(names, (gpointer) other);
+        }
+    }
+
+    g_ptr_array_free(names, TRUE);
+    return zr;
+}
+
+static struct zreactor_s *
+_zservice_pick_reactor(struct zservice_s *zsrv, struct zsock_s *zsock)
+{
+    struct zreactor_s *zr = _zservice_forward_reactor(zsrv, zsock->localname);
+    if (zr)
+        return zr;
+    if (!zsrv->shards->len)
+        return zsrv->zr;
+    guint i = (zsrv->next_shard ++) % zsrv->shards->len;
+    return zsrv->shards->pdata[i];
+}
+
+static void
+_zservice_register_socket(struct zservice_s *zsrv, struct zsock_s *zsock)
+{
+    // Arms the coalescing timers, where the ZooKeeper callbacks run
+    zsock->zk_zr = zsrv->zr;
+    zsock_register_in_reactor(_zservice_pick_reactor(zsrv, zsock), zsock);
+}
+
+/* Stops the forwards using the socket, before it goes */
+static void
+_zservice_stop_forwards(struct zservice_s *zsrv, struct zsock_s *zsock)
+{
+    for (guint i=0; i < zsrv->forwards->len ;) {
+        struct zforward_s *fw = zsrv->forwards->pdata[i];
+        if (fw->in != zsock && fw->out != zsock)
+            ++ i;
+        else {
+            g_ptr_array_remove_index_fast(zsrv->forwards, i);
+            _zservice_run(fw->in->zr, (zreactor_fn_task)zforward_destroy, fw);
+        }
+    }
+}
+
+/* Stops the forwards whose rule disappeared, starts the missing ones */
+static void
+_zservice_apply_forwards(struct zservice_s *zsrv)
+{
+    struct cfg_forward_s *lookup_rule(struct zforward_s *fw) {
+        for (guint i=0; i < zsrv->forward_cfg->len ;++i) {
+            struct cfg_forward_s *cf = zsrv->forward_cfg->pdata[i];
+            if (!strcmp(cf->in, fw->in->localname)
+                    && !strcmp(cf->out, fw->out->localname))
+                return cf;
+        }
+        return NULL;
+    }
+    struct zforward_s *lookup_forward(struct zsock_s *in, struct zsock_s *out) {
+        for (guint i=0; i < zsrv->forwards->len ;++i) {
+            struct zforward_s *fw = zsrv->forwards->pdata[i];
+            if (fw->in == in && fw->out == out)
+                return fw;
+        }
+        return NULL;
+    }
+
+    for (guint i=0; i < zsrv->forwards->len ;) {
+        struct zforward_s *fw = zsrv->forwards->pdata[i];
+        if (lookup_rule(fw))
+            ++ i;
+        else {
+            g_ptr_array_remove_index_fast(zsrv->forwards, i);
+            _zservice_run(fw->in->zr, (zreactor_fn_task)zforward_destroy, fw);
+        }
+    }
+
+    for (guint i=0; i < zsrv->forward_cfg->len ;++i) {
+        struct cfg_forward_s *cf = zsrv->forward_cfg->pdata[i];
+        struct zsock_s *in = g_tree_lookup(zsrv->socks, cf->in);
+        struct zsock_s *out = g_tree_lookup(zsrv->socks, cf->out);
+        if (!in || !out) {
+            g_warning("FWD [%s] -> [%s] ignored, unknown socket",
+                    cf->in, cf->out);
+            continue;
+        }
+        if (lookup_forward(in, out))
+            continue;
+        // Sockets already running apart, only a restart gathers them
+        if (in->zr != out->zr) {
+            g_warning("FWD [%s] -> [%s] ignored, managed by two reactors",
+                    in->fullname, out->fullname);
+            continue;
+        }
+        struct zforward_s *fw = zforward_create(in, out);
+        g_ptr_array_add(zsrv->forwards, fw);
+        _zservice_run(in->zr, (zreactor_fn_task)zforward_start, fw);
+    }
+}
+
+/* A handler run in the threads of a pool, see zservice_on_work() */
+struct zwork_s
+{
+    zpool_fn_work fn;
+    gpointer u;
+};
+
+struct zpool_attach_s
+{
+    struct zpool_s *pool;
+    struct zsock_s *zsock;
+    struct zwork_s work;
+};
+
+static void
+_zservice_attach_pool(struct zpool_attach_s *pa)
+{
+    zpool_attach(pa->pool, pa->zsock, pa->work.fn, pa->work.u);
+    zsock_set_events(pa->zsock, pa->zsock->evt | ZMQ_POLLIN);
+    g_free(pa);
+}
+
+/* Stops the pool of the socket, before it goes */
+static void
+_zservice_stop_pool(struct zservice_s *zsrv, struct zsock_s *zsock)
+{
+    struct zpool_s *pool = g_hash_table_lookup(zsrv->pools, zsock);
+    if (!pool)
+        return;
+    g_hash_table_remove(zsrv->pools, zsock);
+    _zservice_run(zsock->zr, (zreactor_fn_task)zpool_destroy, pool);
+}
+
+/* The sockets asking for workers, whose handler is known, get their pool.
+ * The size is only read when the pool is created. */
+static void
+_zservice_apply_pools(struct zservice_s *zsrv)
+{
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        (void) u;
+        struct zsock_s *zsock = v;
+        if (!zsock->workers || g_hash_table_lookup(zsrv->pools, zsock))
+            return FALSE;
+        struct zwork_s *work = g_tree_lookup(zsrv->work, k);
+        if (!work) {
+            g_warning("SOCK [%s] no handler for its workers",
+                    zsock->fullname);
+            return FALSE;
+        }
+        g_debug("SOCK [%s] %u workers", zsock->fullname, zsock->workers);
+        struct zpool_attach_s *pa = g_malloc0(sizeof(struct zpool_attach_s));
+        pa->pool = zpool_create(zsock->zr, zsock->workers);
+        pa->zsock = zsock;
+        pa->work = *work;
+        g_hash_table_insert(zsrv->pools, zsock, pa->pool);
+        _zservice_run(zsock->zr, (zreactor_fn_task)_zservice_attach_pool, pa);
+        return FALSE;
+    }
+    g_tree_foreach(zsrv->socks, runner, NULL);
+}
+
+/* Takes the forward rules of 'cfg' over */
+static void
+_zservice_set_forward_cfg(struct zservice_s *zsrv, struct cfg_srv_s *cfg)
+{
+    g_ptr_array_free(zsrv->forward_cfg, TRUE);
+    zsrv->forward_cfg = cfg->forward;
+    cfg->forward = NULL;
+}
+
+/* Withdraws the socket from the service, and has it destroyed */
+static void
+_zservice_retire_socket(struct zservice_s *zsrv, const gchar *name)
+{
+    gpointer k = NULL, v = NULL;
+    if (!g_tree_lookup_extended(zsrv->socks, name, &k, &v))
+        return;
+    g_tree_steal(zsrv->socks, name);
+    g_free(k);
+    _zservice_stop_forwards(zsrv, v);
+    _zservice_stop_pool(zsrv, v);
+    zsock_retire(v);
+}
+
+/* Returns TRUE if a socket has been created */
+static gboolean
 zservice_create_and_register(struct zservice_s *zsrv, struct cfg_sock_s *itf)
 {
     struct zsock_s *zsock;
     ASSERT(zsrv != NULL);
 
-    // ensure a socket exist and configure it. If it exists, we must
-    // check its configuration did not change.
-    if (!(zsock = g_tree_lookup(zsrv->socks, itf->sockname))) {
-        zsock = zservice_create_socket(zsrv, itf);
-        g_tree_insert(zsrv->socks, g_strdup(itf->sockname), zsock);
-    }
-    else {
-        // TODO check the config matches, then update it
+    // ensure a socket exist and configure it. If it exists, its new
+    // configuration is applied in place when possible.
+    if ((zsock = g_tree_lookup(zsrv->socks, itf->sockname))) {
+        if (!zsrv->configured) {
+            zsock_configure(zsock, itf);
+            return FALSE;
+        }
+        if (zsock_reconfigure(zsock, itf))
+            return FALSE;
+        g_debug("SOCK [%s] replaced", zsock->fullname);
+        _zservice_retire_socket(zsrv, itf->sockname);
     }
+
+    zsock = zservice_create_socket(zsrv, itf);
+    g_tree_insert(zsrv->socks, g_strdup(itf->sockname), zsock);
+    if (zsrv->configured)
+        _zservice_register_socket(zsrv, zsock);
+    return TRUE;
 }
 
 static void
@@ -77,10 +313,88 @@ zservice_configure(struct zservice_s *zsrv, struct cfg_srv_s *cfg)
     }
 }
 
+/* Applies a configuration to a running service. The sockets not defined
+ * anymore are retired, the internal ones (named '_*') are kept. Returns
+ * TRUE if a socket appeared or disappeared. */
+static gboolean
+_zservice_reconfigure(struct zservice_s *zsrv, struct cfg_srv_s *cfg)
+{
+    _zservice_set_forward_cfg(zsrv, cfg);
+
+    GPtrArray *gone = g_ptr_array_new_with_free_func(g_free);
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        (void) v, (void) u;
+        if (*(gchar*)k == '_')
+            return FALSE;
+        for (guint i=0; i < cfg->socks->len ;++i) {
+            struct cfg_sock_s *itf = cfg->socks->pdata[i];
+            if (!strcmp(itf->sockname, k))
+                return FALSE;
+        }
+        g_ptr_array_add(gone, g_strdup(k));
+        return FALSE;
+    }
+    g_tree_foreach(zsrv->socks, runner, NULL);
+
+    gboolean changed = gone->len > 0;
+    for (guint i=0; i < gone->len ;++i)
+        _zservice_retire_socket(zsrv, gone->pdata[i]);
+    g_ptr_array_free(gone, TRUE);
+
+    for (guint i=0; i < cfg->socks->len ;++i)
+        changed |= zservice_create_and_register(zsrv, cfg->socks->pdata[i]);
+    return changed;
+}
+
+static void
+_zservice_publish_load(struct zservice_s *zsrv)
+{
+    gboolean on_socket(gpointer k, gpointer v, gpointer u) {
+        (void) k, (void) u;
+        zsock_publish_load(v);
+        return FALSE;
+    }
+    g_tree_foreach(zsrv->socks, on_socket, NULL);
+    zsrv->load_timer = zreactor_add_timer(zsrv->zr, zsock_get_load_period(),
+            (zreactor_fn_timer)_zservice_publish_load, zsrv);
+}
+
+/* Creates the sockets, then binds and connects them */
+static void
+_zservice_apply_config(struct zservice_s *zsrv, struct cfg_srv_s *cfg)
+{
+    _zservice_set_forward_cfg(zsrv, cfg);
+    zservice_configure(zsrv, cfg);
+    g_debug("CFG done");
+
+    // Now the sockets are known, load/monitor their behavior
+    g_debug("Connecting / Binding the sockets");
+    gboolean on_socket(gpointer k0, gpointer v0, gpointer u0) {
+        (void) k0, (void) u0;
+        _zservice_register_socket(zsrv, v0);
+        return FALSE;
+    }
+    g_tree_foreach(zsrv->socks, on_socket, NULL);
+    zsrv->configured = TRUE;
+
+    // Same thread as the ZooKeeper callbacks, that create the nodes
+    if (!zsrv->load_timer)
+        zsrv->load_timer = zreactor_add_timer(zsrv->zr,
+                zsock_get_load_period(),
+                (zreactor_fn_timer)_zservice_publish_load, zsrv);
+
+    if (zsrv->on_config)
+        zsrv->on_config(zsrv, zsrv->on_config_data);
+
+    // After the hook, the forwarded sockets are managed by the service
+    _zservice_apply_forwards(zsrv);
+    _zservice_apply_pools(zsrv);
+}
+
 static void
 on_config_completion(int r, const char *v, int vlen, const struct Stat *s, const void *u)
 {
-    struct zservice_s *zsrv = u;
+    struct zservice_s *zsrv = (struct zservice_s*) u;
 
     g_debug("%s(%d,%p,%p) %.*s", __FUNCTION__, r, s, u, vlen, v);
     ASSERT(zsrv != NULL);
@@ -91,34 +405,94 @@ on_config_completion(int r, const char *v, int vlen, const struct Stat *s, const
         return;
     }
 
-    // First configuration of the service
-    struct cfg_srv_s *cfg = zservice_parse_config_buffer(v, vlen);
-    if (!cfg)
-        g_warning("CFG error : invalid JSON object");
+    // Already configured (maybe from the cache), applied in place
+    if (zsrv->configured) {
+        if (zsrv->applied && strlen(zsrv->applied) == (gsize)vlen
+                && !memcmp(zsrv->applied, v, vlen)) {
+            g_debug("CFG unchanged");
+            return;
+        }
+        struct cfg_srv_s *cfg = zservice_parse_config_buffer(v, vlen);
+        if (!cfg) {
+            g_warning("CFG error : invalid JSON object, kept the previous");
+            return;
+        }
+        g_debug("CFG changed, reconfiguring");
+        gboolean changed = _zservice_reconfigure(zsrv, cfg);
+        cfg_srv_destroy(cfg);
+        if (changed && zsrv->on_config)
+            zsrv->on_config(zsrv, zsrv->on_config_data);
+        _zservice_apply_forwards(zsrv);
+        _zservice_apply_pools(zsrv);
+    }
     else {
-        zservice_configure(zsrv, cfg);
+        // First configuration of the service
+        struct cfg_srv_s *cfg = zservice_parse_config_buffer(v, vlen);
+        if (!cfg) {
+            g_warning("CFG error : invalid JSON object");
+            return;
+        }
+        _zservice_apply_config(zsrv, cfg);
         cfg_srv_destroy(cfg);
-        g_debug("CFG done");
     }
 
-    // Now the sockets are known, load/monitor their behavior
-    g_debug("Connecting / Binding the sockets");
-    gboolean on_socket(gpointer k0, gpointer v0, gpointer u0) {
-        (void) k0, (void) u0;
-        zsock_register_in_reactor(zsrv->zr, v0);
-        return FALSE;
+    g_free(zsrv->applied);
+    zsrv->applied = g_strndup(v, vlen);
+
+    if (zsrv->cache) {
+        zcache_set_config(zsrv->cache, v, vlen);
+        zcache_flush(zsrv->cache, TRUE);
     }
-    g_tree_foreach(zsrv->socks, on_socket, NULL);
+}
 
-    if (zsrv->on_config)
-        zsrv->on_config(zsrv, zsrv->on_config_data);
+static void on_config_change(zhandle_t *zh, int t, int s, const char *p,
+        void *u);
+
+/* Gets the configuration and watches its changes */
+static int
+_zservice_watch_config(struct zservice_s *zsrv)
+{
+    gchar *p = g_strdup_printf("/services/%s", zsrv->srvtype);
+    int zrc = zstore_awget(zsrv->store, p,
+            on_config_change, zsrv,
+            on_config_completion, zsrv);
+    ZK_DEBUG("awget(%s) = %d", p, zrc);
+    g_free(p);
+    return zrc;
 }
 
 static void
 on_config_change(zhandle_t *zh, int t, int s, const char *p, void *u)
 {
-    //struct zservice_s *zsrv = u;
+    struct zservice_s *zsrv = u;
     g_debug("%s(%p,%d,%d,%s,%p)", __FUNCTION__, zh, t, s, p, u);
+
+    // The watch is consumed, the next one is armed by the get. An expired
+    // session is handled by _zservice_on_session().
+    if (t == ZOO_SESSION_EVENT)
+        return;
+    int zrc = _zservice_watch_config(zsrv);
+    if (zrc != ZOK)
+        g_warning("CFG not watched anymore for [%s] (%d)", zsrv->srvtype, zrc);
+}
+
+/* The session renewed: the watch of the configuration and the nodes of the
+ * bound sockets are created again, the ZMQ sockets are left untouched. */
+static void
+_zservice_on_session(struct zservice_s *zsrv)
+{
+    if (!zsrv->zr)
+        return;
+    int zrc = _zservice_watch_config(zsrv);
+    if (zrc != ZOK)
+        g_warning("CFG not watched anymore for [%s] (%d)", zsrv->srvtype, zrc);
+
+    gboolean on_socket(gpointer k0, gpointer v0, gpointer u0) {
+        (void) k0, (void) u0;
+        zsock_renew(v0);
+        return FALSE;
+    }
+    g_tree_foreach(zsrv->socks, on_socket, NULL);
 }
 
 void
@@ -129,14 +503,11 @@ zservice_register_in_reactor(struct zreactor_s *zr, struct zservice_s *zsrv)
     (void) zr;
 
     zsrv->zr = zr;
+    if (zsrv->cache)
+        zcache_attach(zsrv->cache, zr);
 
     // Trigger the first service configuration
-    gchar *p = g_strdup_printf("/services/%s", zsrv->srvtype);
-    int zrc = zoo_awget(zsrv->zh, p,
-            on_config_change, zsrv,
-            on_config_completion, zsrv);
-    g_free(p);
-
+    int zrc = _zservice_watch_config(zsrv);
     if (zrc != ZOK) {
         g_debug("Failed to ask the first configuration for [%s] (%d)",
                 zsrv->srvtype, zrc);
@@ -145,22 +516,31 @@ zservice_register_in_reactor(struct zreactor_s *zr, struct zservice_s *zsrv)
 }
 
 struct zservice_s*
-zservice_create(void *zctx, zhandle_t *zh, const gchar *srvtype)
+zservice_create(void *zctx, struct zstore_s *store, const gchar *srvtype)
 {
     ASSERT(zctx != NULL);
-    ASSERT(zh != NULL);
+    ASSERT(store != NULL);
     ASSERT(srvtype != NULL);
 
     struct zservice_s *zsrv = g_malloc0(sizeof(struct zservice_s));
-    zsrv->zh = zh;
+    zsrv->store = store;
     zsrv->zctx = zctx;
     zsrv->srvtype = g_strdup(srvtype);
     zsrv->socks = g_tree_new_full(strcmp3, NULL, g_free,
             (GDestroyNotify)zsock_destroy);
+    zsrv->shards = g_ptr_array_new();
+    zsrv->forward_cfg = g_ptr_array_new_with_free_func(
+            (GDestroyNotify)cfg_forward_destroy);
+    zsrv->forwards = g_ptr_array_new();
+    zsrv->work = g_tree_new_full(strcmp3, NULL, g_free, g_free);
+    zsrv->pools = g_hash_table_new(g_direct_hash, g_direct_equal);
+    zstore_add_session_hook(store, (zstore_fn_session)_zservice_on_session,
+            zsrv);
 
     // A few sockets always exist
     static gchar *empty[] = {NULL};
-    struct cfg_sock_s cfg_tick = { "_tick", "zmq:SUB", empty, empty };
+    struct cfg_sock_s cfg_tick = { "_tick", "zmq:SUB", NULL, empty, 0,
+            FALSE, 0, 0, 0, 0 };
     zservice_create_and_register(zsrv, &cfg_tick);
 
     return zsrv;
@@ -171,10 +551,37 @@ zservice_destroy(struct zservice_s *zsrv)
 {
     if (!zsrv)
         return;
+    zstore_remove_session_hook(zsrv->store,
+            (zstore_fn_session)_zservice_on_session, zsrv);
+    if (zsrv->load_timer)
+        zreactor_cancel_timer(zsrv->zr, zsrv->load_timer);
+    if (zsrv->forwards) {
+        for (guint i=0; i < zsrv->forwards->len ;++i)
+            zforward_destroy(zsrv->forwards->pdata[i]);
+        g_ptr_array_free(zsrv->forwards, TRUE);
+    }
+    if (zsrv->forward_cfg)
+        g_ptr_array_free(zsrv->forward_cfg, TRUE);
+    if (zsrv->pools) {
+        GHashTableIter it;
+        gpointer k, v;
+        g_hash_table_iter_init(&it, zsrv->pools);
+        while (g_hash_table_iter_next(&it, &k, &v))
+            zpool_destroy(v);
+        g_hash_table_destroy(zsrv->pools);
+    }
+    if (zsrv->work)
+        g_tree_destroy(zsrv->work);
     if (zsrv->socks)
         g_tree_destroy(zsrv->socks);
     if (zsrv->srvtype)
         g_free(zsrv->srvtype);
+    if (zsrv->shards)
+        g_ptr_array_free(zsrv->shards, TRUE);
+    if (zsrv->cache)
+        zcache_close(zsrv->cache);
+    if (zsrv->applied)
+        g_free(zsrv->applied);
     g_free(zsrv);
 }
 
@@ -196,3 +603,60 @@ zservice_on_config(struct zservice_s *zsrv, gpointer data,
     zsrv->on_config_data = data;
 }
 
+void
+zservice_on_work(struct zservice_s *zsrv, const gchar *name,
+        void (*fn)(gpointer, struct zjob_s*), gpointer u)
+{
+    ASSERT(zsrv != NULL);
+    ASSERT(name != NULL);
+    ASSERT(fn != NULL);
+    struct zwork_s *work = g_malloc0(sizeof(struct zwork_s));
+    work->fn = fn;
+    work->u = u;
+    g_tree_replace(zsrv->work, g_strdup(name), work);
+}
+
+void
+zservice_add_shard(struct zservice_s *zsrv, struct zreactor_s *zr)
+{
+    ASSERT(zsrv != NULL);
+    ASSERT(zr != NULL);
+    g_ptr_array_add(zsrv->shards, zr);
+}
+
+void
+zservice_use_cache(struct zservice_s *zsrv, const gchar *path)
+{
+    ASSERT(zsrv != NULL);
+    ASSERT(path != NULL);
+    ASSERT(zsrv->cache == NULL);
+    zsrv->cache = zcache_open(path);
+}
+
+gboolean
+zservice_start_from_cache(struct zservice_s *zsrv, struct zreactor_s *zr)
+{
+    ASSERT(zsrv != NULL);
+    ASSERT(zr != NULL);
+
+    if (!zsrv->cache || zsrv->configured)
+        return FALSE;
+
+    gchar *b = zcache_get_config(zsrv->cache);
+    if (!b)
+        return FALSE;
+
+    struct cfg_srv_s *cfg = zservice_parse_config_string(b);
+    if (!cfg) {
+        g_free(b);
+        g_warning("CFG error : invalid cached JSON object");
+        return FALSE;
+    }
+
+    g_debug("CFG loaded from the cache");
+    zsrv->zr = zr;
+    _zservice_apply_config(zsrv, cfg);
+    cfg_srv_destroy(cfg);
+    zsrv->applied = b;
+    return TRUE;
+}
@@ -3,6 +3,7 @@
 #endif
 
 #include <string.h>
+#include <errno.h>
 
 #include <glib.h>
 #include <zmq.h>
@@ -11,6 +12,10 @@
 #include "./macros.h"
 #include "./zsock.h"
 #include "./zreactor.h"
+#include "./zcache.h"
+#include "./zdisco.h"
+#include "./zstore.h"
+#include "./zbatch.h"
 
 #define ZK_DEBUG(FMT,...) g_log("ZK", G_LOG_LEVEL_DEBUG, FMT, ##__VA_ARGS__)
 
@@ -81,25 +86,195 @@ zevents(void *s)
     }
 }
 
+static guint load_period = ZLOAD_PERIOD;
+
+/* Number of leading components ('.'-separated) shared by two cells, the
+ * higher the closer. */
+static guint
+_cell_locality(const gchar *c0, const gchar *c1)
+{
+    guint common = 0;
+    if (!c0 || !c1)
+        return 0;
+    for (;;) {
+        gsize l0 = strcspn(c0, "."), l1 = strcspn(c1, ".");
+        if (l0 != l1 || memcmp(c0, c1, l0))
+            return common;
+        ++ common;
+        if (!c0[l0] || !c1[l1])
+            return common + (!c0[l0] && !c1[l1]);
+        c0 += l0 + 1, c1 += l1 + 1;
+    }
+}
+
+/* Rendezvous score of the peer for the socket: each socket ranks the peers
+ * differently, and a peer coming or going only moves its own share. */
+static guint64
+_peer_score(const gchar *puuid, const struct cfg_listen_s *cl)
+{
+    guint64 h = 14695981039346656037ULL; // FNV-1a
+    void mix(const gchar *s) {
+        for (; s && *s ;++s)
+            h = (h ^ (guint8)*s) * 1099511628211ULL;
+        h = (h ^ 0xFF) * 1099511628211ULL;
+    }
+    mix(puuid);
+    mix(cl->uuid);
+    mix(cl->url);
+    // splitmix64 finalizer, FNV alone mixes the last bytes poorly
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+struct zpeer_s
+{
+    const gchar *url;
+    gboolean gone; // vanished, still in its grace period
+    guint locality;
+    guint load; // by steps, not to follow every small variation
+    guint64 score;
+};
+
+/* Keeps the peers the policy of 'zco' selects among 'peers' */
+static void
+_zco_select(struct zconnect_s *zco, GArray *peers)
+{
+    gint peer_cmp(gconstpointer p0, gconstpointer p1) {
+        const struct zpeer_s *z0 = p0, *z1 = p1;
+        if (z0->gone != z1->gone)
+            return z0->gone ? 1 : -1;
+        if (z0->locality != z1->locality)
+            return z0->locality > z1->locality ? -1 : 1;
+        if (z0->load != z1->load)
+            return z0->load < z1->load ? -1 : 1;
+        if (z0->score != z1->score)
+            return z0->score > z1->score ? -1 : 1;
+        return 0;
+    }
+
+    if (zco->policy_kind == ZPOLICY_ALL || peers->len <= zco->policy_count)
+        return;
+    g_array_sort(peers, peer_cmp);
+    g_array_set_size(peers, zco->policy_count);
+}
+
+static guint connect_grace = 0;
+
+void
+zsock_set_connect_grace(guint grace)
+{
+    connect_grace = grace;
+}
+
+static void zco_reconnect(struct zconnect_s *zco);
+
+static void
+_zco_on_grace(struct zconnect_s *zco)
+{
+    zco->grace_timer = NULL;
+    zco_reconnect(zco);
+}
+
+/* Adds to 'peers' the ones connected but not listed anymore, until their
+ * grace period ends. A timer reconsiders them then, thus no grace without
+ * a reactor for the ZooKeeper callbacks. */
+static void
+_zco_add_ghosts(struct zconnect_s *zco, GArray *peers)
+{
+    struct zreactor_s *zr = zco->zs->zk_zr;
+    guint grace = zco->grace ? zco->grace : connect_grace;
+    gint64 now = g_get_monotonic_time() / 1000, next = 0;
+
+    GHashTable *listed = g_hash_table_new(g_str_hash, g_str_equal);
+    for (guint i=0; i < peers->len ;++i)
+        g_hash_table_insert(listed,
+                (gpointer) g_array_index(peers, struct zpeer_s, i).url, NULL);
+
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        (void) v, (void) u;
+        if (g_hash_table_contains(listed, k))
+            ++ zco->stats.recovered;
+        return FALSE;
+    }
+    g_tree_foreach(zco->ghosts, runner, NULL);
+
+    GTree *ghosts = g_tree_new_full(strcmp3, NULL, g_free, g_free);
+    for (gchar **pu = zco->urlv_current; zr && grace && *pu ;++pu) {
+        if (g_hash_table_contains(listed, *pu))
+            continue;
+        gint64 *since = g_tree_lookup(zco->ghosts, *pu);
+        if (!since)
+            ++ zco->stats.lingered;
+        gint64 t = since ? *since : now;
+        if (now - t >= grace)
+            continue;
+        gchar *url = g_strdup(*pu);
+        gint64 *pt = g_new(gint64, 1);
+        *pt = t;
+        g_tree_insert(ghosts, url, pt);
+        struct zpeer_s peer = {url, TRUE, 0, 0, 0};
+        g_array_append_val(peers, peer);
+        next = next ? MIN(next, t + grace) : t + grace;
+    }
+    g_hash_table_destroy(listed);
+    g_tree_destroy(zco->ghosts);
+    zco->ghosts = ghosts;
+
+    if (zco->grace_timer) {
+        zreactor_cancel_timer(zr, zco->grace_timer);
+        zco->grace_timer = NULL;
+    }
+    if (next)
+        zco->grace_timer = zreactor_add_timer(zr, MAX(1, next - now),
+                (zreactor_fn_timer)_zco_on_grace, zco);
+}
+
+/* The sorted and unique URLs of the listeners of 'zco' the socket is to be
+ * connected to */
 static inline gchar **
-_extract_urlv(GPtrArray *v)
+_zco_extract_urlv(struct zconnect_s *zco)
 {
     gint pstr_cmp(gconstpointer p0, gconstpointer p1) {
         return g_strcmp0(*(gchar**)p0, *(gchar**)p1);
     }
-
-    GPtrArray *tmp = g_ptr_array_sized_new(16);
-    for (guint i=0; i<v->len ;++i) {
-        struct cfg_listen_s *cl = g_ptr_array_index(v, i);
-        if (cl && cl->url) {
-            g_ptr_array_add(tmp, cl->url);
-            cl->url = NULL;
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        struct cfg_listen_s *cl = v;
+        int ztype = 0;
+        (void) k;
+        if (cl && cl->url && !zsocket_resolve(cl->ztype, &ztype)
+                && ztype_compatible(zco->zs->ztype, ztype)) {
+            struct zpeer_s peer = {cl->url, FALSE, 0, 0, 0};
+            if (zco->policy_kind == ZPOLICY_NEAR)
+                peer.locality = _cell_locality(zco->zs->pcell, cl->cell);
+            if (zco->policy_kind == ZPOLICY_LOAD && cl->load > 0)
+                peer.load = cl->load / ZLOAD_STEP;
+            if (zco->policy_kind != ZPOLICY_ALL)
+                peer.score = _peer_score(zco->zs->puuid, cl);
+            g_array_append_val(u, peer);
         }
+        return FALSE;
     }
-    g_ptr_array_set_size(v, 0);
+
+    GArray *peers = g_array_sized_new(FALSE, FALSE, sizeof(struct zpeer_s), 16);
+    g_tree_foreach(zco->disco->children, runner, peers);
+    _zco_add_ghosts(zco, peers);
+    _zco_select(zco, peers);
+
+    GPtrArray *tmp = g_ptr_array_sized_new(peers->len);
+    for (guint i=0; i < peers->len ;++i)
+        g_ptr_array_add(tmp, (gpointer) g_array_index(peers, struct zpeer_s, i).url);
     g_ptr_array_sort(tmp, pstr_cmp);
-    g_ptr_array_add(tmp, NULL);
-    return (gchar**) g_ptr_array_free(tmp, FALSE);
+    g_array_free(peers, TRUE);
+
+    GPtrArray *result = g_ptr_array_sized_new(tmp->len + 1);
+    for (guint i=0; i < tmp->len ;++i) {
+        if (!i || strcmp(tmp->pdata[i-1], tmp->pdata[i]))
+            g_ptr_array_add(result, g_strdup(tmp->pdata[i]));
+    }
+    g_ptr_array_free(tmp, TRUE);
+    g_ptr_array_add(result, NULL);
+    return (gchar**) g_ptr_array_free(result, FALSE);
 }
 
 static inline void
@@ -132,6 +307,171 @@ _zsock_real_disconnect(struct zsock_s *zsock, const gchar *url)
     }
 }
 
+/* Runs 'fn' in the thread owning the socket, i.e. running its reactor. */
+static inline void
+_zsock_run(struct zsock_s *zsock, zreactor_fn_task fn, gpointer u)
+{
+    if (!zsock->zr || zreactor_is_current(zsock->zr))
+        fn(u);
+    else
+        zreactor_post(zsock->zr, fn, u);
+}
+
+static guint connect_rate = 0;
+static guint connect_jitter = 0;
+
+void
+zsock_set_connect_pacing(guint rate, guint jitter)
+{
+    connect_rate = rate;
+    connect_jitter = jitter;
+}
+
+static void _zsock_drain_connects(struct zsock_s *zsock);
+
+static void
+_zsock_on_connect_timer(struct zsock_s *zsock)
+{
+    zsock->connect_timer = NULL;
+    _zsock_drain_connects(zsock);
+}
+
+/* Connects the peers waiting, at most 'connect_rate' per second (with a
+ * burst of one second after a quiet period). */
+static void
+_zsock_drain_connects(struct zsock_s *zsock)
+{
+    gint64 now = g_get_monotonic_time() / 1000;
+    gint64 interval = connect_rate ? MAX(1, 1000 / connect_rate) : 0;
+
+    while (!g_queue_is_empty(zsock->connect_order)) {
+        if (interval && zsock->connect_next > now)
+            break;
+        gchar *url = g_queue_pop_head(zsock->connect_order);
+        gint n = GPOINTER_TO_INT(g_tree_lookup(zsock->connect_wait, url));
+        g_tree_remove(zsock->connect_wait, url);
+        // Skipped if cancelled, or already served by an earlier entry
+        if (n > 0) {
+            for (; n > 0 ;--n)
+                _zsock_real_connect(zsock, url);
+            if (interval)
+                zsock->connect_next = MAX(zsock->connect_next,
+                        now - 1000) + interval;
+        }
+        g_free(url);
+    }
+
+    if (!g_queue_is_empty(zsock->connect_order) && !zsock->connect_timer)
+        zsock->connect_timer = zreactor_add_timer(zsock->zr,
+                MAX(1, zsock->connect_next - now),
+                (zreactor_fn_timer)_zsock_on_connect_timer, zsock);
+}
+
+/* Delays the connection to 'url' when pacing. The first one of a batch
+ * waits for a random jitter, so that the processes started together do
+ * not connect at once. */
+static void
+_zsock_paced_connect(struct zsock_s *zsock, const gchar *url, gint n)
+{
+    if (!zsock->zr || (!connect_rate && !connect_jitter)) {
+        for (; n > 0 ;--n)
+            _zsock_real_connect(zsock, url);
+        return;
+    }
+
+    gboolean first = g_queue_is_empty(zsock->connect_order);
+    n += GPOINTER_TO_INT(g_tree_lookup(zsock->connect_wait, url));
+    g_tree_replace(zsock->connect_wait, g_strdup(url), GINT_TO_POINTER(n));
+    g_queue_push_tail(zsock->connect_order, g_strdup(url));
+
+    if (first && !zsock->connect_timer) {
+        guint delay = connect_jitter ? g_random_int_range(0, connect_jitter + 1) : 0;
+        if (delay)
+            zsock->connect_timer = zreactor_add_timer(zsock->zr, delay,
+                    (zreactor_fn_timer)_zsock_on_connect_timer, zsock);
+        else
+            _zsock_drain_connects(zsock);
+    }
+}
+
+/* A connection not established yet is just forgotten */
+static void
+_zsock_paced_disconnect(struct zsock_s *zsock, const gchar *url, gint n)
+{
+    gint waiting = GPOINTER_TO_INT(g_tree_lookup(zsock->connect_wait, url));
+    if (waiting > 0) {
+        gint cancelled = MIN(waiting, n);
+        n -= cancelled;
+        waiting -= cancelled;
+        if (waiting)
+            g_tree_replace(zsock->connect_wait, g_strdup(url),
+                    GINT_TO_POINTER(waiting));
+        else
+            g_tree_remove(zsock->connect_wait, url);
+    }
+    for (; n > 0 ;--n)
+        _zsock_real_disconnect(zsock, url);
+}
+
+/* Applies the connection changes queued by the control plane, in the
+ * thread owning the socket. The disconnections go first, to drop the dead
+ * peers at once, the connections may be paced. */
+static void
+_zsock_apply_pending(struct zsock_s *zsock)
+{
+    gboolean on_rem(gpointer k, gpointer v, gpointer u) {
+        (void) u;
+        if (GPOINTER_TO_INT(v) < 0)
+            _zsock_paced_disconnect(zsock, k, - GPOINTER_TO_INT(v));
+        return FALSE;
+    }
+    gboolean on_add(gpointer k, gpointer v, gpointer u) {
+        (void) u;
+        if (GPOINTER_TO_INT(v) > 0)
+            _zsock_paced_connect(zsock, k, GPOINTER_TO_INT(v));
+        return FALSE;
+    }
+
+    g_mutex_lock(&zsock->pending_lock);
+    GTree *pending = zsock->pending;
+    zsock->pending = g_tree_new_full(strcmp3, NULL, g_free, NULL);
+    zsock->pending_posted = FALSE;
+    g_mutex_unlock(&zsock->pending_lock);
+
+    g_tree_foreach(pending, on_rem, NULL);
+    g_tree_foreach(pending, on_add, NULL);
+    g_tree_destroy(pending);
+}
+
+/* Queues the connections to be added and removed. The changes accumulated
+ * until the owner thread runs are compacted (a removal cancels an addition)
+ * and handed over in a single task. */
+static void
+_zsock_queue_delta(struct zsock_s *zsock, gchar **add, gchar **rem)
+{
+    void _count(const gchar *url, gint n) {
+        gpointer k = NULL, v = NULL;
+        if (g_tree_lookup_extended(zsock->pending, url, &k, &v))
+            n += GPOINTER_TO_INT(v);
+        if (n)
+            g_tree_replace(zsock->pending, g_strdup(url), GINT_TO_POINTER(n));
+        else
+            g_tree_remove(zsock->pending, url);
+    }
+
+    g_mutex_lock(&zsock->pending_lock);
+    for (gchar **c = add; *c ;++c)
+        _count(*c, 1);
+    for (gchar **c = rem; *c ;++c)
+        _count(*c, -1);
+    gboolean post = !zsock->pending_posted;
+    zsock->pending_posted = TRUE;
+    g_mutex_unlock(&zsock->pending_lock);
+
+    if (post)
+        _zsock_run(zsock, (zreactor_fn_task)_zsock_apply_pending, zsock);
+}
+
 struct delta_s
 {
     gchar **add;
@@ -239,33 +579,44 @@ _compute_deltas(gchar **urlv, gchar **newv, struct delta_s *delta)
     delta->to_delete = (gchar**) g_ptr_array_free(pdel, FALSE);
 }
 
+/* Moves to the set of URLs 'newv' (sorted, unique), taken over. */
 static void
-zco_reconnect(struct zconnect_s *zco)
+_zco_apply_urlv(struct zconnect_s *zco, gchar **newv)
 {
-    if (!zco || !zco->urlv_new || !zco->urlv_new->len)
-        return ;
-
-    gchar **urlv, **newv;
+    gchar **urlv;
     struct delta_s delta;
 
-    ASSERT(zco != NULL);
     memset(&delta, 0, sizeof(struct delta_s));
     urlv = zco->urlv_current;
-    newv = _extract_urlv(zco->urlv_new);
 
     //_debug_sets(urlv, newv);
     _compute_deltas(urlv, newv, &delta);
     //_debug_deltas(&delta);
      
     // Apply the delta
-    for (gchar **c = delta.add; *c ;++c)
-        _zsock_real_connect(zco->zs, *c);
-    for (gchar **c = delta.rem; *c ;++c)
-        _zsock_real_disconnect(zco->zs, *c);
+    if (*delta.add || *delta.rem) {
+        _zsock_queue_delta(zco->zs, delta.add, delta.rem);
+        ++ zco->stats.reconnects;
+    }
 
     zco->urlv_current = _merge_deltas(urlv, newv, &delta);
 }
 
+static void
+zco_reconnect(struct zconnect_s *zco)
+{
+    if (!zco)
+        return ;
+
+    _zco_apply_urlv(zco, _zco_extract_urlv(zco));
+
+    struct zcache_s *cache = zco->zs->cache;
+    if (cache) {
+        zcache_set_peers(cache, zco->zs->fullname, zco->type,
+                zco->urlv_current);
+        zcache_flush(cache, FALSE);
+    }
+}
 
 static void
 zco_destroy(struct zconnect_s *zco)
@@ -284,14 +635,17 @@ zco_destroy(struct zconnect_s *zco)
         g_strfreev(zco->urlv_current);
         zco->urlv_current = NULL;
     }
-    if (zco->urlv_new) {
-        while (zco->urlv_new->len) {
-            struct cfg_listen_s *cl = zco->urlv_new->pdata[0];
-            g_ptr_array_remove_index_fast(zco->urlv_new, 0);
-            cfg_listen_destroy(cl);
-        }
-        g_ptr_array_free(zco->urlv_new, TRUE);
-        zco->urlv_new = NULL;
+    if (zco->disco) {
+        zdisco_unsubscribe(zco->disco, zco);
+        zco->disco = NULL;
+    }
+    if (zco->grace_timer) {
+        zreactor_cancel_timer(zco->zs->zk_zr, zco->grace_timer);
+        zco->grace_timer = NULL;
+    }
+    if (zco->ghosts) {
+        g_tree_destroy(zco->ghosts);
+        zco->ghosts = NULL;
     }
 
     zco->zs = NULL;
@@ -306,7 +660,8 @@ zco_create(struct zsock_s *zs, const gchar *type)
     zco->zs = zs;
     zco->type = g_strdup(type);
     zco->urlv_current = g_malloc0(sizeof(gchar*));
-    zco->urlv_new = g_ptr_array_new_full(8, (GDestroyNotify)cfg_listen_destroy);
+    zco->ghosts = g_tree_new_full(strcmp3, NULL, g_free, g_free);
+    zco->disco = zdisco_subscribe(type, (zdisco_fn)zco_reconnect, zco);
     return zco;
 }
 
@@ -328,6 +683,54 @@ zsock_connect(struct zsock_s *zsock, const gchar *type, const gchar *policy)
     if (zco->policy)
         g_free(zco->policy);
     zco->policy = g_strdup(policy);
+
+    // "all", or "<kind>:<count>"
+    gchar *end = NULL;
+    zco->policy_kind = ZPOLICY_ALL;
+    zco->policy_count = 0;
+    const gchar *sep = strchr(policy, ':');
+    if (sep) {
+        guint64 n = g_ascii_strtoull(sep + 1, &end, 10);
+        if (n > 0 && n <= G_MAXUINT && end && !*end) {
+            zco->policy_count = n;
+            if (!strncmp(policy, "near:", 5))
+                zco->policy_kind = ZPOLICY_NEAR;
+            else if (!strncmp(policy, "hash:", 5))
+                zco->policy_kind = ZPOLICY_HASH;
+            else if (!strncmp(policy, "load:", 5)) {
+                zco->policy_kind = ZPOLICY_LOAD;
+                zdisco_set_refresh(zco->disco, load_period);
+            }
+        }
+    }
+    if (zco->policy_kind == ZPOLICY_ALL && strcmp(policy, "all"))
+        g_warning("Unknown connect policy [%s] to [%s], using 'all'",
+                policy, type);
+}
+
+void
+zsock_set_coalescing(struct zsock_s *zsock, const gchar *type,
+        guint delay_min, guint delay_max)
+{
+    ASSERT(zsock != NULL);
+    ASSERT(type != NULL);
+
+    struct zconnect_s *zco = g_tree_lookup(zsock->connect_cfg, type);
+    if (!zco)
+        g_error("BUG : no connection configured to [%s]", type);
+    zdisco_set_window(zco->disco, delay_min, delay_max);
+}
+
+void
+zsock_set_grace(struct zsock_s *zsock, const gchar *type, guint grace)
+{
+    ASSERT(zsock != NULL);
+    ASSERT(type != NULL);
+
+    struct zconnect_s *zco = g_tree_lookup(zsock->connect_cfg, type);
+    if (!zco)
+        g_error("BUG : no connection configured to [%s]", type);
+    zco->grace = grace;
 }
 
 static void
@@ -346,6 +749,8 @@ _zsock_bind(struct zsock_s *zsock, const gchar *url)
     g_tree_insert(zsock->bind_set, g_strdup(url), g_strdup(d));
 }
 
+static int _zsock_flush(struct zsock_s *zsock);
+
 gboolean
 zsock_ready(struct zsock_s *zsock)
 {
@@ -356,6 +761,12 @@ zsock_ready(struct zsock_s *zsock)
             && g_tree_nnodes(zsock->bind_set) == 0)
         return FALSE;
 
+    // An envelope refused must go first, a message offered could then be
+    // refused too
+    if (zsock->batch && zsock->batch->has_sealed && !zsock->out_message
+            && 0 > _zsock_flush(zsock))
+        return FALSE;
+
     zmq_pollitem_t item = {zsock->zs, -1, ZMQ_POLLOUT, 0};
     return 1 == zmq_poll(&item, 1, 0);
 }
@@ -367,18 +778,33 @@ zsock_configure(struct zsock_s *zsock, struct cfg_sock_s *cfg)
     ASSERT(cfg != NULL);
 
     // connect
-    for (gchar **p = cfg->connect ;;) {
-        gchar *type, *policy;
-        if (!(type = *(p++)))
-            break;
-        if (!(policy = *(p++)))
-            break;
-        zsock_connect(zsock, type, policy);
+    for (guint i=0; cfg->connect && i < cfg->connect->len ;++i) {
+        struct cfg_connect_s *cc = cfg->connect->pdata[i];
+        zsock_connect(zsock, cc->type, cc->policy);
+        zsock_set_coalescing(zsock, cc->type, cc->delay_min, cc->delay_max);
+        zsock_set_grace(zsock, cc->type, cc->grace);
     }
 
     // listen
     for (gchar **p = cfg->listen; *p ;++p)
         _zsock_bind(zsock, *p);
+
+    if (cfg->weight)
+        zsock->weight = cfg->weight;
+    if (cfg->batch)
+        zsock_set_batch(zsock, cfg->batch_bytes, cfg->batch_count,
+                cfg->batch_delay);
+    zsock->workers = cfg->workers;
+}
+
+static void
+_zlisten_destroy(struct zlisten_s *zl)
+{
+    if (!zl)
+        return;
+    g_free(zl->url);
+    g_free(zl->path);
+    g_free(zl);
 }
 
 struct zsock_s*
@@ -388,36 +814,61 @@ zsock_create(const gchar *pu, const gchar *pc)
 
     zsock->puuid = pu;
     zsock->pcell = pc;
+    zsock->weight = 1;
+    zsock->budget = G_MAXUINT;
 
     zsock->connect_real = g_tree_new_full(strcmp3, NULL, g_free, g_free);
+    zsock->pending = g_tree_new_full(strcmp3, NULL, g_free, NULL);
+    g_mutex_init(&zsock->pending_lock);
     zsock->connect_cfg = g_tree_new_full(strcmp3, NULL, g_free,
             (GDestroyNotify)zco_destroy);
     zsock->bind_set = g_tree_new_full(strcmp3, NULL, g_free, g_free);
+    zsock->listen_nodes = g_ptr_array_new();
+    zsock->connect_wait = g_tree_new_full(strcmp3, NULL, g_free, NULL);
+    zsock->connect_order = g_queue_new();
 
     return zsock;
 }
 
+static void _zsock_report_received(struct zsock_s *zsock);
+
 void
 zsock_destroy(struct zsock_s *zsock)
 {
     if (!zsock)
         return;
 
-    if (zsock->zs) {
-        zmq_close(zsock->zs);
-        zsock->zs = NULL;
+    if (zsock->zmon) {
+        zreactor_remove(zsock->zr, zsock->zmon);
+        zsock->zmon = NULL;
     }
 
-    if (zsock->fullname) {
-        g_free(zsock->fullname);
-        zsock->fullname = NULL;
+    if (zsock->connect_timer) {
+        zreactor_cancel_timer(zsock->zr, zsock->connect_timer);
+        zsock->connect_timer = NULL;
     }
-
-    if (zsock->connect_cfg) {
-        g_tree_destroy(zsock->connect_cfg);
-        zsock->connect_cfg = NULL;
+    zsock_unset_batch(zsock);
+    _zsock_report_received(zsock);
+    if (zsock->unpacking) {
+        zmq_msg_close(&zsock->unpack);
+        zsock->unpacking = FALSE;
+    }
+    if (zsock->unpacked) {
+        g_free(zsock->unpacked);
+        zsock->unpacked = NULL;
+    }
+    if (zsock->connect_order) {
+        while (!g_queue_is_empty(zsock->connect_order))
+            g_free(g_queue_pop_head(zsock->connect_order));
+        g_queue_free(zsock->connect_order);
+        zsock->connect_order = NULL;
+    }
+    if (zsock->connect_wait) {
+        g_tree_destroy(zsock->connect_wait);
+        zsock->connect_wait = NULL;
     }
 
+    // Before the ZMQ socket is closed
     if (zsock->connect_real) {
         gboolean runner(gpointer u, gpointer i0, gpointer i1) {
             (void) i0, (void) i1;
@@ -429,154 +880,241 @@ zsock_destroy(struct zsock_s *zsock)
         zsock->connect_real = NULL;
     }
 
+    if (zsock->zs) {
+        zmq_close(zsock->zs);
+        zsock->zs = NULL;
+    }
+
+    if (zsock->fullname) {
+        g_free(zsock->fullname);
+        zsock->fullname = NULL;
+    }
+
+    if (zsock->connect_cfg) {
+        g_tree_destroy(zsock->connect_cfg);
+        zsock->connect_cfg = NULL;
+    }
+
     if (zsock->bind_set) {
         g_tree_destroy(zsock->bind_set);
         zsock->bind_set = NULL;
     }
 
+    if (zsock->listen_nodes) {
+        // The ones being created are freed by their completion
+        for (guint i=0; i < zsock->listen_nodes->len ;++i) {
+            struct zlisten_s *zl = zsock->listen_nodes->pdata[i];
+            if (zl->pending)
+                zl->retired = TRUE;
+            else
+                _zlisten_destroy(zl);
+        }
+        g_ptr_array_free(zsock->listen_nodes, TRUE);
+        zsock->listen_nodes = NULL;
+    }
+
+    if (zsock->pending) {
+        g_tree_destroy(zsock->pending);
+        zsock->pending = NULL;
+        g_mutex_clear(&zsock->pending_lock);
+    }
+
     g_free(zsock);
 }
 
 //------------------------------------------------------------------------------
 
-static void on_get(int r, const char *v, int vl, const struct Stat *s, const void *u);
-static void on_list_completion(int r, const struct String_vector *sv, const void *u);
-static void on_list_change(zhandle_t *zh, int t, int s, const char *p, void *u);
-
 static void on_bind_create(int r, const char *v, const void *u);
 
-static void
-restart_list(struct zconnect_s *zco)
-{
-    // Get rid of values already got but not yet taken into account
-    g_ptr_array_set_size(zco->urlv_new, 0);
-
-    // Start the ZooKeeper request
-    gchar *p = g_strdup_printf("/listen/%s", zco->type);
-    int rc = zoo_awget_children(zco->zs->zh, p,
-            on_list_change, zco,
-            on_list_completion, zco);
-    ZK_DEBUG("awget_children(%s) = %d", p, rc);
-    g_free(p);
-
-    if (rc == ZOK)
-        ++ zco->list_pending;
-}
-
-static inline void
-maybe_relist(struct zconnect_s *zco)
-{
-    if (!zco->get_pending && !zco->list_pending && zco->list_wanted) {
-        -- zco->list_wanted;
-        restart_list(zco);
-    }
-}
-
-static inline void
-maybe_reconnect(struct zconnect_s *zco)
-{
-    if (!zco->get_pending && !zco->list_pending && !zco->list_wanted)
-        zco_reconnect(zco);
-}
-
 /* Builds a JSON representation of the 'listen' block */
 static inline GString*
-_build_listen(struct zsock_s *zs, const gchar *url)
+_build_listen(struct zsock_s *zs, const gchar *url, gint load)
 {
     GString *body = g_string_new("{");
     g_string_append(body, "\"type\":\"");
     g_string_append(body, zs->fullname);
     g_string_append(body, "\",\"ztype\":\"");
-    g_string_append(body, ztype2str(get_ztype(zs->zs)));
+    g_string_append(body, ztype2str(zs->ztype));
     g_string_append(body, "\",\"url\":\"");
     g_string_append(body, url);
     g_string_append(body, "\",\"uuid\":\"");
     g_string_append(body, zs->puuid);
     g_string_append(body, "\",\"cell\":\"");
     g_string_append(body, zs->pcell);
-    g_string_append(body, "\"}");
+    g_string_append_printf(body, "\",\"load\":%d}", load);
     return body;
 }
 
+/* Name of the ephemeral node of a listener, see zlisten_parse_name() */
+static inline gchar*
+_build_listen_path(struct zsock_s *zs, const gchar *url)
+{
+    gchar *cell = g_uri_escape_string(zs->pcell, NULL, FALSE);
+    gchar *ztype = g_uri_escape_string(ztype2str(zs->ztype), NULL, FALSE);
+    gchar *eurl = g_uri_escape_string(url, NULL, FALSE);
+    gchar *path = g_strdup_printf("/listen/%s/%s,%s,%s,%s,%s,", zs->fullname,
+            ZLISTEN_NAME_TAG, zs->puuid, cell, ztype, eurl);
+    g_free(cell);
+    g_free(ztype);
+    g_free(eurl);
+    return path;
+}
+
 static void
-on_get(int r, const char *v, int vl, const struct Stat *s, const void *u)
-{
-    struct zconnect_s *zco = u;
-    (void) r, (void) s;
-
-    ASSERT(zco != NULL);
-    g_debug("%s(%s -> %s) %.*s", __FUNCTION__, zco->zs->fullname,
-            zco->type, v ? vl : 0, v);
-    -- zco->get_pending;
-
-    if (r == ZOK) {
-        struct cfg_listen_s *cfg = zlisten_parse_config_buffer(v, vl);
-        if (cfg != NULL) {
-            int own_ztype, opposite_ztype;
-            own_ztype = get_ztype(zco->zs->zs);
-            GError *e = zsocket_resolve(cfg->ztype, &opposite_ztype);
-            if (e != NULL) {
-                g_debug("Socket ignored (invalid ztype)");
-                cfg_listen_destroy(cfg);
-            }
-            else if (!ztype_compatible(own_ztype, opposite_ztype)) {
-                g_debug("Socket ignored (ztypes not compatible: %s vs. %s)",
-                        ztype2str(own_ztype), ztype2str(opposite_ztype));
-                cfg_listen_destroy(cfg);
-            }
-            else
-                g_ptr_array_add(zco->urlv_new, cfg);
-        }
+on_bind_delete(int r, const void *u)
+{
+    (void) u;
+    if (r != ZOK)
+        ZK_DEBUG("adelete error : %d", r);
+}
+
+static void
+on_bind_create(int r, const char *v, const void *u)
+{
+    struct zlisten_s *zl = (struct zlisten_s*) u;
+    g_debug("%s(%d,%s,%p)", __FUNCTION__, r, v, u);
+    zl->pending = FALSE;
+
+    // Withdrawn while being created
+    if (zl->retired) {
+        if (r == ZOK && v)
+            zstore_adelete(zl->store, v, -1, on_bind_delete, NULL);
+        _zlisten_destroy(zl);
+        return;
     }
+    if (r == ZOK && v)
+        g_atomic_pointer_set(&zl->path, g_strdup(v));
+}
+
+static void
+_zlisten_create(struct zsock_s *zsock, struct zlisten_s *zl)
+{
+    GString *body = _build_listen(zsock, zl->url, zl->load);
+    gchar *path = _build_listen_path(zsock, zl->url);
+
+    zl->session = zstore_session(zsock->store);
+    int rc = zstore_acreate(zsock->store, path, body->str, body->len,
+            ZOO_EPHEMERAL|ZOO_SEQUENCE,
+            on_bind_create, zl);
+    zl->pending = (rc == ZOK);
+
+    ZK_DEBUG("acreate(%s) = %d", path, rc);
+    g_string_free(body, TRUE);
+    g_free(path);
+}
 
-    maybe_reconnect(zco);
-    maybe_relist(zco);
+/* Creates the ephemeral node of the endpoint 'url' */
+static void
+_zsock_advertise(struct zsock_s *zsock, const gchar *url)
+{
+    struct zlisten_s *zl = g_malloc0(sizeof(struct zlisten_s));
+    zl->url = g_strdup(url);
+    zl->store = zsock->store;
+    g_ptr_array_add(zsock->listen_nodes, zl);
+    _zlisten_create(zsock, zl);
 }
 
+/* Deletes the node of the endpoint, or has it deleted once created */
 static void
-on_list_completion(int r, const struct String_vector *sv, const void *u)
-{
-    struct zconnect_s *zco = u;
-
-    ASSERT(zco != NULL);
-    g_debug("%s(%s -> %s) %u", __FUNCTION__, zco->zs->fullname, zco->type, sv ? sv->count : 0);
-    -- zco->list_pending;
-
-    if (r == ZOK)  {
-        for (gint32 i=0; i < sv->count ;++i) {
-            gchar *p = g_strdup_printf("/listen/%s/%s", zco->type, sv->data[i]);
-            int rc = zoo_awget(zco->zs->zh, p, NULL, NULL, on_get, zco);
-            ZK_DEBUG("awget(%s) = %d", p, rc);
-            if (rc == ZOK)
-                ++ zco->get_pending;
-            g_free(p);
-        }
+_zlisten_withdraw(struct zlisten_s *zl)
+{
+    if (!zl->path && zl->pending) {
+        zl->retired = TRUE;
+        return;
     }
-    maybe_relist(zco);
+    if (!zl->path) {
+        _zlisten_destroy(zl);
+        return;
+    }
+    int rc = zstore_adelete(zl->store, zl->path, -1, on_bind_delete, NULL);
+    ZK_DEBUG("adelete(%s) = %d", zl->path, rc);
+    _zlisten_destroy(zl);
 }
 
 static void
-on_list_change(zhandle_t *zh, int t, int s, const char *p, void *u)
+on_load_set(int r, const struct Stat *s, const void *u)
 {
-    struct zconnect_s *zco = u;
-    (void) zh, (void) t, (void) s, (void) p;
+    (void) s, (void) u;
+    if (r != ZOK)
+        ZK_DEBUG("aset(load) error : %d", r);
+}
 
-    ASSERT(zco != NULL);
-    g_debug("%s(%s -> %s)", __FUNCTION__, zco->zs->fullname, zco->type);
+void
+zsock_set_load_period(guint period)
+{
+    load_period = period;
+}
 
-    ++ zco->list_wanted;
-    maybe_relist(zco);
+guint
+zsock_get_load_period(void)
+{
+    return load_period;
 }
 
-static void
-on_bind_create(int r, const char *v, const void *u)
+void
+zsock_publish_load(struct zsock_s *zsock)
 {
-    (void) u;
-    g_debug("%s(%d,%s,%p)", __FUNCTION__, r, v, u);
+    ASSERT(zsock != NULL);
+    if (!zsock->listen_nodes || !zsock->listen_nodes->len)
+        return;
+
+    // Share of the turns that left messages waiting, since the last call
+    guint turns = (guint) g_atomic_int_get(&zsock->in_turns);
+    guint backlogs = (guint) g_atomic_int_get(&zsock->in_backlogs);
+    guint dt = turns - zsock->load_turns, db = backlogs - zsock->load_backlogs;
+    zsock->load_turns = turns;
+    zsock->load_backlogs = backlogs;
+    gint load = dt ? (gint)((100ULL * db) / dt) : 0;
+
+    for (guint i=0; i < zsock->listen_nodes->len ;++i) {
+        struct zlisten_s *zl = zsock->listen_nodes->pdata[i];
+        const gchar *path = g_atomic_pointer_get(&zl->path);
+        if (!path || ABS(load - zl->load) < ZLOAD_STEP)
+            continue;
+        GString *body = _build_listen(zsock, zl->url, load);
+        int rc = zstore_aset(zsock->store, path, body->str, body->len, -1,
+                on_load_set, NULL);
+        ZK_DEBUG("aset(%s,%d) = %d", path, load, rc);
+        g_string_free(body, TRUE);
+        if (rc == ZOK)
+            zl->load = load;
+    }
+}
+
+void
+zsock_renew(struct zsock_s *zsock)
+{
+    ASSERT(zsock != NULL);
+    if (!zsock->listen_nodes)
+        return;
+
+    gint session = zstore_session(zsock->store);
+    for (guint i=0; i < zsock->listen_nodes->len ;++i) {
+        struct zlisten_s *zl = zsock->listen_nodes->pdata[i];
+        if (zl->pending) {
+            // Already created in the new session
+            if (zl->session == session)
+                continue;
+            // Issued with the expired handle, its completion may never come:
+            // left to it, retired, and replaced.
+            struct zlisten_s *fresh = g_malloc0(sizeof(struct zlisten_s));
+            fresh->url = g_strdup(zl->url);
+            fresh->store = zl->store;
+            fresh->load = zl->load;
+            zl->retired = TRUE;
+            zsock->listen_nodes->pdata[i] = zl = fresh;
+        }
+        else {
+            gchar *old = g_atomic_pointer_get(&zl->path);
+            g_atomic_pointer_set(&zl->path, NULL);
+            g_free(old);
+        }
+        _zlisten_create(zsock, zl);
+    }
 }
 
 static int
-zsock_handler(struct zsock_s *zsock, void *s, int evt)
+zsock_handler(struct zsock_s *zsock, void *s, int evt, guint budget)
 {
     (void) s;
     ASSERT(s != NULL);
@@ -584,17 +1122,245 @@ zsock_handler(struct zsock_s *zsock, void *s, int evt)
     ASSERT(zsock->zs == s);
 
     if (evt & ZMQ_POLLOUT) {
-        zsock->evt &= ~ZMQ_POLLOUT;
+        zsock_set_events(zsock, zsock->evt & ~ZMQ_POLLOUT);
         if (zsock->ready_out)
             zsock->ready_out(zsock);
     }
 
     if (evt & ZMQ_POLLIN) {
-        if (zsock->ready_in)
+        if (zsock->ready_in) {
+            zsock->budget = budget;
+            zsock->exhausted = FALSE;
             zsock->ready_in(zsock);
+            zsock->budget = G_MAXUINT;
+            g_atomic_int_inc(&zsock->in_turns);
+            if (zsock->exhausted)
+                g_atomic_int_inc(&zsock->in_backlogs);
+        }
+    }
+
+    // The rest of an envelope is served even if ZMQ has nothing more
+    return zsock->exhausted || (zsock->unpacking && zsock->ready_in);
+}
+
+/* Delivers the next message of the envelope received */
+static int
+_zsock_unpack_next(struct zsock_s *zsock, zmq_msg_t *msg)
+{
+    zbatch_next(&zsock->unpack, &zsock->unpack_at, msg);
+    if (zsock->unpack_at >= zmq_msg_size(&zsock->unpack)) {
+        zmq_msg_close(&zsock->unpack);
+        zsock->unpacking = FALSE;
+    }
+    zsock->in_message = FALSE;
+    if (zsock->budget)
+        -- zsock->budget;
+    return zmq_msg_size(msg);
+}
+
+int
+zsock_recv(struct zsock_s *zsock, zmq_msg_t *msg)
+{
+    ASSERT(zsock != NULL);
+    ASSERT(msg != NULL);
+
+    // A message is never cut, the budget is checked before its first frame
+    if (!zsock->budget && !zsock->in_message) {
+        zsock->exhausted = TRUE;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (zsock->unpacking)
+        return _zsock_unpack_next(zsock, msg);
+
+    int rc = zmq_msg_recv(msg, zsock->zs, ZMQ_DONTWAIT);
+    if (rc >= 0) {
+        guint count;
+        if (zsock->batch && !zsock->in_message && !zmq_msg_more(msg)
+                && 0 < (count = zbatch_check(msg))) {
+            if (!zsock->unpacked) {
+                zsock->unpacked = g_malloc0(sizeof(struct zhisto_s));
+                zhisto_reset(zsock->unpacked);
+            }
+            zhisto_record(zsock->unpacked, count);
+            zmq_msg_init(&zsock->unpack);
+            zmq_msg_move(&zsock->unpack, msg);
+            zsock->unpack_at = ZBATCH_MAGIC_LEN;
+            zsock->unpacking = TRUE;
+            return _zsock_unpack_next(zsock, msg);
+        }
+        zsock->in_message = zmq_msg_more(msg);
+        if (!zsock->in_message && zsock->budget)
+            -- zsock->budget;
+    }
+    return rc;
+}
+
+/* Envelopes ---------------------------------------------------------------*/
+
+static void _zsock_batch_deadline(struct zsock_s *zsock);
+
+static void
+_zsock_batch_arm(struct zsock_s *zsock)
+{
+    struct zbatch_s *b = zsock->batch;
+    if (b->timer || !zsock->zr || (!b->pending && !b->has_sealed))
+        return;
+    b->timer = zreactor_add_timer(zsock->zr, b->delay,
+            (zreactor_fn_timer)_zsock_batch_deadline, zsock);
+}
+
+/* Sends the envelope sealed, then the messages pending. -1 (EAGAIN) if the
+ * socket cannot take them, they are then kept. */
+static int
+_zsock_flush(struct zsock_s *zsock)
+{
+    struct zbatch_s *b = zsock->batch;
+    for (;;) {
+        if (!b->has_sealed) {
+            if (!b->pending)
+                return 0;
+            zbatch_seal(b);
+        }
+        if (0 > zmq_msg_send(&b->sealed, zsock->zs, ZMQ_DONTWAIT))
+            return -1;
+        zmq_msg_close(&b->sealed);
+        b->has_sealed = FALSE;
+    }
+}
+
+static void
+_zsock_batch_deadline(struct zsock_s *zsock)
+{
+    struct zbatch_s *b = zsock->batch;
+    b->timer = NULL;
+    // Never in the middle of a multipart message
+    if (!zsock->out_message) {
+        if (b->pending && !b->has_sealed) {
+            zbatch_seal(b);
+            ++ b->stats.flushes_delay;
+        }
+        (void) _zsock_flush(zsock);
+    }
+    _zsock_batch_arm(zsock);
+}
+
+static void
+_zsock_report_sent(struct zsock_s *zsock)
+{
+    struct zbatch_s *b = zsock->batch;
+    if (b->stats.sent.count)
+        g_message("ZSOCK [%s] envelopes sent=%"G_GUINT64_FORMAT
+                " messages/envelope p50=%"G_GUINT64_FORMAT
+                " p99=%"G_GUINT64_FORMAT" max=%"G_GUINT64_FORMAT
+                " full=%"G_GUINT64_FORMAT" delay=%"G_GUINT64_FORMAT,
+                zsock->fullname, b->stats.sent.count,
+                zhisto_percentile(&b->stats.sent, 50),
+                zhisto_percentile(&b->stats.sent, 99),
+                b->stats.sent.max, b->stats.flushes_full,
+                b->stats.flushes_delay);
+}
+
+static void
+_zsock_report_received(struct zsock_s *zsock)
+{
+    if (zsock->unpacked && zsock->unpacked->count)
+        g_message("ZSOCK [%s] envelopes received=%"G_GUINT64_FORMAT
+                " messages/envelope p50=%"G_GUINT64_FORMAT
+                " p99=%"G_GUINT64_FORMAT" max=%"G_GUINT64_FORMAT,
+                zsock->fullname, zsock->unpacked->count,
+                zhisto_percentile(zsock->unpacked, 50),
+                zhisto_percentile(zsock->unpacked, 99),
+                zsock->unpacked->max);
+}
+
+int
+zsock_send(struct zsock_s *zsock, zmq_msg_t *msg, int flags)
+{
+    ASSERT(zsock != NULL);
+    ASSERT(msg != NULL);
+
+    struct zbatch_s *b = zsock->batch;
+    gsize len = zmq_msg_size(msg);
+    flags |= ZMQ_DONTWAIT;
+
+    // Multipart and big messages go as they are, after the ones packed
+    if (!b || zsock->out_message || (flags & ZMQ_SNDMORE) || len >= b->bytes) {
+        if (b && !zsock->out_message && 0 > _zsock_flush(zsock))
+            return -1;
+        int rc = zmq_msg_send(msg, zsock->zs, flags);
+        if (rc >= 0)
+            zsock->out_message = (flags & ZMQ_SNDMORE) != 0;
+        return rc;
+    }
+
+    if (!zbatch_fits(b, len)) {
+        if (!b->has_sealed) {
+            zbatch_seal(b);
+            ++ b->stats.flushes_full;
+        }
+        if (0 > _zsock_flush(zsock))
+            return -1;
+    }
+    // Not registered yet, no deadline can be armed
+    if (zbatch_add(b, zmq_msg_data(msg), len) || !zsock->zr) {
+        if (!b->has_sealed) {
+            zbatch_seal(b);
+            ++ b->stats.flushes_full;
+        }
+        (void) _zsock_flush(zsock);
+    }
+    _zsock_batch_arm(zsock);
+
+    // Consumed, as zmq_msg_send() would do
+    zmq_msg_close(msg);
+    zmq_msg_init(msg);
+    return len;
+}
+
+void
+zsock_set_batch(struct zsock_s *zsock, guint bytes, guint count,
+        guint delay)
+{
+    ASSERT(zsock != NULL);
+    if (!zsock->batch) {
+        zsock->batch = zbatch_create(bytes, count, delay);
+        return;
+    }
+    // The envelope being filled is flushed at the next threshold reached
+    zsock->batch->bytes = bytes ? bytes : ZBATCH_BYTES;
+    zsock->batch->count = count ? count : ZBATCH_COUNT;
+    zsock->batch->delay = delay ? delay : ZBATCH_DELAY;
+}
+
+void
+zsock_unset_batch(struct zsock_s *zsock)
+{
+    ASSERT(zsock != NULL);
+    struct zbatch_s *b = zsock->batch;
+    if (!b)
+        return;
+
+    if (b->timer) {
+        zreactor_cancel_timer(zsock->zr, b->timer);
+        b->timer = NULL;
     }
+    if (zsock->zs && !zsock->out_message && 0 > _zsock_flush(zsock))
+        g_warning("ZSOCK [%s] batched messages dropped : (%d) %s",
+                zsock->fullname, errno, zmq_strerror(errno));
+    _zsock_report_sent(zsock);
+    zbatch_destroy(b);
+    zsock->batch = NULL;
+}
 
-    return 0;
+static void
+_zsock_attach(struct zsock_s *zsock)
+{
+    zsock->zmon = zreactor_add_zmq(zsock->zr, zsock->zs, &(zsock->evt),
+            (zreactor_fn_zmq) zsock_handler, zsock);
+    zreactor_set_weight(zsock->zr, zsock->zmon, zsock->weight);
+    zreactor_set_name(zsock->zr, zsock->zmon, zsock->fullname);
 }
 
 void
@@ -604,34 +1370,285 @@ zsock_register_in_reactor(struct zreactor_s *zr, struct zsock_s *zsock)
         (void) k, (void) u;
         struct zconnect_s *zco = v;
         g_debug(" %s -> [%s]", zsock->fullname, zco->type);
-        restart_list(zco);
+        // Optimistic connection to the peers known by the last run
+        gchar **urlv;
+        if (zsock->cache && (urlv = zcache_get_peers(zsock->cache,
+                        zsock->fullname, zco->type))) {
+            g_debug(" %s -> [%s] %u cached peers", zsock->fullname,
+                    zco->type, g_strv_length(urlv));
+            _zco_apply_urlv(zco, urlv);
+        }
+        zdisco_start(zco->disco, zsock->store, zsock->zk_zr, zco);
         return FALSE;
     }
 
     gboolean on_endpoint(gpointer k, gpointer v, gpointer u) {
-        gchar *endpoint = k;
-        gchar *url = v;
         (void) u;
+        g_debug(" %s <- [%s,%s]", zsock->fullname, (gchar*)k, (gchar*)v);
+        _zsock_advertise(zsock, v);
+        return FALSE;
+    }
 
-        g_debug(" %s <- [%s,%s]", zsock->fullname, endpoint, url);
-        GString *body = _build_listen(zsock, url);
-        gchar *path = g_strdup_printf("/listen/%s/%s-",
-                zsock->fullname, zsock->puuid);
+    zsock->ztype = get_ztype(zsock->zs);
+    g_tree_foreach(zsock->bind_set, on_endpoint, NULL);
+    g_tree_foreach(zsock->connect_cfg, on_target, NULL);
 
-        int rc = zoo_acreate(zsock->zh, path, body->str, body->len,
-                &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL|ZOO_SEQUENCE,
-                on_bind_create, NULL);
+    // From now on, the ZMQ socket only belongs to the thread running 'zr'
+    zsock->zr = zr;
+    _zsock_run(zsock, (zreactor_fn_task)_zsock_attach, zsock);
+}
 
-        ZK_DEBUG("acreate(%s) = %d", path, rc);
-        g_string_free(body, TRUE);
-        g_free(path);
+struct zevents_s
+{
+    struct zsock_s *zsock;
+    int evt;
+};
+
+static void
+_zsock_set_events(struct zevents_s *ze)
+{
+    struct zsock_s *zsock = ze->zsock;
+    if (zsock->evt != ze->evt) {
+        zsock->evt = ze->evt;
+        if (zsock->zmon)
+            zreactor_mark_dirty(zsock->zr, zsock->zmon);
+    }
+    // Input resumed in the middle of an envelope, ZMQ won't signal it
+    if ((ze->evt & ZMQ_POLLIN) && zsock->unpacking && zsock->zmon)
+        zreactor_check_later(zsock->zr, zsock->zmon);
+    g_free(ze);
+}
+
+void
+zsock_set_events(struct zsock_s *zsock, int evt)
+{
+    ASSERT(zsock != NULL);
+    struct zevents_s *ze = g_malloc(sizeof(struct zevents_s));
+    ze->zsock = zsock;
+    ze->evt = evt;
+    _zsock_run(zsock, (zreactor_fn_task)_zsock_set_events, ze);
+}
+
+
+//------------------------------------------------------------------------------
+
+/* Runs 'fn' in the thread running the ZooKeeper callbacks */
+static inline void
+_zsock_run_zk(struct zsock_s *zsock, zreactor_fn_task fn, gpointer u)
+{
+    if (!zsock->zk_zr || zreactor_is_current(zsock->zk_zr))
+        fn(u);
+    else
+        zreactor_post(zsock->zk_zr, fn, u);
+}
+
+static void
+_zsock_retire_zk(struct zsock_s *zsock)
+{
+    _zsock_run(zsock, (zreactor_fn_task)zsock_destroy, zsock);
+}
+
+/* Back in the ZooKeeper thread before the destruction, so that the
+ * readvertisements posted by the owner thread before run first */
+static void
+_zsock_retire_owner(struct zsock_s *zsock)
+{
+    _zsock_run_zk(zsock, (zreactor_fn_task)_zsock_retire_zk, zsock);
+}
+
+/* Changes of the endpoints bound, computed by the owner thread */
+struct zrebind_s
+{
+    struct zsock_s *zsock;
+    gchar **listen;
+    guint weight;
+    gboolean batch;
+    guint batch_bytes, batch_count, batch_delay;
+    GPtrArray *added; // (gchar*) URL of the endpoints
+    GPtrArray *removed;
+};
+
+static void
+_zrebind_free(struct zrebind_s *rb)
+{
+    g_strfreev(rb->listen);
+    g_ptr_array_free(rb->added, TRUE);
+    g_ptr_array_free(rb->removed, TRUE);
+    g_free(rb);
+}
+
+/* Advertises the endpoints bound, and withdraws the ones unbound */
+static void
+_zsock_readvertise(struct zrebind_s *rb)
+{
+    struct zsock_s *zsock = rb->zsock;
+
+    // Its nodes already withdrawn, the socket is only freed after this
+    if (zsock->retired) {
+        _zrebind_free(rb);
+        return;
+    }
+
+    for (guint i=0; i < rb->removed->len ;++i) {
+        const gchar *url = rb->removed->pdata[i];
+        for (guint j=0; j < zsock->listen_nodes->len ;) {
+            struct zlisten_s *zl = zsock->listen_nodes->pdata[j];
+            if (strcmp(zl->url, url))
+                ++ j;
+            else {
+                g_ptr_array_remove_index_fast(zsock->listen_nodes, j);
+                _zlisten_withdraw(zl);
+            }
+        }
+    }
+    for (guint i=0; i < rb->added->len ;++i)
+        _zsock_advertise(zsock, rb->added->pdata[i]);
+
+    _zrebind_free(rb);
+}
+
+static void
+_zsock_rebind(struct zrebind_s *rb)
+{
+    struct zsock_s *zsock = rb->zsock;
+
+    if (rb->weight && rb->weight != zsock->weight) {
+        zsock->weight = rb->weight;
+        if (zsock->zmon)
+            zreactor_set_weight(zsock->zr, zsock->zmon, zsock->weight);
+    }
+    if (rb->batch)
+        zsock_set_batch(zsock, rb->batch_bytes, rb->batch_count,
+                rb->batch_delay);
+    else
+        zsock_unset_batch(zsock);
+
+    GPtrArray *gone = g_ptr_array_new();
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        (void) v, (void) u;
+        for (gchar **p = rb->listen; *p ;++p) {
+            if (!strcmp(*p, k))
+                return FALSE;
+        }
+        g_ptr_array_add(gone, k);
         return FALSE;
     }
+    g_tree_foreach(zsock->bind_set, runner, NULL);
+    for (guint i=0; i < gone->len ;++i) {
+        const gchar *endpoint = g_tree_lookup(zsock->bind_set, gone->pdata[i]);
+        zmq_unbind(zsock->zs, endpoint);
+        g_ptr_array_add(rb->removed, g_strdup(endpoint));
+        g_tree_remove(zsock->bind_set, gone->pdata[i]);
+    }
+    g_ptr_array_free(gone, TRUE);
 
-    g_tree_foreach(zsock->bind_set, on_endpoint, NULL);
-    g_tree_foreach(zsock->connect_cfg, on_target, NULL);
+    for (gchar **p = rb->listen; *p ;++p) {
+        if (g_tree_lookup(zsock->bind_set, *p))
+            continue;
+        _zsock_bind(zsock, *p);
+        const gchar *endpoint = g_tree_lookup(zsock->bind_set, *p);
+        if (endpoint)
+            g_ptr_array_add(rb->added, g_strdup(endpoint));
+    }
 
-    zreactor_add_zmq(zr, zsock->zs, &(zsock->evt),
-            (zreactor_fn_zmq) zsock_handler, zsock);
+    if (rb->added->len || rb->removed->len)
+        _zsock_run_zk(zsock, (zreactor_fn_task)_zsock_readvertise, rb);
+    else
+        _zrebind_free(rb);
 }
 
+gboolean
+zsock_reconfigure(struct zsock_s *zsock, struct cfg_sock_s *cfg)
+{
+    ASSERT(zsock != NULL);
+    ASSERT(cfg != NULL);
+
+    int ztype = 0;
+    GError *e = zsocket_resolve(cfg->ztype, &ztype);
+    if (e != NULL) {
+        g_warning("Socket [%s] kept, invalid type : (%d) %s",
+                zsock->fullname, e->code, e->message);
+        g_clear_error(&e);
+        return TRUE;
+    }
+    if (ztype != zsock->ztype)
+        return FALSE;
+
+    // Targets not followed anymore, their connections are dropped
+    GPtrArray *gone = g_ptr_array_new();
+    gboolean runner(gpointer k, gpointer v, gpointer u) {
+        (void) v, (void) u;
+        for (guint i=0; cfg->connect && i < cfg->connect->len ;++i) {
+            struct cfg_connect_s *cc = cfg->connect->pdata[i];
+            if (!strcmp(cc->type, k))
+                return FALSE;
+        }
+        g_ptr_array_add(gone, k);
+        return FALSE;
+    }
+    g_tree_foreach(zsock->connect_cfg, runner, NULL);
+    for (guint i=0; i < gone->len ;++i) {
+        struct zconnect_s *zco = g_tree_lookup(zsock->connect_cfg,
+                gone->pdata[i]);
+        g_debug(" %s -/> [%s]", zsock->fullname, zco->type);
+        _zco_apply_urlv(zco, g_malloc0(sizeof(gchar*)));
+        if (zsock->cache)
+            zcache_set_peers(zsock->cache, zsock->fullname, zco->type,
+                    zco->urlv_current);
+        g_tree_remove(zsock->connect_cfg, gone->pdata[i]);
+    }
+    g_ptr_array_free(gone, TRUE);
+
+    // New targets start their discovery, the others follow their policy
+    for (guint i=0; cfg->connect && i < cfg->connect->len ;++i) {
+        struct cfg_connect_s *cc = cfg->connect->pdata[i];
+        struct zconnect_s *zco = g_tree_lookup(zsock->connect_cfg, cc->type);
+        gchar *policy = zco ? g_strdup(zco->policy) : NULL;
+        zsock_connect(zsock, cc->type, cc->policy);
+        zsock_set_coalescing(zsock, cc->type, cc->delay_min, cc->delay_max);
+        zsock_set_grace(zsock, cc->type, cc->grace);
+        if (!zco) {
+            zco = g_tree_lookup(zsock->connect_cfg, cc->type);
+            g_debug(" %s -> [%s]", zsock->fullname, zco->type);
+            zdisco_start(zco->disco, zsock->store, zsock->zk_zr, zco);
+        }
+        else if (strcmp(policy, cc->policy))
+            zco_reconnect(zco);
+        g_free(policy);
+    }
+
+    // The endpoints are bound by the owner thread
+    struct zrebind_s *rb = g_malloc0(sizeof(struct zrebind_s));
+    rb->zsock = zsock;
+    rb->listen = g_strdupv(cfg->listen);
+    rb->weight = cfg->weight;
+    rb->batch = cfg->batch;
+    rb->batch_bytes = cfg->batch_bytes;
+    rb->batch_count = cfg->batch_count;
+    rb->batch_delay = cfg->batch_delay;
+    rb->added = g_ptr_array_new_with_free_func(g_free);
+    rb->removed = g_ptr_array_new_with_free_func(g_free);
+    _zsock_run(zsock, (zreactor_fn_task)_zsock_rebind, rb);
+    return TRUE;
+}
+
+void
+zsock_retire(struct zsock_s *zsock)
+{
+    ASSERT(zsock != NULL);
+    g_debug("SOCK [%s] retired", zsock->fullname);
+
+    // The connections go with the ZMQ socket
+    if (zsock->connect_cfg) {
+        g_tree_destroy(zsock->connect_cfg);
+        zsock->connect_cfg = NULL;
+    }
+    while (zsock->listen_nodes->len) {
+        struct zlisten_s *zl = g_ptr_array_remove_index_fast(
+                zsock->listen_nodes, 0);
+        _zlisten_withdraw(zl);
+    }
+    zsock->retired = TRUE;
+
+    _zsock_run(zsock, (zreactor_fn_task)_zsock_retire_owner, zsock);
+}
@@ -19,43 +19,132 @@ struct cfg_listen_s
     gchar *uuid;
     gchar *cell;
     gchar *url;
+    gint load; // published by the listener, -1 if unknown
 };
 
+/* A connect value is either the policy string, or an object:
+ *   {"policy":"all", "delay_min":50, "delay_max":1000, "grace":5000}
+ * The delays (ms) bound the window coalescing the changes of the peers. A
+ * peer vanished stays connected during the grace period (ms). */
+struct cfg_connect_s
+{
+    gchar *type;
+    gchar *policy;
+    guint delay_min; // quiet time after the last change
+    guint delay_max; // since the first change
+    guint grace; // 0 for the default, see zsock_set_connect_grace()
+};
+
+/* "batch": {"bytes":8192, "count":256, "delay":1} packs the small messages
+ * sent with zsock_send() in envelopes, flushed at the first threshold
+ * reached (delay in ms). Omitted fields take the defaults of zbatch.h. */
 struct cfg_sock_s
 {
     gchar *sockname;
     gchar *ztype;
-    gchar **connect; // pairs of char*
+    GPtrArray *connect; // (struct cfg_connect_s*)
     gchar **listen; // char*
+    guint weight; // share of the reactor's attention, 0 for the default
+    gboolean batch; // the envelopes are sent and unpacked
+    guint batch_bytes;
+    guint batch_count;
+    guint batch_delay;
+    guint workers; // "workers": N runs the handler in a pool, see zpool.h
+};
+
+/* "forward": {"in":"out"} moves the messages of a socket to another one,
+ * without user code (see zforward.h) */
+struct cfg_forward_s
+{
+    gchar *in;
+    gchar *out;
 };
 
 struct cfg_srv_s
 {
     gchar *srvtype;
     GPtrArray *socks; // (struct cfg_sock_s *)
+    GPtrArray *forward; // (struct cfg_forward_s *)
 };
 
 void cfg_listen_destroy(struct cfg_listen_s *cfg);
+void cfg_connect_destroy(struct cfg_connect_s *cfg);
 void cfg_sock_destroy(struct cfg_sock_s *cfg);
+void cfg_forward_destroy(struct cfg_forward_s *cfg);
 void cfg_srv_destroy(struct cfg_srv_s *cfg);
 
 struct cfg_listen_s * zlisten_parse_config_buffer(const gchar *b, gsize blen);
+
+/* The ephemeral node of a listener is named after its description, so that
+ * a single listing is enough to discover the peers. The JSON body is still
+ * written for older consumers. Format, the fields being URI-escaped:
+ *   ZLISTEN_NAME_TAG,<uuid>,<cell>,<ztype>,<url>,<sequence> */
+# define ZLISTEN_NAME_TAG "z1"
+
+/* NULL if 'name' does not describe the listener (e.g. an older node, whose
+ * body has to be fetched). */
+struct cfg_listen_s * zlisten_parse_name(const gchar *type,
+        const gchar *name);
 struct cfg_srv_s * zservice_parse_config_buffer(const gchar *b, gsize bl);
 struct cfg_srv_s * zservice_parse_config_string(const gchar *cfg);
 struct cfg_srv_s* zservice_parse_config_from_path(const gchar *path);
 
 //------------------------------------------------------------------------------
 
+struct zbatch_s;
+struct zcache_s;
+struct zdisco_s;
+struct zhisto_s;
+struct zjob_s;
+struct zstore_s;
+
+enum zpolicy_e
+{
+    ZPOLICY_ALL = 0, // every peer
+    ZPOLICY_NEAR, // the 'count' closest peers, by cell
+    ZPOLICY_LOAD, // the 'count' least loaded peers
+    ZPOLICY_HASH, // 'count' peers, by rendezvous hashing of the uuids
+};
+
+/* Period (ms) of the publication of the load by the listeners, and of its
+ * refresh by the sockets connecting with the "load:N" policy. The load is
+ * the percentage of the reactor turns that left messages waiting on the
+ * socket, only published when it moves by ZLOAD_STEP. */
+# define ZLOAD_PERIOD 5000
+# define ZLOAD_STEP 10
+
+/* The ephemeral node advertising a bound endpoint */
+struct zlisten_s
+{
+    gchar *url;
+    gchar *path; // known once created, see on_bind_create()
+    gint load; // last published
+    struct zstore_s *store;
+    gboolean pending; // being created
+    gint session; // ... in that session of the store, see zstore_session()
+    gboolean retired; // to be deleted as soon as created
+};
+
 struct zconnect_s
 {
     gchar *type;
     gchar *policy;
+    enum zpolicy_e policy_kind;
+    guint policy_count;
     gchar **urlv_current;
 
-    GPtrArray *urlv_new; // (struct cfg_listen_s*)
-    guint list_wanted;
-    guint list_pending;
-    guint get_pending;
+    // Peers connected but not listed anymore, kept (ranked last) until
+    // they have been missing for 'grace' ms.
+    guint grace; // 0 for the default
+    GTree *ghosts; // char* -> gint64* (ms, missing since)
+    struct ztimer_s *grace_timer; // the next ghost to drop
+
+    struct zdisco_s *disco; // the listeners of 'type', shared
+    struct {
+        guint64 reconnects; // deltas applied
+        guint64 lingered; // peers kept after they vanished
+        guint64 recovered; // ... that came back within the grace period
+    } stats;
 
     struct zsock_s *zs; // the socket it belongs to
 };
@@ -64,7 +153,8 @@ struct zsock_s
 {
     void *zctx; // a ZMQ context 
     void *zs; // ZMQ socket
-    zhandle_t *zh; // ZooKeeper handle
+    int ztype; // its ZMQ type, known once registered
+    struct zstore_s *store; // configuration and discovery
 
     gchar *fullname;
     gchar *localname;
@@ -75,17 +165,56 @@ struct zsock_s
     GTree *connect_real; // char* -> gulong
     GTree *connect_cfg; // char* -> (struct zconnect_s*)
     GTree *bind_set; // char* -> char*
+    GPtrArray *listen_nodes; // (struct zlisten_s*)
+    gboolean retired; // see zsock_retire(), ZooKeeper thread only
+    struct zcache_s *cache; // remembers the peers, may be NULL
+    struct zreactor_s *zk_zr; // runs the ZooKeeper callbacks, may be NULL
+
+    // Connection changes computed by the control plane (ZooKeeper side),
+    // waiting for the owner thread. Compacted: net count of connections.
+    GMutex pending_lock;
+    GTree *pending; // char* -> GINT_TO_POINTER(gint)
+    gboolean pending_posted;
+
+    // Connections delayed by the pacing, see zsock_set_connect_pacing()
+    GTree *connect_wait; // char* -> GINT_TO_POINTER(gint)
+    GQueue *connect_order; // (char*), may hold cancelled ones
+    struct ztimer_s *connect_timer;
+    gint64 connect_next; // ms, date of the next connection allowed
 
     void (*ready_out)(struct zsock_s*);
     void (*ready_in)(struct zsock_s*);
-    int evt; // to be monitored ZMQ_POLLIN|ZMQ_POLLOUT
+    gpointer ready_data; // context of the handlers
+    int evt; // to be monitored ZMQ_POLLIN|ZMQ_POLLOUT, see zsock_set_events()
+    guint weight; // see zreactor_set_weight()
+    guint budget; // messages left to zsock_recv() in the current handler
+    gboolean exhausted; // zsock_recv() refused a message
+    gboolean in_message; // zsock_recv() is in the middle of a multipart
+    gint in_turns; // calls to 'ready_in' (atomic, wraps)
+    gint in_backlogs; // ... that exhausted the budget (atomic, wraps)
+    guint load_turns; // values at the last zsock_publish_load()
+    guint load_backlogs;
+    guint workers; // asked by the configuration, see zservice_on_work()
+
+    // Envelopes, see zbatch.h
+    struct zbatch_s *batch; // packs the messages sent, NULL if disabled
+    gboolean out_message; // zsock_send() is in the middle of a multipart
+    zmq_msg_t unpack; // envelope received, being delivered
+    gsize unpack_at; // offset of its next message
+    gboolean unpacking;
+    struct zhisto_s *unpacked; // messages per envelope received, or NULL
+
+    // The reactor monitoring the socket. Its thread is the only one allowed
+    // to use the ZMQ socket, the connection sets and the handlers.
+    struct zreactor_s *zr;
+    struct zmon_s *zmon; // its handle in that reactor
 };
 
 struct zservice_s
 {
     void *zctx; // a ZMQ context 
     struct zreactor_s *zr; // the reactor managing this reactor
-    zhandle_t *zh; // the ZooKeeper handle
+    struct zstore_s *store; // configuration and discovery
 
     gpointer on_config_data;
     void (*on_config)(struct zservice_s *zsrv, gpointer data);
@@ -94,6 +223,23 @@ struct zservice_s
     GTree *socks;
     gchar uuid[32];
     gchar cell[32];
+
+    // Data-plane reactors sharing the sockets. When empty, all the sockets
+    // are managed by 'zr'.
+    GPtrArray *shards; // (struct zreactor_s*)
+    guint next_shard;
+
+    struct zcache_s *cache; // may be NULL
+    gboolean configured; // the sockets exist and have been registered
+    struct ztimer_s *load_timer; // see zsock_publish_load()
+    gchar *applied; // the last configuration applied
+
+    // The sockets linked by a rule are managed by the same reactor
+    GPtrArray *forward_cfg; // (struct cfg_forward_s*) rules in force
+    GPtrArray *forwards; // (struct zforward_s*) running
+
+    GTree *work; // (char*) socket name -> (struct zwork_s*)
+    GHashTable *pools; // (struct zsock_s*) -> (struct zpool_s*)
 };
 
 //------------------------------------------------------------------------------
@@ -103,18 +249,86 @@ struct zsock_s* zsock_create(const gchar *uuid, const gchar *cell);
 
 void zsock_destroy(struct zsock_s *zsock);
 
+/* TRUE if a message can be sent at once. An envelope refused earlier is
+ * sent first, FALSE while it is still refused. */
 gboolean zsock_ready(struct zsock_s *zsock);
 
 void zsock_configure(struct zsock_s *zsock, struct cfg_sock_s *cfg);
 
 void zsock_register_in_reactor(struct zreactor_s *zr, struct zsock_s *zsock);
 
+/* Applies a new definition to a registered socket, from the thread running
+ * the ZooKeeper callbacks: the targets, their policies and the endpoints
+ * bound are diffed, the ZMQ socket is kept. FALSE if it cannot be kept
+ * (its type changed). */
+gboolean zsock_reconfigure(struct zsock_s *zsock, struct cfg_sock_s *cfg);
+
+/* Withdraws the endpoints and the targets of a registered socket, from the
+ * thread running the ZooKeeper callbacks, then destroys it in the thread
+ * owning it. */
+void zsock_retire(struct zsock_s *zsock);
+
+/* Changes the events monitored for the socket (ZMQ_POLLIN|ZMQ_POLLOUT).
+ * Can be called from any thread. */
+void zsock_set_events(struct zsock_s *zsock, int evt);
+
 void zsock_connect(struct zsock_s *zsock, const gchar *type,
         const gchar *policy);
 
+/* Sets the coalescing window of the target 'type' (see cfg_connect_s),
+ * the widest one asked wins for all the sockets following that type. Only
+ * effective when the reactor running the ZooKeeper callbacks is known
+ * ('zk_zr'). */
+void zsock_set_coalescing(struct zsock_s *zsock, const gchar *type,
+        guint delay_min, guint delay_max);
+
+/* Sets the grace period (ms) of the peers of 'type' that vanished, 0 for
+ * the default. Same restriction as zsock_set_coalescing(). */
+void zsock_set_grace(struct zsock_s *zsock, const gchar *type, guint grace);
+
+/* Updates the load advertised for the endpoints bound, to be called
+ * periodically from the thread running the ZooKeeper callbacks. */
+void zsock_publish_load(struct zsock_s *zsock);
+
+/* Creates again the nodes of the endpoints bound, lost with an expired
+ * session. To be called from the thread running the ZooKeeper callbacks. */
+void zsock_renew(struct zsock_s *zsock);
+
+void zsock_set_load_period(guint period);
+
+/* Paces the connections of each socket to 'rate' per second (0 for no
+ * limit), the first one of a batch being delayed by a random time up to
+ * 'jitter' ms. The disconnections are never delayed. */
+void zsock_set_connect_pacing(guint rate, guint jitter);
+
+/* Default grace period (ms) of the peers vanished, 0 (none) by default */
+void zsock_set_connect_grace(guint grace);
+guint zsock_get_load_period(void);
+
+/* Non-blocking zmq_msg_recv() that counts the messages against the budget
+ * granted by the reactor to the 'ready_in' handler. Once exhausted, fails
+ * with EAGAIN and the handler will be called again at the next turn. */
+int zsock_recv(struct zsock_s *zsock, zmq_msg_t *msg);
+
+/* Non-blocking zmq_msg_send(), with the same ownership and errors. The
+ * single-frame messages smaller than the threshold are packed in an
+ * envelope when the socket batches. The envelopes received on such a
+ * socket are unpacked by zsock_recv(). To be called by the thread owning
+ * the socket. */
+int zsock_send(struct zsock_s *zsock, zmq_msg_t *msg, int flags);
+
+/* Enables the envelopes (see cfg_sock_s), 0 for the defaults. To be called
+ * by the thread owning the socket, or before it is registered. */
+void zsock_set_batch(struct zsock_s *zsock, guint bytes, guint count,
+        guint delay);
+
+/* Flushes and disables the envelopes, same thread */
+void zsock_unset_batch(struct zsock_s *zsock);
+
 //------------------------------------------------------------------------------
 
-struct zservice_s* zservice_create(void *zctx, zhandle_t *zh, const gchar *srvtype);
+struct zservice_s* zservice_create(void *zctx, struct zstore_s *store,
+        const gchar *srvtype);
 
 void zservice_destroy(struct zservice_s *zsrv);
 
@@ -123,7 +337,27 @@ struct zsock_s* zservice_get_socket(struct zservice_s *zsrv, const gchar *n);
 void zservice_register_in_reactor(struct zreactor_s *zr,
         struct zservice_s *zsrv);
 
+/* Remembers the configuration and the peers of the sockets in the file at
+ * 'path', and loads what a previous run left there. */
+void zservice_use_cache(struct zservice_s *zsrv, const gchar *path);
+
+/* Configures the service and connects its sockets as the cache tells, if it
+ * knows the service. ZooKeeper then reconciles the peers. To be called
+ * before zservice_register_in_reactor(). */
+gboolean zservice_start_from_cache(struct zservice_s *zsrv,
+        struct zreactor_s *zr);
+
 void zservice_on_config(struct zservice_s *zsrv, gpointer u,
         void (*hook)(struct zservice_s*, gpointer));
 
+/* The messages of the socket 'name' are given to 'fn' in the threads of a
+ * pool (see zpool.h) when its definition asks for "workers". Call it before
+ * the service starts, or from the hook of zservice_on_config(). */
+void zservice_on_work(struct zservice_s *zsrv, const gchar *name,
+        void (*fn)(gpointer, struct zjob_s*), gpointer u);
+
+/* Each socket configured afterwards is managed by one of the reactors added,
+ * in a round-robin fashion. 'zr' must be run by its own thread. */
+void zservice_add_shard(struct zservice_s *zsrv, struct zreactor_s *zr);
+
 #endif // TECHFORUM_zsock_h
@@ -32,6 +32,18 @@ cfg_listen_destroy(struct cfg_listen_s *cfg)
     g_free(cfg);
 }
 
+void
+cfg_connect_destroy(struct cfg_connect_s *cfg)
+{
+    if (!cfg)
+        return;
+    if (cfg->type)
+        g_free(cfg->type);
+    if (cfg->policy)
+        g_free(cfg->policy);
+    g_free(cfg);
+}
+
 void
 cfg_sock_destroy(struct cfg_sock_s *cfg)
 {
@@ -42,12 +54,22 @@ cfg_sock_destroy(struct cfg_sock_s *cfg)
     if (cfg->ztype)
         g_free(cfg->ztype);
     if (cfg->connect)
-        g_strfreev(cfg->connect);
+        g_ptr_array_free(cfg->connect, TRUE);
     if (cfg->listen)
         g_strfreev(cfg->listen);
     g_free(cfg);
 }
 
+void
+cfg_forward_destroy(struct cfg_forward_s *cfg)
+{
+    if (!cfg)
+        return;
+    g_free(cfg->in);
+    g_free(cfg->out);
+    g_free(cfg);
+}
+
 void
 cfg_srv_destroy(struct cfg_srv_s *cfg)
 {
@@ -55,6 +77,8 @@ cfg_srv_destroy(struct cfg_srv_s *cfg)
         return;
     if (cfg->srvtype)
         g_free(cfg->srvtype);
+    if (cfg->forward)
+        g_ptr_array_free(cfg->forward, TRUE);
     if (cfg->socks) {
         GPtrArray *gpa = cfg->socks;
         while (gpa->len > 0) {
@@ -66,25 +90,46 @@ cfg_srv_destroy(struct cfg_srv_s *cfg)
     g_free(cfg);
 }
 
-static gchar **
+static GPtrArray *
 _get_connectv(json_t *jconnect)
 {
-    GPtrArray *tmp = g_ptr_array_new();
+    GPtrArray *tmp = g_ptr_array_new_with_free_func(
+            (GDestroyNotify)cfg_connect_destroy);
 
     for (void *iter=json_object_iter(jconnect); iter != NULL;
             iter = json_object_iter_next(jconnect, iter)) {
         const char *key = json_object_iter_key(iter);
         json_t *jval = json_object_iter_value(iter);
-        if (!json_is_string(jval)) {
-            g_error("Connect URL is not a string");
+        struct cfg_connect_s *cc = g_malloc0(sizeof(struct cfg_connect_s));
+        cc->type = g_strdup(key);
+        g_ptr_array_add(tmp, cc);
+
+        if (json_is_string(jval)) {
+            cc->policy = g_strdup(json_string_value(jval));
+        }
+        else if (json_is_object(jval)) {
+            json_t *jpolicy = json_object_get(jval, "policy");
+            json_t *jmin = json_object_get(jval, "delay_min");
+            json_t *jmax = json_object_get(jval, "delay_max");
+            json_t *jgrace = json_object_get(jval, "grace");
+            cc->policy = g_strdup(json_is_string(jpolicy)
+                    ? json_string_value(jpolicy) : "all");
+            if (json_is_integer(jmin) && json_integer_value(jmin) > 0)
+                cc->delay_min = json_integer_value(jmin);
+            if (json_is_integer(jmax) && json_integer_value(jmax) > 0)
+                cc->delay_max = json_integer_value(jmax);
+            cc->delay_max = MAX(cc->delay_min, cc->delay_max);
+            if (json_is_integer(jgrace) && json_integer_value(jgrace) > 0)
+                cc->grace = json_integer_value(jgrace);
+        }
+        else {
+            g_error("Connect value is neither a string nor an object");
+            g_ptr_array_free(tmp, TRUE);
             return NULL;
         }
-        g_ptr_array_add(tmp, g_strdup(key));
-        g_ptr_array_add(tmp, g_strdup(json_string_value(jval)));
     }
 
-    g_ptr_array_add(tmp, NULL);
-    return (gchar**) g_ptr_array_free(tmp, FALSE);
+    return tmp;
 }
 
 static gchar **
@@ -105,7 +150,7 @@ _get_bindv(json_t *jbind)
 static struct cfg_sock_s*
 _parse_socket(json_t *jroot)
 {
-    json_t *jname, *jtype, *jconnect, *jbind;
+    json_t *jname, *jtype, *jconnect, *jbind, *jweight, *jbatch, *jworkers;
 
     if (!json_is_object(jroot)) {
         g_debug("Socket definition error : %s", "not a JSON object");
@@ -114,8 +159,11 @@ _parse_socket(json_t *jroot)
 
     JGET(jname, jroot, "name", string);
     JGET(jtype, jroot, "type", string);
+    JGET(jweight, jroot, "weight", integer);
+    JGET(jworkers, jroot, "workers", integer);
     jconnect = json_object_get(jroot, "connect");
     jbind = json_object_get(jroot, "bind");
+    jbatch = json_object_get(jroot, "batch");
 
     if (!jconnect && !jbind) {
         g_debug("Socket definition error : %s", "No bind or connect");
@@ -135,21 +183,62 @@ _parse_socket(json_t *jroot)
     csock->ztype = g_strdup(json_string_value(jtype));
     csock->connect = _get_connectv(jconnect);
     csock->listen = _get_bindv(jbind);
+    if (jweight && json_integer_value(jweight) > 0)
+        csock->weight = json_integer_value(jweight);
+    if (jworkers && json_integer_value(jworkers) > 0)
+        csock->workers = json_integer_value(jworkers);
+    if (json_is_object(jbatch)) {
+        guint get(const char *k) {
+            json_t *j = json_object_get(jbatch, k);
+            if (json_is_integer(j) && json_integer_value(j) > 0)
+                return json_integer_value(j);
+            return 0;
+        }
+        csock->batch = TRUE;
+        csock->batch_bytes = get("bytes");
+        csock->batch_count = get("count");
+        csock->batch_delay = get("delay");
+    }
 
     return csock;
 }
 
+static GPtrArray *
+_get_forwardv(json_t *jforward)
+{
+    GPtrArray *tmp = g_ptr_array_new_with_free_func(
+            (GDestroyNotify)cfg_forward_destroy);
+
+    for (void *iter=json_object_iter(jforward); iter != NULL;
+            iter = json_object_iter_next(jforward, iter)) {
+        const char *key = json_object_iter_key(iter);
+        json_t *jval = json_object_iter_value(iter);
+        if (!json_is_string(jval) || !strcmp(key, json_string_value(jval))) {
+            g_warning("Invalid forward rule from [%s]", key);
+            continue;
+        }
+        struct cfg_forward_s *cf = g_malloc0(sizeof(struct cfg_forward_s));
+        cf->in = g_strdup(key);
+        cf->out = g_strdup(json_string_value(jval));
+        g_ptr_array_add(tmp, cf);
+    }
+
+    return tmp;
+}
+
 static struct cfg_srv_s*
 _parse_service(json_t *jroot)
 {
-    json_t *jsocks, *jtype;
+    json_t *jsocks, *jtype, *jforward;
 
     JGET(jsocks, jroot, "sockets", array);
     JGET(jtype, jroot, "name", string);
+    JGET(jforward, jroot, "forward", object);
 
     struct cfg_srv_s *cfg = g_malloc0(sizeof(struct cfg_srv_s));
     cfg->srvtype = g_strdup(json_string_value(jtype));
     cfg->socks = g_ptr_array_new();
+    cfg->forward = _get_forwardv(jforward);
 
     size_t max = json_array_size(jsocks);
     for (size_t i=0; i<max ;++i) {
@@ -206,7 +295,7 @@ zservice_parse_config_from_path(const gchar *path)
 static struct cfg_listen_s *
 _parse_listen(json_t *jroot)
 {
-    json_t *jtype, *jztype, *jurl, *juuid, *jcell;
+    json_t *jtype, *jztype, *jurl, *juuid, *jcell, *jload;
 
     if (!json_is_object(jroot))
         return NULL;
@@ -215,6 +304,7 @@ _parse_listen(json_t *jroot)
     JGET(jurl, jroot, "url", string);
     JGET(juuid, jroot, "uuid", string);
     JGET(jcell, jroot, "cell", string);
+    JGET(jload, jroot, "load", integer);
 
     struct cfg_listen_s *result = NULL;
     result = g_malloc0(sizeof(struct cfg_listen_s));
@@ -223,6 +313,7 @@ _parse_listen(json_t *jroot)
     result->url = g_strdup(json_string_value(jurl));
     result->uuid = g_strdup(json_string_value(juuid));
     result->cell = g_strdup(json_string_value(jcell));
+    result->load = jload ? json_integer_value(jload) : -1;
     return result;
 }
 
@@ -243,3 +334,27 @@ zlisten_parse_config_buffer(const gchar *b, gsize blen)
     return result;
 }
 
+struct cfg_listen_s *
+zlisten_parse_name(const gchar *type, const gchar *name)
+{
+    struct cfg_listen_s *result = NULL;
+    gchar **tokens = g_strsplit(name, ",", 0);
+
+    // TAG,UUID,CELL,ZTYPE,URL,SEQ
+    if (g_strv_length(tokens) == 6 && !strcmp(tokens[0], ZLISTEN_NAME_TAG)) {
+        result = g_malloc0(sizeof(struct cfg_listen_s));
+        result->type = g_strdup(type);
+        result->uuid = g_strdup(tokens[1]);
+        result->cell = g_uri_unescape_string(tokens[2], NULL);
+        result->ztype = g_uri_unescape_string(tokens[3], NULL);
+        result->url = g_uri_unescape_string(tokens[4], NULL);
+        result->load = -1;
+        if (!result->cell || !result->ztype || !result->url) {
+            cfg_listen_destroy(result);
+            result = NULL;
+        }
+    }
+
+    g_strfreev(tokens);
+    return result;
+}
@@ -0,0 +1,617 @@
+#ifndef G_LOG_DOMAIN
+# define G_LOG_DOMAIN "zsock"
+#endif
+
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+#include <zookeeper.h>
+
+#include "./macros.h"
+#include "./zreactor.h"
+#include "./zstore.h"
+
+#define ZK_TIMEOUT 5000
+#define ZK_RETRY 1000
+
+struct zstore_hook_s
+{
+    zstore_fn_session fn;
+    gpointer u;
+};
+
+void
+zstore_init(struct zstore_s *st, struct zstore_vtable_s *vtable)
+{
+    st->vtable = vtable;
+    g_rec_mutex_init(&st->lock);
+    st->hooks = g_array_new(FALSE, FALSE, sizeof(struct zstore_hook_s));
+}
+
+gint
+zstore_session(struct zstore_s *st)
+{
+    return g_atomic_int_get(&st->session);
+}
+
+void
+zstore_clear(struct zstore_s *st)
+{
+    g_array_free(st->hooks, TRUE);
+    g_rec_mutex_clear(&st->lock);
+}
+
+void
+zstore_add_session_hook(struct zstore_s *st, zstore_fn_session fn, gpointer u)
+{
+    ASSERT(st != NULL);
+    ASSERT(fn != NULL);
+    struct zstore_hook_s hook = {fn, u};
+    g_rec_mutex_lock(&st->lock);
+    g_array_append_val(st->hooks, hook);
+    g_rec_mutex_unlock(&st->lock);
+}
+
+static gint
+_hook_find(struct zstore_s *st, zstore_fn_session fn, gpointer u)
+{
+    for (guint i=0; i < st->hooks->len ;++i) {
+        struct zstore_hook_s *h = &g_array_index(st->hooks,
+                struct zstore_hook_s, i);
+        if (h->fn == fn && h->u == u)
+            return i;
+    }
+    return -1;
+}
+
+void
+zstore_remove_session_hook(struct zstore_s *st, zstore_fn_session fn,
+        gpointer u)
+{
+    ASSERT(st != NULL);
+    g_rec_mutex_lock(&st->lock);
+    gint i = _hook_find(st, fn, u);
+    if (i >= 0)
+        g_array_remove_index(st->hooks, i);
+    g_rec_mutex_unlock(&st->lock);
+}
+
+void
+zstore_notify_session(struct zstore_s *st)
+{
+    // A hook may remove others, or itself
+    g_rec_mutex_lock(&st->lock);
+    GArray *todo = g_array_sized_new(FALSE, FALSE,
+            sizeof(struct zstore_hook_s), st->hooks->len);
+    g_array_append_vals(todo, st->hooks->data, st->hooks->len);
+    for (guint i=0; i < todo->len ;++i) {
+        struct zstore_hook_s *h = &g_array_index(todo,
+                struct zstore_hook_s, i);
+        if (_hook_find(st, h->fn, h->u) >= 0)
+            h->fn(h->u);
+    }
+    g_array_free(todo, TRUE);
+    g_rec_mutex_unlock(&st->lock);
+}
+
+struct zstore_s*
+zstore_open(const gchar *url)
+{
+    ASSERT(url != NULL);
+
+    if (g_str_has_prefix(url, "zk://"))
+        return zstore_open_zk(url + 5);
+    if (g_str_has_prefix(url, "file://"))
+        return zstore_open_file(url + 7);
+    if (!strstr(url, "://"))
+        return zstore_open_zk(url);
+
+    g_warning("Unknown discovery backend [%s]", url);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+
+/* An expired session cannot be resumed. The handle is replaced by a new one
+ * in the thread of the reactor, then the hooks are called once connected.
+ * Meanwhile, the calls fail and the ZMQ connections are left untouched. */
+struct zstore_zk_s
+{
+    struct zstore_s base;
+    gchar *hosts;
+    zhandle_t *zh; // current
+    zhandle_t *expired; // closed at the next renewal, a thread may hold it
+    struct zreactor_s *zr;
+    struct zmon_s *mon;
+    gint renewing;
+    gint orphan; // expired before a reactor was attached
+    guint64 renewals;
+#ifdef HAVE_ZK_MT
+    GMutex calls_lock;
+    GQueue *early; // calls completed before _zk_attach()
+#endif
+};
+
+#define ZK(st) ((struct zstore_zk_s*)(st))
+#define ZH(st) ((zhandle_t*)g_atomic_pointer_get(&ZK(st)->zh))
+
+static void _zk_renew(struct zstore_zk_s *st);
+#ifdef HAVE_ZK_MT
+struct zkcall_s;
+static void _zkcall_run(struct zkcall_s *c);
+static void _zkcall_free(struct zkcall_s *c);
+#endif
+
+static void
+_zk_on_session(zhandle_t *zh, int type, int state, const char *path,
+        void *ctx)
+{
+    struct zstore_zk_s *st = ctx;
+    (void) path;
+
+    if (type != ZOO_SESSION_EVENT)
+        return;
+
+    if (state == ZOO_EXPIRED_SESSION_STATE) {
+        if (!g_atomic_int_compare_and_exchange(&st->renewing, 0, 1))
+            return;
+        if (!st->zr) {
+            // Renewed by _zk_attach()
+            g_warning("ZK session expired, no reactor to renew it yet");
+            g_atomic_int_set(&st->orphan, 1);
+            g_atomic_int_set(&st->renewing, 0);
+            return;
+        }
+        g_warning("ZK session expired, renewing it");
+        zreactor_post(st->zr, (zreactor_fn_task)_zk_renew, st);
+    }
+    else if (state == ZOO_CONNECTED_STATE) {
+        if (!g_atomic_int_compare_and_exchange(&st->renewing, 1, 0))
+            return;
+        // The multi-threaded client may connect before _zk_renew() returns
+        g_atomic_pointer_set(&st->zh, zh);
+        g_message("ZK session renewed (%"G_GUINT64_FORMAT")", ++st->renewals);
+#ifdef HAVE_ZK_MT
+        zreactor_post(st->zr, (zreactor_fn_task)zstore_notify_session,
+                &st->base);
+#else
+        zstore_notify_session(&st->base);
+#endif
+    }
+}
+
+static void
+_zk_renew(struct zstore_zk_s *st)
+{
+    // Saved first, the multi-threaded client may replace it during the init.
+    // The session is bumped before it may connect and call the hooks.
+    zhandle_t *old = ZH(st);
+    g_atomic_int_inc(&st->base.session);
+    zhandle_t *zh = zookeeper_init(st->hosts, _zk_on_session, ZK_TIMEOUT,
+            NULL, st, 0);
+    if (!zh) {
+        g_warning("ZooKeeper init error [%s] : (%d) %s", st->hosts,
+                errno, g_strerror(errno));
+        zreactor_add_timer(st->zr, ZK_RETRY, (zreactor_fn_timer)_zk_renew, st);
+        return;
+    }
+
+#ifndef HAVE_ZK_MT
+    zreactor_remove(st->zr, st->mon);
+    st->mon = zreactor_add_zk(st->zr, zh);
+#endif
+    if (st->expired)
+        zookeeper_close(st->expired);
+    st->expired = old;
+    g_atomic_pointer_set(&st->zh, zh);
+}
+
+static void
+_zk_destroy(struct zstore_s *st)
+{
+#ifdef HAVE_ZK_MT
+    // The calls completed by the closing are not deferred anymore
+    g_mutex_lock(&ZK(st)->calls_lock);
+    ZK(st)->zr = NULL;
+    g_mutex_unlock(&ZK(st)->calls_lock);
+#endif
+    zookeeper_close(ZH(st));
+    if (ZK(st)->expired)
+        zookeeper_close(ZK(st)->expired);
+#ifdef HAVE_ZK_MT
+    while (!g_queue_is_empty(ZK(st)->early))
+        _zkcall_free(g_queue_pop_head(ZK(st)->early));
+    g_queue_free(ZK(st)->early);
+    g_mutex_clear(&ZK(st)->calls_lock);
+#endif
+    zstore_clear(st);
+    g_free(ZK(st)->hosts);
+    g_free(st);
+}
+
+static void
+_zk_attach(struct zstore_s *st, struct zreactor_s *zr)
+{
+#ifdef HAVE_ZK_MT
+    // The client runs its own threads, the calls completed are handed over
+    g_mutex_lock(&ZK(st)->calls_lock);
+    ZK(st)->zr = zr;
+    while (!g_queue_is_empty(ZK(st)->early))
+        zreactor_post(zr, (zreactor_fn_task)_zkcall_run,
+                g_queue_pop_head(ZK(st)->early));
+    g_mutex_unlock(&ZK(st)->calls_lock);
+#else
+    ZK(st)->zr = zr;
+    ZK(st)->mon = zreactor_add_zk(zr, ZH(st));
+#endif
+    if (g_atomic_int_compare_and_exchange(&ZK(st)->orphan, 1, 0)
+            && g_atomic_int_compare_and_exchange(&ZK(st)->renewing, 0, 1)) {
+        g_warning("ZK session expired, renewing it");
+        zreactor_post(zr, (zreactor_fn_task)_zk_renew, st);
+    }
+}
+
+#ifdef HAVE_ZK_MT
+/* The multi-threaded client calls back from its own thread: the results are
+ * copied and the callbacks deferred to the reactor attached, as with the
+ * single-threaded client. */
+struct zkcall_s
+{
+    enum { ZK_DATA, ZK_STRINGS, ZK_STRING, ZK_STAT, ZK_VOID, ZK_WATCH } kind;
+    struct zstore_zk_s *st;
+    int rc;
+    union {
+        data_completion_t data;
+        strings_completion_t strings;
+        string_completion_t string;
+        stat_completion_t stat;
+        void_completion_t vd;
+        watcher_fn watch;
+    } fn;
+    const void *u;
+    struct zkwatch_s *watch; // armed by the call, if it succeeds
+    gchar *buf; // the data, the name created or the path watched
+    int buflen;
+    struct String_vector sv;
+    struct Stat stat;
+    gboolean has_stat;
+    int type, state; // of the watch
+};
+
+/* A watch, that stays registered until it fires with a node event or the
+ * session expires */
+struct zkwatch_s
+{
+    struct zstore_zk_s *st;
+    watcher_fn fn;
+    void *ctx;
+};
+
+static void
+_zkcall_free(struct zkcall_s *c)
+{
+    for (gint32 i=0; i < c->sv.count ;++i)
+        g_free(c->sv.data[i]);
+    g_free(c->sv.data);
+    g_free(c->buf);
+    g_free(c);
+}
+
+static void
+_zkcall_run(struct zkcall_s *c)
+{
+    const struct Stat *stat = c->has_stat ? &c->stat : NULL;
+    switch (c->kind) {
+        case ZK_DATA:
+            c->fn.data(c->rc, c->buf, c->buflen, stat, c->u);
+            break;
+        case ZK_STRINGS:
+            c->fn.strings(c->rc, c->rc == ZOK ? &c->sv : NULL, c->u);
+            break;
+        case ZK_STRING:
+            c->fn.string(c->rc, c->buf, c->u);
+            break;
+        case ZK_STAT:
+            c->fn.stat(c->rc, stat, c->u);
+            break;
+        case ZK_VOID:
+            c->fn.vd(c->rc, c->u);
+            break;
+        case ZK_WATCH:
+            c->fn.watch(ZH(c->st), c->type, c->state, c->buf, (void*)c->u);
+            break;
+    }
+    _zkcall_free(c);
+}
+
+static struct zkcall_s *
+_zkcall(struct zstore_zk_s *st, int kind, const void *u)
+{
+    struct zkcall_s *c = g_malloc0(sizeof(struct zkcall_s));
+    c->kind = kind;
+    c->st = st;
+    c->u = u;
+    return c;
+}
+
+static void
+_zkcall_defer(struct zkcall_s *c)
+{
+    struct zstore_zk_s *st = c->st;
+    g_mutex_lock(&st->calls_lock);
+    struct zreactor_s *zr = st->zr;
+    if (!zr)
+        g_queue_push_tail(st->early, c);
+    g_mutex_unlock(&st->calls_lock);
+    if (zr)
+        zreactor_post(zr, (zreactor_fn_task)_zkcall_run, c);
+}
+
+/* No watch is left by a read that failed */
+static void
+_zkcall_set_rc(struct zkcall_s *c, int r)
+{
+    c->rc = r;
+    if (r != ZOK)
+        g_free(c->watch);
+    c->watch = NULL;
+}
+
+static void
+_zkcall_set_stat(struct zkcall_s *c, const struct Stat *s)
+{
+    if (s) {
+        memcpy(&c->stat, s, sizeof(struct Stat));
+        c->has_stat = TRUE;
+    }
+}
+
+static void
+_zk_on_data(int r, const char *v, int vl, const struct Stat *s,
+        const void *u)
+{
+    struct zkcall_s *c = (struct zkcall_s*) u;
+    _zkcall_set_rc(c, r);
+    if (v && vl >= 0) {
+        c->buf = g_malloc(vl + 1);
+        memcpy(c->buf, v, vl);
+        c->buf[vl] = '\0';
+    }
+    c->buflen = vl;
+    _zkcall_set_stat(c, s);
+    _zkcall_defer(c);
+}
+
+static void
+_zk_on_strings(int r, const struct String_vector *sv, const void *u)
+{
+    struct zkcall_s *c = (struct zkcall_s*) u;
+    _zkcall_set_rc(c, r);
+    if (sv && sv->count > 0) {
+        c->sv.count = sv->count;
+        c->sv.data = g_malloc0(sv->count * sizeof(char*));
+        for (gint32 i=0; i < sv->count ;++i)
+            c->sv.data[i] = g_strdup(sv->data[i]);
+    }
+    _zkcall_defer(c);
+}
+
+static void
+_zk_on_string(int r, const char *v, const void *u)
+{
+    struct zkcall_s *c = (struct zkcall_s*) u;
+    c->rc = r;
+    c->buf = g_strdup(v);
+    _zkcall_defer(c);
+}
+
+static void
+_zk_on_stat(int r, const struct Stat *s, const void *u)
+{
+    struct zkcall_s *c = (struct zkcall_s*) u;
+    _zkcall_set_rc(c, r);
+    _zkcall_set_stat(c, s);
+    _zkcall_defer(c);
+}
+
+/* The watch stays armed on a missing node */
+static void
+_zk_on_exists(int r, const struct Stat *s, const void *u)
+{
+    struct zkcall_s *c = (struct zkcall_s*) u;
+    if (r == ZNONODE)
+        c->watch = NULL;
+    _zk_on_stat(r, s, u);
+}
+
+static void
+_zk_on_void(int r, const void *u)
+{
+    struct zkcall_s *c = (struct zkcall_s*) u;
+    c->rc = r;
+    _zkcall_defer(c);
+}
+
+static void
+_zk_on_watch(zhandle_t *zh, int type, int state, const char *path,
+        void *ctx)
+{
+    struct zkwatch_s *w = ctx;
+    (void) zh;
+
+    struct zkcall_s *c = _zkcall(w->st, ZK_WATCH, w->ctx);
+    c->fn.watch = w->fn;
+    c->type = type;
+    c->state = state;
+    c->buf = g_strdup(path);
+    if (type != ZOO_SESSION_EVENT || state == ZOO_EXPIRED_SESSION_STATE)
+        g_free(w);
+    _zkcall_defer(c);
+}
+
+static struct zkwatch_s *
+_zkwatch(struct zstore_s *st, watcher_fn fn, void *ctx)
+{
+    if (!fn)
+        return NULL;
+    struct zkwatch_s *w = g_malloc0(sizeof(struct zkwatch_s));
+    w->st = ZK(st);
+    w->fn = fn;
+    w->ctx = ctx;
+    return w;
+}
+
+/* The call failed, nothing will be called back */
+static int
+_zk_check(int rc, struct zkcall_s *c, struct zkwatch_s *w)
+{
+    if (rc != ZOK) {
+        _zkcall_free(c);
+        g_free(w);
+    }
+    return rc;
+}
+
+static int
+_zk_awget(struct zstore_s *st, const char *path, watcher_fn w, void *wctx,
+        data_completion_t dc, const void *u)
+{
+    struct zkcall_s *c = _zkcall(ZK(st), ZK_DATA, u);
+    struct zkwatch_s *zw = _zkwatch(st, w, wctx);
+    c->fn.data = dc;
+    c->watch = zw;
+    return _zk_check(zoo_awget(ZH(st), path, zw ? _zk_on_watch : NULL, zw,
+                _zk_on_data, c), c, zw);
+}
+
+static int
+_zk_awget_children(struct zstore_s *st, const char *path, watcher_fn w,
+        void *wctx, strings_completion_t sc, const void *u)
+{
+    struct zkcall_s *c = _zkcall(ZK(st), ZK_STRINGS, u);
+    struct zkwatch_s *zw = _zkwatch(st, w, wctx);
+    c->fn.strings = sc;
+    c->watch = zw;
+    return _zk_check(zoo_awget_children(ZH(st), path,
+                zw ? _zk_on_watch : NULL, zw, _zk_on_strings, c), c, zw);
+}
+
+static int
+_zk_awexists(struct zstore_s *st, const char *path, watcher_fn w,
+        void *wctx, stat_completion_t sc, const void *u)
+{
+    struct zkcall_s *c = _zkcall(ZK(st), ZK_STAT, u);
+    struct zkwatch_s *zw = _zkwatch(st, w, wctx);
+    c->fn.stat = sc;
+    c->watch = zw;
+    return _zk_check(zoo_awexists(ZH(st), path, zw ? _zk_on_watch : NULL, zw,
+                _zk_on_exists, c), c, zw);
+}
+
+static int
+_zk_acreate(struct zstore_s *st, const char *path, const char *v, int vl,
+        int flags, string_completion_t sc, const void *u)
+{
+    struct zkcall_s *c = _zkcall(ZK(st), ZK_STRING, u);
+    c->fn.string = sc;
+    return _zk_check(zoo_acreate(ZH(st), path, v, vl, &ZOO_OPEN_ACL_UNSAFE,
+                flags, _zk_on_string, c), c, NULL);
+}
+
+static int
+_zk_aset(struct zstore_s *st, const char *path, const char *v, int vl,
+        int version, stat_completion_t sc, const void *u)
+{
+    struct zkcall_s *c = _zkcall(ZK(st), ZK_STAT, u);
+    c->fn.stat = sc;
+    return _zk_check(zoo_aset(ZH(st), path, v, vl, version, _zk_on_stat, c),
+            c, NULL);
+}
+
+static int
+_zk_adelete(struct zstore_s *st, const char *path, int version,
+        void_completion_t vc, const void *u)
+{
+    struct zkcall_s *c = _zkcall(ZK(st), ZK_VOID, u);
+    c->fn.vd = vc;
+    return _zk_check(zoo_adelete(ZH(st), path, version, _zk_on_void, c),
+            c, NULL);
+}
+#else
+static int
+_zk_awget(struct zstore_s *st, const char *path, watcher_fn w, void *wctx,
+        data_completion_t dc, const void *u)
+{
+    return zoo_awget(ZH(st), path, w, wctx, dc, u);
+}
+
+static int
+_zk_awget_children(struct zstore_s *st, const char *path, watcher_fn w,
+        void *wctx, strings_completion_t sc, const void *u)
+{
+    return zoo_awget_children(ZH(st), path, w, wctx, sc, u);
+}
+
+static int
+_zk_awexists(struct zstore_s *st, const char *path, watcher_fn w,
+        void *wctx, stat_completion_t sc, const void *u)
+{
+    return zoo_awexists(ZH(st), path, w, wctx, sc, u);
+}
+
+static int
+_zk_acreate(struct zstore_s *st, const char *path, const char *v, int vl,
+        int flags, string_completion_t sc, const void *u)
+{
+    return zoo_acreate(ZH(st), path, v, vl, &ZOO_OPEN_ACL_UNSAFE, flags,
+            sc, u);
+}
+
+static int
+_zk_aset(struct zstore_s *st, const char *path, const char *v, int vl,
+        int version, stat_completion_t sc, const void *u)
+{
+    return zoo_aset(ZH(st), path, v, vl, version, sc, u);
+}
+
+static int
+_zk_adelete(struct zstore_s *st, const char *path, int version,
+        void_completion_t vc, const void *u)
+{
+    return zoo_adelete(ZH(st), path, version, vc, u);
+}
+#endif
+
+static struct zstore_vtable_s vtable_zk =
+{
+    _zk_destroy, _zk_attach,
+    _zk_awget, _zk_awget_children, _zk_awexists, _zk_acreate, _zk_aset,
+    _zk_adelete
+};
+
+struct zstore_s*
+zstore_open_zk(const gchar *hosts)
+{
+    ASSERT(hosts != NULL);
+
+    struct zstore_zk_s *st = g_malloc0(sizeof(struct zstore_zk_s));
+#ifdef HAVE_ZK_MT
+    g_mutex_init(&st->calls_lock);
+    st->early = g_queue_new();
+#endif
+    st->zh = zookeeper_init(hosts, _zk_on_session, ZK_TIMEOUT, NULL, st, 0);
+    if (!st->zh) {
+        g_warning("ZooKeeper init error [%s] : (%d) %s", hosts,
+                errno, g_strerror(errno));
+#ifdef HAVE_ZK_MT
+        g_queue_free(st->early);
+        g_mutex_clear(&st->calls_lock);
+#endif
+        g_free(st);
+        return NULL;
+    }
+    zstore_init(&st->base, &vtable_zk);
+    st->hosts = g_strdup(hosts);
+    return &st->base;
+}
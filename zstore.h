@@ -0,0 +1,137 @@
+#ifndef TECHFORUM_zstore_h
+# define TECHFORUM_zstore_h 1
+# include <glib.h>
+# include <zookeeper.h>
+
+/* Backend of the configuration and of the discovery: a tree of nodes with
+ * data, ephemeral nodes and one-shot watches. The calls mimic the
+ * asynchronous API of ZooKeeper, with the same completions, watchers and
+ * return codes, and the completions are never called from within the
+ * call. Two backends exist:
+ *   zk://host:port[,host:port...]  ZooKeeper
+ *   file:///path/to/dir           A local directory (see zstore_file.c) */
+
+struct zreactor_s;
+struct zstore_s;
+
+typedef void (*zstore_fn_session) (gpointer u);
+
+struct zstore_vtable_s
+{
+    void (*destroy) (struct zstore_s *st);
+
+    // Runs the callbacks in the thread of 'zr'
+    void (*attach) (struct zstore_s *st, struct zreactor_s *zr);
+
+    int (*awget) (struct zstore_s *st, const char *path,
+            watcher_fn w, void *wctx, data_completion_t dc, const void *u);
+
+    int (*awget_children) (struct zstore_s *st, const char *path,
+            watcher_fn w, void *wctx, strings_completion_t sc, const void *u);
+
+    // The watch is armed even on a missing node, it fires at its creation
+    int (*awexists) (struct zstore_s *st, const char *path,
+            watcher_fn w, void *wctx, stat_completion_t sc, const void *u);
+
+    // Only ZOO_EPHEMERAL|ZOO_SEQUENCE nodes are created by the services
+    int (*acreate) (struct zstore_s *st, const char *path, const char *v,
+            int vl, int flags, string_completion_t sc, const void *u);
+
+    int (*aset) (struct zstore_s *st, const char *path, const char *v,
+            int vl, int version, stat_completion_t sc, const void *u);
+
+    int (*adelete) (struct zstore_s *st, const char *path, int version,
+            void_completion_t vc, const void *u);
+};
+
+struct zstore_s
+{
+    struct zstore_vtable_s *vtable;
+    GRecMutex lock;
+    GArray *hooks; // (struct zstore_hook_s)
+    gint session; // bumped when a new session replaces the expired one
+};
+
+/* NULL if the URL is not understood. Without a scheme, the URL is taken
+ * as a list of ZooKeeper hosts. */
+struct zstore_s* zstore_open(const gchar *url);
+
+struct zstore_s* zstore_open_zk(const gchar *hosts);
+
+struct zstore_s* zstore_open_file(const gchar *basedir);
+
+/* 'fn' is called with 'u' once a new session replaced an expired one: the
+ * ephemeral nodes and the watches are lost and must be created again. Called
+ * where the callbacks run. Can be called from any thread, even from a hook. */
+void zstore_add_session_hook(struct zstore_s *st, zstore_fn_session fn,
+        gpointer u);
+
+void zstore_remove_session_hook(struct zstore_s *st, zstore_fn_session fn,
+        gpointer u);
+
+/* The generation of the session the calls are issued in. Any thread. */
+gint zstore_session(struct zstore_s *st);
+
+/* For the backends */
+void zstore_init(struct zstore_s *st, struct zstore_vtable_s *vtable);
+
+void zstore_clear(struct zstore_s *st);
+
+void zstore_notify_session(struct zstore_s *st);
+
+static inline void
+zstore_close(struct zstore_s *st)
+{
+    if (st)
+        st->vtable->destroy(st);
+}
+
+static inline void
+zstore_attach(struct zstore_s *st, struct zreactor_s *zr)
+{
+    st->vtable->attach(st, zr);
+}
+
+static inline int
+zstore_awget(struct zstore_s *st, const char *path, watcher_fn w,
+        void *wctx, data_completion_t dc, const void *u)
+{
+    return st->vtable->awget(st, path, w, wctx, dc, u);
+}
+
+static inline int
+zstore_awget_children(struct zstore_s *st, const char *path, watcher_fn w,
+        void *wctx, strings_completion_t sc, const void *u)
+{
+    return st->vtable->awget_children(st, path, w, wctx, sc, u);
+}
+
+static inline int
+zstore_awexists(struct zstore_s *st, const char *path, watcher_fn w,
+        void *wctx, stat_completion_t sc, const void *u)
+{
+    return st->vtable->awexists(st, path, w, wctx, sc, u);
+}
+
+static inline int
+zstore_acreate(struct zstore_s *st, const char *path, const char *v, int vl,
+        int flags, string_completion_t sc, const void *u)
+{
+    return st->vtable->acreate(st, path, v, vl, flags, sc, u);
+}
+
+static inline int
+zstore_aset(struct zstore_s *st, const char *path, const char *v, int vl,
+        int version, stat_completion_t sc, const void *u)
+{
+    return st->vtable->aset(st, path, v, vl, version, sc, u);
+}
+
+static inline int
+zstore_adelete(struct zstore_s *st, const char *path, int version,
+        void_completion_t vc, const void *u)
+{
+    return st->vtable->adelete(st, path, version, vc, u);
+}
+
+#endif // TECHFORUM_zstore_h
@@ -0,0 +1,687 @@
+#ifndef G_LOG_DOMAIN
+# define G_LOG_DOMAIN "zsock"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <glib.h>
+#include <zmq.h>
+#include <zookeeper.h>
+
+#include "./macros.h"
+#include "./zreactor.h"
+#include "./zstore.h"
+
+/* A node is a file (its data) or a directory (its children) under the base
+ * directory, watched with inotify. The files are replaced atomically: a
+ * new node is linked (IN_CREATE), an existing one renamed over (IN_MOVED_TO)
+ * so that only the creations and deletions fire the watches of children.
+ *
+ * An ephemeral node 'N' comes with a lock file '.N.lock', locked by the
+ * process that created it as long as it lives. A node whose lock file is
+ * not locked anymore is deleted by the next process that lists it, or at
+ * the next periodic check of the directories watched. The dot-files are
+ * never listed. */
+
+#define ZSTORE_REAP_PERIOD 1000
+
+struct zstore_file_s
+{
+    struct zstore_s base;
+    gchar *basedir;
+
+    GMutex lock;
+    struct zreactor_s *zr;
+    GQueue *early; // completions issued before zstore_attach()
+    int ifd; // inotify
+    int ievt;
+    GHashTable *wds; // GINT_TO_POINTER(wd) -> char* (node path of a dir)
+    GHashTable *dirs; // char* -> GINT_TO_POINTER(wd)
+    GPtrArray *watches; // (struct zwatch_s*)
+    GHashTable *owned; // char* (node path) -> GINT_TO_POINTER(lock fd)
+    gint seq;
+};
+
+/* One-shot watch on the data of 'dir/name', or on the children of 'dir' */
+struct zwatch_s
+{
+    gchar *dir;
+    gchar *name; // NULL for the children
+    watcher_fn fn;
+    void *ctx;
+};
+
+/* A completion deferred to the reactor */
+struct zcall_s
+{
+    enum { ZC_DATA, ZC_STRINGS, ZC_STRING, ZC_STAT, ZC_VOID } kind;
+    int rc;
+    union {
+        data_completion_t data;
+        strings_completion_t strings;
+        string_completion_t string;
+        stat_completion_t stat;
+        void_completion_t vd;
+    } fn;
+    const void *u;
+    gchar *buf;
+    gsize buflen;
+    struct String_vector sv;
+    struct Stat stat;
+};
+
+static void
+_zcall_free(struct zcall_s *c)
+{
+    for (gint32 i=0; i < c->sv.count ;++i)
+        g_free(c->sv.data[i]);
+    g_free(c->sv.data);
+    g_free(c->buf);
+    g_free(c);
+}
+
+static void
+_zcall_run(struct zcall_s *c)
+{
+    switch (c->kind) {
+        case ZC_DATA:
+            c->fn.data(c->rc, c->buf, c->buflen, &c->stat, c->u);
+            break;
+        case ZC_STRINGS:
+            c->fn.strings(c->rc, &c->sv, c->u);
+            break;
+        case ZC_STRING:
+            c->fn.string(c->rc, c->buf, c->u);
+            break;
+        case ZC_STAT:
+            c->fn.stat(c->rc, &c->stat, c->u);
+            break;
+        case ZC_VOID:
+            c->fn.vd(c->rc, c->u);
+            break;
+    }
+    _zcall_free(c);
+}
+
+static void
+_defer(struct zstore_file_s *st, struct zcall_s *c)
+{
+    g_mutex_lock(&st->lock);
+    struct zreactor_s *zr = st->zr;
+    if (!zr)
+        g_queue_push_tail(st->early, c);
+    g_mutex_unlock(&st->lock);
+    if (zr)
+        zreactor_post(zr, (zreactor_fn_task)_zcall_run, c);
+}
+
+static struct zcall_s *
+_zcall(int kind, int rc, const void *u)
+{
+    struct zcall_s *c = g_malloc0(sizeof(struct zcall_s));
+    c->kind = kind;
+    c->rc = rc;
+    c->u = u;
+    return c;
+}
+
+//------------------------------------------------------------------------------
+
+static gboolean
+_path_valid(const char *path)
+{
+    return path && *path == '/' && !strstr(path, "/.") && !strstr(path, "//");
+}
+
+static gchar *
+_real(struct zstore_file_s *st, const char *path)
+{
+    return g_strconcat(st->basedir, path, NULL);
+}
+
+static gchar *
+_lock_path(struct zstore_file_s *st, const char *path)
+{
+    gchar *dir = g_path_get_dirname(path);
+    gchar *base = g_path_get_basename(path);
+    gchar *lock = g_strdup_printf("%s%s/.%s.lock", st->basedir,
+            strcmp(dir, "/") ? dir : "", base);
+    g_free(dir);
+    g_free(base);
+    return lock;
+}
+
+/* Atomically creates or replaces the file of the node */
+static int
+_write(struct zstore_file_s *st, const char *path, const char *v, int vl,
+        gboolean create)
+{
+    gchar *real = _real(st, path);
+    gchar *dir = g_path_get_dirname(real);
+    gchar *tmp = g_strdup_printf("%s/.tmp-%d-%d", dir, getpid(),
+            g_atomic_int_add(&st->seq, 1));
+    int rc = ZOK;
+    if (!g_file_set_contents(tmp, v ? v : "", v ? vl : 0, NULL))
+        rc = ZSYSTEMERROR;
+    else if (create) {
+        if (0 > link(tmp, real))
+            rc = (errno == EEXIST) ? ZNODEEXISTS : ZSYSTEMERROR;
+    }
+    else if (0 > rename(tmp, real))
+        rc = ZSYSTEMERROR;
+    if (create || rc != ZOK)
+        unlink(tmp);
+    g_free(tmp);
+    g_free(dir);
+    g_free(real);
+    return rc;
+}
+
+/* TRUE if 'path' is an ephemeral node whose owner is gone, then deleted */
+static gboolean
+_reap(struct zstore_file_s *st, const char *path)
+{
+    gchar *lock = _lock_path(st, path);
+    gboolean dead = FALSE;
+    int fd = open(lock, O_RDONLY|O_CLOEXEC);
+    if (fd >= 0) {
+        if (0 == flock(fd, LOCK_EX|LOCK_NB)) {
+            gchar *real = _real(st, path);
+            unlink(real);
+            unlink(lock);
+            g_free(real);
+            dead = TRUE;
+        }
+        close(fd);
+    }
+    g_free(lock);
+    return dead;
+}
+
+/* Returns the node path of the children of the directory, the dead
+ * ephemeral ones being deleted */
+static GPtrArray *
+_list(struct zstore_file_s *st, const char *path)
+{
+    gchar *real = _real(st, path);
+    DIR *d = opendir(real);
+    g_free(real);
+    if (!d)
+        return NULL;
+
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    for (struct dirent *de; NULL != (de = readdir(d)) ;) {
+        if (de->d_name[0] == '.')
+            continue;
+        gchar *child = g_strconcat(strcmp(path, "/") ? path : "", "/",
+                de->d_name, NULL);
+        if (!_reap(st, child))
+            g_ptr_array_add(names, g_strdup(de->d_name));
+        g_free(child);
+    }
+    closedir(d);
+    return names;
+}
+
+static void
+_watch_dir(struct zstore_file_s *st, const char *dir)
+{
+    if (g_hash_table_lookup(st->dirs, dir))
+        return;
+    gchar *real = _real(st, dir);
+    int wd = inotify_add_watch(st->ifd, real, IN_CREATE|IN_CLOSE_WRITE
+            |IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_ONLYDIR);
+    g_free(real);
+    if (wd < 0) {
+        g_warning("inotify error on [%s] : (%d) %s", dir, errno,
+                g_strerror(errno));
+        return;
+    }
+    g_hash_table_insert(st->wds, GINT_TO_POINTER(wd), g_strdup(dir));
+    g_hash_table_insert(st->dirs, g_strdup(dir), GINT_TO_POINTER(wd));
+}
+
+/* Called with the lock held */
+static void
+_add_watch(struct zstore_file_s *st, const char *path, gboolean children,
+        watcher_fn fn, void *ctx)
+{
+    struct zwatch_s *w = g_malloc0(sizeof(struct zwatch_s));
+    if (children)
+        w->dir = g_strdup(path);
+    else {
+        w->dir = g_path_get_dirname(path);
+        w->name = g_path_get_basename(path);
+    }
+    w->fn = fn;
+    w->ctx = ctx;
+    _watch_dir(st, w->dir);
+    g_ptr_array_add(st->watches, w);
+}
+
+/* Calls and frees the watches in 'fired' */
+static void
+_notify(GPtrArray *fired, int data_event)
+{
+    for (guint i=0; i < fired->len ;++i) {
+        struct zwatch_s *w = fired->pdata[i];
+        if (!w->name)
+            w->fn(NULL, ZOO_CHILD_EVENT, ZOO_CONNECTED_STATE, w->dir, w->ctx);
+        else {
+            gchar *path = g_strconcat(strcmp(w->dir, "/") ? w->dir : "", "/",
+                    w->name, NULL);
+            w->fn(NULL, data_event, ZOO_CONNECTED_STATE, path, w->ctx);
+            g_free(path);
+        }
+        g_free(w->dir);
+        g_free(w->name);
+        g_free(w);
+    }
+    g_ptr_array_free(fired, TRUE);
+}
+
+/* Fires the watches matching the event, they are consumed */
+static void
+_fire(struct zstore_file_s *st, const gchar *dir, const gchar *name,
+        guint32 mask)
+{
+    // A rename replaces a node, as a set does
+    gboolean child_event = 0 != (mask & (IN_CREATE|IN_MOVED_FROM|IN_DELETE));
+    int data_event = 0;
+    if (mask & IN_CREATE)
+        data_event = ZOO_CREATED_EVENT;
+    else if (mask & (IN_CLOSE_WRITE|IN_MOVED_TO))
+        data_event = ZOO_CHANGED_EVENT;
+    else if (mask & (IN_DELETE|IN_MOVED_FROM))
+        data_event = ZOO_DELETED_EVENT;
+
+    GPtrArray *fired = g_ptr_array_new();
+    g_mutex_lock(&st->lock);
+    for (guint i=0; i < st->watches->len ;) {
+        struct zwatch_s *w = st->watches->pdata[i];
+        if (strcmp(w->dir, dir)
+                || (!w->name && !child_event)
+                || (w->name && (!data_event || strcmp(w->name, name))))
+            ++ i;
+        else {
+            g_ptr_array_remove_index(st->watches, i);
+            g_ptr_array_add(fired, w);
+        }
+    }
+    g_mutex_unlock(&st->lock);
+    _notify(fired, data_event);
+}
+
+/* The events queued were lost, every watch fires as if its node changed.
+ * The watchers read the nodes again. */
+static void
+_fire_all(struct zstore_file_s *st)
+{
+    g_mutex_lock(&st->lock);
+    GPtrArray *fired = st->watches;
+    st->watches = g_ptr_array_new();
+    g_mutex_unlock(&st->lock);
+    g_warning("inotify queue overflow, %u watches fired", fired->len);
+    _notify(fired, ZOO_CHANGED_EVENT);
+}
+
+static int
+_on_inotify(struct zstore_file_s *st, int fd, int e)
+{
+    (void) e;
+    gchar buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r <= 0)
+            return 0;
+        for (gchar *p = buf; p < buf + r ;) {
+            struct inotify_event *ev = (struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                _fire_all(st);
+                continue;
+            }
+            if (!ev->len || ev->name[0] == '.')
+                continue;
+            g_mutex_lock(&st->lock);
+            gchar *dir = g_strdup(g_hash_table_lookup(st->wds,
+                        GINT_TO_POINTER(ev->wd)));
+            g_mutex_unlock(&st->lock);
+            if (dir)
+                _fire(st, dir, ev->name, ev->mask);
+            g_free(dir);
+        }
+    }
+}
+
+/* Deletes the dead ephemeral nodes of the directories whose children are
+ * watched, the deletions then fire the watches. */
+static void
+_on_reap(struct zstore_file_s *st)
+{
+    GPtrArray *dirs = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_lock(&st->lock);
+    for (guint i=0; i < st->watches->len ;++i) {
+        struct zwatch_s *w = st->watches->pdata[i];
+        if (!w->name)
+            g_ptr_array_add(dirs, g_strdup(w->dir));
+    }
+    g_mutex_unlock(&st->lock);
+
+    for (guint i=0; i < dirs->len ;++i) {
+        GPtrArray *names = _list(st, dirs->pdata[i]);
+        if (names)
+            g_ptr_array_free(names, TRUE);
+    }
+    g_ptr_array_free(dirs, TRUE);
+
+    zreactor_add_timer(st->zr, ZSTORE_REAP_PERIOD,
+            (zreactor_fn_timer)_on_reap, st);
+}
+
+//------------------------------------------------------------------------------
+
+#define ST(s) ((struct zstore_file_s*)(s))
+
+static void
+_file_destroy(struct zstore_s *s)
+{
+    struct zstore_file_s *st = ST(s);
+
+    // As a closed session, the ephemeral nodes go away
+    GHashTableIter it;
+    gpointer k, v;
+    g_hash_table_iter_init(&it, st->owned);
+    while (g_hash_table_iter_next(&it, &k, &v)) {
+        gchar *real = _real(st, k), *lock = _lock_path(st, k);
+        unlink(real);
+        unlink(lock);
+        close(GPOINTER_TO_INT(v));
+        g_free(real);
+        g_free(lock);
+    }
+    g_hash_table_destroy(st->owned);
+
+    for (guint i=0; i < st->watches->len ;++i) {
+        struct zwatch_s *w = st->watches->pdata[i];
+        g_free(w->dir);
+        g_free(w->name);
+        g_free(w);
+    }
+    g_ptr_array_free(st->watches, TRUE);
+    while (!g_queue_is_empty(st->early)) {
+        _zcall_free(g_queue_pop_head(st->early));
+    }
+    g_queue_free(st->early);
+    g_hash_table_destroy(st->wds);
+    g_hash_table_destroy(st->dirs);
+    close(st->ifd);
+    g_mutex_clear(&st->lock);
+    zstore_clear(&st->base);
+    g_free(st->basedir);
+    g_free(st);
+}
+
+static void
+_file_attach(struct zstore_s *s, struct zreactor_s *zr)
+{
+    struct zstore_file_s *st = ST(s);
+    ASSERT(st->zr == NULL);
+
+    st->ievt = ZMQ_POLLIN;
+    zreactor_add_fd(zr, st->ifd, &st->ievt, (zreactor_fn_fd)_on_inotify, st);
+    zreactor_add_timer(zr, ZSTORE_REAP_PERIOD,
+            (zreactor_fn_timer)_on_reap, st);
+
+    g_mutex_lock(&st->lock);
+    st->zr = zr;
+    GQueue *early = st->early;
+    st->early = g_queue_new();
+    g_mutex_unlock(&st->lock);
+
+    while (!g_queue_is_empty(early))
+        zreactor_post(zr, (zreactor_fn_task)_zcall_run, g_queue_pop_head(early));
+    g_queue_free(early);
+}
+
+static int
+_file_awget(struct zstore_s *s, const char *path, watcher_fn w, void *wctx,
+        data_completion_t dc, const void *u)
+{
+    struct zstore_file_s *st = ST(s);
+    if (!_path_valid(path))
+        return ZBADARGUMENTS;
+
+    struct zcall_s *c = _zcall(ZC_DATA, ZOK, u);
+    c->fn.data = dc;
+    gchar *real = _real(st, path);
+    if (g_file_test(real, G_FILE_TEST_IS_DIR))
+        c->buf = g_strdup("");
+    else if (!g_file_get_contents(real, &c->buf, &c->buflen, NULL))
+        c->rc = ZNONODE;
+    g_free(real);
+    c->stat.dataLength = c->buflen;
+
+    // As ZooKeeper, no watch on a missing node
+    if (w && c->rc == ZOK) {
+        g_mutex_lock(&st->lock);
+        _add_watch(st, path, FALSE, w, wctx);
+        g_mutex_unlock(&st->lock);
+    }
+    _defer(st, c);
+    return ZOK;
+}
+
+static int
+_file_awget_children(struct zstore_s *s, const char *path, watcher_fn w,
+        void *wctx, strings_completion_t sc, const void *u)
+{
+    struct zstore_file_s *st = ST(s);
+    if (!_path_valid(path))
+        return ZBADARGUMENTS;
+
+    // Lenient, the directory of a type is created by its first follower
+    gchar *real = _real(st, path);
+    g_mkdir_with_parents(real, 0755);
+    g_free(real);
+
+    // Watched first, not to miss a change between the listing and the watch
+    if (w) {
+        g_mutex_lock(&st->lock);
+        _add_watch(st, path, TRUE, w, wctx);
+        g_mutex_unlock(&st->lock);
+    }
+
+    struct zcall_s *c = _zcall(ZC_STRINGS, ZOK, u);
+    c->fn.strings = sc;
+    GPtrArray *names = _list(st, path);
+    if (!names)
+        c->rc = ZNONODE;
+    else {
+        c->sv.count = names->len;
+        c->sv.data = (char**) g_ptr_array_free(names, FALSE);
+    }
+    _defer(st, c);
+    return ZOK;
+}
+
+static int
+_file_awexists(struct zstore_s *s, const char *path, watcher_fn w,
+        void *wctx, stat_completion_t sc, const void *u)
+{
+    struct zstore_file_s *st = ST(s);
+    if (!_path_valid(path))
+        return ZBADARGUMENTS;
+
+    // Lenient, the parent is created to be watched
+    gchar *real = _real(st, path);
+    gchar *dir = g_path_get_dirname(real);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    // Watched first, not to miss a creation
+    if (w) {
+        g_mutex_lock(&st->lock);
+        _add_watch(st, path, FALSE, w, wctx);
+        g_mutex_unlock(&st->lock);
+    }
+
+    struct zcall_s *c = _zcall(ZC_STAT, ZOK, u);
+    c->fn.stat = sc;
+    if (!g_file_test(real, G_FILE_TEST_EXISTS))
+        c->rc = ZNONODE;
+    g_free(real);
+    _defer(st, c);
+    return ZOK;
+}
+
+static int
+_file_acreate(struct zstore_s *s, const char *path, const char *v, int vl,
+        int flags, string_completion_t sc, const void *u)
+{
+    struct zstore_file_s *st = ST(s);
+    if (!_path_valid(path))
+        return ZBADARGUMENTS;
+
+    gchar *node = (flags & ZOO_SEQUENCE)
+        ? g_strdup_printf("%s%d-%d", path, getpid(),
+                g_atomic_int_add(&st->seq, 1))
+        : g_strdup(path);
+    gchar *real = _real(st, node);
+    gchar *dir = g_path_get_dirname(real);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    int rc = ZOK, lfd = -1;
+    if (g_file_test(real, G_FILE_TEST_EXISTS))
+        rc = ZNODEEXISTS;
+    else if (flags & ZOO_EPHEMERAL) {
+        // Locked before the node appears, never seen dead
+        gchar *lock = _lock_path(st, node);
+        lfd = open(lock, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+        if (lfd < 0 || 0 > flock(lfd, LOCK_EX|LOCK_NB))
+            rc = ZSYSTEMERROR;
+        g_free(lock);
+    }
+    if (rc == ZOK)
+        rc = _write(st, node, v, vl, TRUE);
+
+    if (lfd >= 0) {
+        if (rc != ZOK)
+            close(lfd);
+        else {
+            g_mutex_lock(&st->lock);
+            g_hash_table_insert(st->owned, g_strdup(node),
+                    GINT_TO_POINTER(lfd));
+            g_mutex_unlock(&st->lock);
+        }
+    }
+    g_free(real);
+
+    struct zcall_s *c = _zcall(ZC_STRING, rc, u);
+    c->fn.string = sc;
+    c->buf = node;
+    _defer(st, c);
+    return ZOK;
+}
+
+static int
+_file_aset(struct zstore_s *s, const char *path, const char *v, int vl,
+        int version, stat_completion_t sc, const void *u)
+{
+    struct zstore_file_s *st = ST(s);
+    (void) version;
+    if (!_path_valid(path))
+        return ZBADARGUMENTS;
+
+    gchar *real = _real(st, path);
+    int rc = g_file_test(real, G_FILE_TEST_IS_REGULAR)
+        ? _write(st, path, v, vl, FALSE) : ZNONODE;
+    g_free(real);
+
+    struct zcall_s *c = _zcall(ZC_STAT, rc, u);
+    c->fn.stat = sc;
+    c->stat.dataLength = vl;
+    _defer(st, c);
+    return ZOK;
+}
+
+static int
+_file_adelete(struct zstore_s *s, const char *path, int version,
+        void_completion_t vc, const void *u)
+{
+    struct zstore_file_s *st = ST(s);
+    (void) version;
+    if (!_path_valid(path))
+        return ZBADARGUMENTS;
+
+    gchar *real = _real(st, path);
+    int rc = ZOK;
+    if (0 > remove(real))
+        rc = (errno == ENOENT) ? ZNONODE : ZSYSTEMERROR;
+    g_free(real);
+
+    gpointer k = NULL, v = NULL;
+    g_mutex_lock(&st->lock);
+    if (g_hash_table_lookup_extended(st->owned, path, &k, &v)) {
+        gchar *lock = _lock_path(st, path);
+        unlink(lock);
+        g_free(lock);
+        close(GPOINTER_TO_INT(v));
+        g_hash_table_remove(st->owned, path);
+    }
+    g_mutex_unlock(&st->lock);
+
+    if (vc) {
+        struct zcall_s *c = _zcall(ZC_VOID, rc, u);
+        c->fn.vd = vc;
+        _defer(st, c);
+    }
+    return ZOK;
+}
+
+static struct zstore_vtable_s vtable_file =
+{
+    _file_destroy, _file_attach,
+    _file_awget, _file_awget_children, _file_awexists, _file_acreate,
+    _file_aset, _file_adelete
+};
+
+struct zstore_s*
+zstore_open_file(const gchar *basedir)
+{
+    ASSERT(basedir != NULL);
+
+    if (0 > g_mkdir_with_parents(basedir, 0755)) {
+        g_warning("Discovery directory error [%s] : (%d) %s", basedir,
+                errno, g_strerror(errno));
+        return NULL;
+    }
+    int ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (ifd < 0) {
+        g_warning("inotify error : (%d) %s", errno, g_strerror(errno));
+        return NULL;
+    }
+
+    struct zstore_file_s *st = g_malloc0(sizeof(struct zstore_file_s));
+    zstore_init(&st->base, &vtable_file);
+    st->basedir = g_strdup(basedir);
+    g_mutex_init(&st->lock);
+    st->early = g_queue_new();
+    st->ifd = ifd;
+    st->wds = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+            g_free);
+    st->dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    st->watches = g_ptr_array_new();
+    st->owned = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    return &st->base;
+}
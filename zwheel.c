@@ -0,0 +1,253 @@
+#ifndef G_LOG_DOMAIN
+# define G_LOG_DOMAIN "zsock"
+#endif
+
+#include <glib.h>
+
+#include "./macros.h"
+#include "./zwheel.h"
+
+static inline void
+_list_init(struct ztimer_s *head)
+{
+    head->prev = head->next = head;
+}
+
+static inline gboolean
+_list_empty(struct ztimer_s *head)
+{
+    return head->next == head;
+}
+
+static inline void
+_list_unlink(struct ztimer_s *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = t;
+}
+
+static inline void
+_list_append(struct ztimer_s *head, struct ztimer_s *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* Moves the whole content of 'from' into the (empty) list 'to' */
+static inline void
+_list_steal(struct ztimer_s *from, struct ztimer_s *to)
+{
+    _list_init(to);
+    if (_list_empty(from))
+        return;
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    _list_init(from);
+}
+
+static void
+_zw_place(struct zwheel_s *w, struct ztimer_s *t)
+{
+    guint level, idx = 0;
+    gint64 e = MAX(t->expire, w->now);
+
+    for (level=0; level < ZW_LEVELS ;++level) {
+        guint shift = level * ZW_BITS;
+        if (((e >> shift) - (w->now >> shift)) < ZW_SLOTS) {
+            idx = (e >> shift) & ZW_MASK;
+            break;
+        }
+    }
+
+    if (level >= ZW_LEVELS) { // Too far, parked in the last slot reachable
+        level = ZW_LEVELS - 1;
+        idx = ((w->now >> (level * ZW_BITS)) + ZW_MASK) & ZW_MASK;
+    }
+
+    _list_append(&(w->slots[level][idx]), t);
+    w->bitmap[level] |= (G_GUINT64_CONSTANT(1) << idx);
+}
+
+/* Returns the first non-empty slot in [from,ZW_SLOTS[ */
+static gint
+_zw_first_slot(struct zwheel_s *w, guint level, guint from)
+{
+    if (from >= ZW_SLOTS)
+        return -1;
+
+    guint64 bits = w->bitmap[level] & (~G_GUINT64_CONSTANT(0) << from);
+    while (bits) {
+        gint idx = __builtin_ctzll(bits);
+        if (!_list_empty(&(w->slots[level][idx])))
+            return idx;
+        // cancelled since, the bit is cleared now
+        w->bitmap[level] &= ~(G_GUINT64_CONSTANT(1) << idx);
+        bits &= ~(G_GUINT64_CONSTANT(1) << idx);
+    }
+    return -1;
+}
+
+static void
+_zw_cascade(struct zwheel_s *w)
+{
+    for (guint level=1; level < ZW_LEVELS ;++level) {
+        struct ztimer_s tmp;
+        guint idx = (w->now >> (level * ZW_BITS)) & ZW_MASK;
+
+        _list_steal(&(w->slots[level][idx]), &tmp);
+        w->bitmap[level] &= ~(G_GUINT64_CONSTANT(1) << idx);
+        while (!_list_empty(&tmp)) {
+            struct ztimer_s *t = tmp.next;
+            _list_unlink(t);
+            _zw_place(w, t);
+        }
+
+        // The upper level only moves when this one wraps
+        if (idx != 0)
+            break;
+    }
+}
+
+static void
+_zw_fire_current(struct zwheel_s *w)
+{
+    struct ztimer_s tmp;
+    guint idx = w->now & ZW_MASK;
+
+    _list_steal(&(w->slots[0][idx]), &tmp);
+    w->bitmap[0] &= ~(G_GUINT64_CONSTANT(1) << idx);
+
+    // Timers armed by the callbacks must not land in the current slot
+    ++ w->now;
+
+    while (!_list_empty(&tmp)) {
+        struct ztimer_s *t = tmp.next;
+        zwheel_fn fn = t->fn;
+        gpointer u = t->u;
+        _list_unlink(t);
+        -- w->count;
+        g_free(t);
+        fn(u);
+    }
+}
+
+/* Next tick worth a look, without crossing a boundary of the level 0 */
+static inline gint64
+_zw_next_tick(struct zwheel_s *w)
+{
+    if (!(w->now & ZW_MASK))
+        return w->now;
+    gint idx = _zw_first_slot(w, 0, w->now & ZW_MASK);
+    if (idx >= 0)
+        return (w->now & ~((gint64)ZW_MASK)) + idx;
+    return (w->now | ZW_MASK) + 1;
+}
+
+struct zwheel_s*
+zwheel_create(gint64 now)
+{
+    struct zwheel_s *w = g_malloc0(sizeof(struct zwheel_s));
+    w->now = now;
+    for (guint l=0; l < ZW_LEVELS ;++l) {
+        for (guint i=0; i < ZW_SLOTS ;++i)
+            _list_init(&(w->slots[l][i]));
+    }
+    return w;
+}
+
+void
+zwheel_destroy(struct zwheel_s *w)
+{
+    if (!w)
+        return;
+    for (guint l=0; l < ZW_LEVELS ;++l) {
+        for (guint i=0; i < ZW_SLOTS ;++i) {
+            struct ztimer_s *head = &(w->slots[l][i]);
+            while (!_list_empty(head)) {
+                struct ztimer_s *t = head->next;
+                _list_unlink(t);
+                g_free(t);
+            }
+        }
+    }
+    g_free(w);
+}
+
+struct ztimer_s*
+zwheel_add(struct zwheel_s *w, gint64 expire, zwheel_fn fn, gpointer u)
+{
+    ASSERT(w != NULL);
+    ASSERT(fn != NULL);
+
+    struct ztimer_s *t = g_malloc0(sizeof(struct ztimer_s));
+    t->expire = expire;
+    t->fn = fn;
+    t->u = u;
+    _zw_place(w, t);
+    ++ w->count;
+    return t;
+}
+
+void
+zwheel_cancel(struct zwheel_s *w, struct ztimer_s *t)
+{
+    ASSERT(w != NULL);
+    if (!t)
+        return;
+    _list_unlink(t);
+    -- w->count;
+    g_free(t);
+}
+
+void
+zwheel_advance(struct zwheel_s *w, gint64 now)
+{
+    ASSERT(w != NULL);
+
+    while (w->now <= now) {
+        if (!w->count) {
+            w->now = now + 1;
+            return;
+        }
+        if (!(w->now & ZW_MASK))
+            _zw_cascade(w);
+        _zw_fire_current(w);
+        w->now = MIN(_zw_next_tick(w), now + 1);
+    }
+}
+
+gint64
+zwheel_next_expiry(struct zwheel_s *w)
+{
+    ASSERT(w != NULL);
+
+    if (!w->count)
+        return -1;
+
+    // Standing on a boundary, a cascade is pending
+    if (!(w->now & ZW_MASK))
+        return w->now;
+
+    for (guint level=0; level < ZW_LEVELS ;++level) {
+        guint shift = level * ZW_BITS;
+        guint cur = (w->now >> shift) & ZW_MASK;
+
+        // At the level 0, the current slot is still to be fired. Above, it
+        // has already been cascaded.
+        gint idx = _zw_first_slot(w, level, level ? cur+1 : cur);
+        if (idx >= 0)
+            return ((w->now >> shift) + (idx - cur)) << shift;
+
+        // Slots before the current one are for the next round, i.e. after
+        // the next boundary of the upper level.
+        if (_zw_first_slot(w, level, 0) >= 0)
+            return ((w->now >> (shift + ZW_BITS)) + 1) << (shift + ZW_BITS);
+    }
+
+    return w->now;
+}
@@ -0,0 +1,52 @@
+#ifndef TECHFORUM_zwheel_h
+# define TECHFORUM_zwheel_h 1
+# include <glib.h>
+
+/* Hierarchical timing wheel with a millisecond resolution. 4 levels of 64
+ * slots cover ~4.6 hours, further deadlines are parked in the last level and
+ * re-cascaded. Insertion and cancellation are O(1). */
+
+# define ZW_BITS 6
+# define ZW_SLOTS (1 << ZW_BITS)
+# define ZW_MASK (ZW_SLOTS - 1)
+# define ZW_LEVELS 4
+
+typedef void (*zwheel_fn) (void *u);
+
+struct ztimer_s
+{
+    struct ztimer_s *prev;
+    struct ztimer_s *next;
+    gint64 expire; // absolute, in ms
+    zwheel_fn fn;
+    gpointer u;
+};
+
+struct zwheel_s
+{
+    gint64 now; // next tick to be processed
+    guint count; // armed timers
+    guint64 bitmap[ZW_LEVELS]; // non-empty slots (a hint, cleared lazily)
+    struct ztimer_s slots[ZW_LEVELS][ZW_SLOTS]; // list heads
+};
+
+struct zwheel_s* zwheel_create(gint64 now);
+
+/* Pending timers are released without being fired */
+void zwheel_destroy(struct zwheel_s *w);
+
+/* The returned timer belongs to the wheel, it is released once fired. */
+struct ztimer_s* zwheel_add(struct zwheel_s *w, gint64 expire,
+        zwheel_fn fn, gpointer u);
+
+/* Must not be called on a timer already fired */
+void zwheel_cancel(struct zwheel_s *w, struct ztimer_s *t);
+
+/* Fire all the timers expired at 'now' */
+void zwheel_advance(struct zwheel_s *w, gint64 now);
+
+/* Absolute time of the next tick that needs to be processed, -1 when no timer
+ * is armed. It is a lower bound: no timer will expire before. */
+gint64 zwheel_next_expiry(struct zwheel_s *w);
+
+#endif // TECHFORUM_zwheel_h